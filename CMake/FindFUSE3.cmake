@@ -0,0 +1,29 @@
+# Find the libfuse 3 includes and library
+#
+#  FUSE3_INCLUDE_DIR - where to find fuse.h, etc.
+#  FUSE3_LIBRARIES   - List of libraries when using libfuse 3.
+#  FUSE3_FOUND       - True if libfuse 3 is found.
+
+# check if already in cache, be silent
+IF (FUSE3_INCLUDE_DIR)
+    SET (FUSE3_FIND_QUIETLY TRUE)
+ENDIF (FUSE3_INCLUDE_DIR)
+
+# find includes, which libfuse 3 installs in a fuse3 subdirectory
+FIND_PATH (FUSE3_INCLUDE_DIR fuse_lowlevel.h
+        PATHS /usr/local/include /usr/include
+        PATH_SUFFIXES fuse3
+        NO_DEFAULT_PATH
+        )
+
+# find lib
+FIND_LIBRARY(FUSE3_LIBRARIES
+        NAMES fuse3
+        PATHS /lib64 /lib /usr/lib64 /usr/lib /usr/local/lib64 /usr/local/lib /usr/lib/x86_64-linux-gnu
+        )
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("FUSE3" DEFAULT_MSG
+        FUSE3_INCLUDE_DIR FUSE3_LIBRARIES)
+
+mark_as_advanced (FUSE3_INCLUDE_DIR FUSE3_LIBRARIES)
@@ -0,0 +1,252 @@
+/*******************************************************************************************
+ *
+ * Alto page allocation policies
+ *
+ *******************************************************************************************/
+#include <algorithm>
+
+#include "allocator.h"
+
+// Needs a definition, since std::max() takes it by reference
+const page_t afs_allocator::first_page;
+
+/**
+ * @brief Nearest free page to the previous page
+ *
+ * This is the search alloc_page() always did, alternatingly looking at a
+ * page after and a page before the previous page. When a batch of more
+ * than one page starts, a contiguous run of free pages after the previous
+ * page is preferred.
+ */
+class afs_alloc_nearest : public afs_allocator
+{
+public:
+    afs_alloc_policy_t policy() const
+    {
+        return ALLOC_NEAREST;
+    }
+
+    page_t start(const afs_bitmap& map, page_t prev, page_t count) const
+    {
+        if (count > 1)
+        {
+            const page_t run = map.find_run(prev + 1, map.size(), count);
+            if (run >= 0)
+            {
+                return run;
+            }
+        }
+
+        return next(map, prev, count);
+    }
+
+    page_t next(const afs_bitmap& map, page_t prev, page_t count) const
+    {
+        (void)count;
+        return map.nearest_free(prev, first_page, map.size());
+    }
+};
+
+/**
+ * @brief First free extent from the start of the disk
+ *
+ * The first run of free pages which holds all pages, or else the first
+ * free page on the disk.
+ */
+class afs_alloc_first_fit : public afs_allocator
+{
+public:
+    afs_alloc_policy_t policy() const
+    {
+        return ALLOC_FIRST_FIT;
+    }
+
+    page_t next(const afs_bitmap& map, page_t prev, page_t count) const
+    {
+        if (!map.used(prev + 1))
+        {
+            return prev + 1;
+        }
+
+        const page_t run = map.find_run(first_page, map.size(), count);
+        if (run >= 0)
+        {
+            return run;
+        }
+
+        return map.next_free(first_page, map.size());
+    }
+};
+
+/**
+ * @brief Smallest free extent which holds all pages
+ *
+ * This leaves the large free extents for large files. If no extent holds
+ * all pages, the largest extent is used.
+ */
+class afs_alloc_best_fit : public afs_allocator
+{
+public:
+    afs_alloc_policy_t policy() const
+    {
+        return ALLOC_BEST_FIT;
+    }
+
+    page_t next(const afs_bitmap& map, page_t prev, page_t count) const
+    {
+        if (!map.used(prev + 1))
+        {
+            return prev + 1;
+        }
+
+        const page_t end = map.size();
+        page_t best = -1, best_size = 0;
+        page_t largest = -1, largest_size = 0;
+        page_t page = map.next_free(first_page, end);
+        while (page >= 0)
+        {
+            const page_t used = map.next_used(page, end);
+            const page_t size = (used < 0 ? end : used) - page;
+            if (size >= count && (best < 0 || size < best_size))
+            {
+                best = page;
+                best_size = size;
+                if (size == count)
+                {
+                    break;
+                }
+            }
+            if (size > largest_size)
+            {
+                largest = page;
+                largest_size = size;
+            }
+            page = used < 0 ? -1 : map.next_free(used + 1, end);
+        }
+
+        return best >= 0 ? best : largest;
+    }
+};
+
+/**
+ * @brief Keep a file within one cylinder
+ *
+ * The pages of one cylinder (NHEADS * NSECS pages) can be read without
+ * seeking. A file is continued in the cylinder of the previous page while
+ * it has free pages, then in the nearest cylinder with room for the rest
+ * of the file (at most a full cylinder).
+ */
+class afs_alloc_cylinder : public afs_allocator
+{
+public:
+    afs_alloc_policy_t policy() const
+    {
+        return ALLOC_CYLINDER;
+    }
+
+    page_t next(const afs_bitmap& map, page_t prev, page_t count) const
+    {
+        const page_t cylsize = NHEADS * NSECS;
+        const page_t ncyls = (map.size() + cylsize - 1) / cylsize;
+        const page_t cyl = prev / cylsize;
+
+        // The rest of the cylinder of the previous page
+        page_t page = map.nearest_free(prev, std::max(first_page, cyl * cylsize), (cyl + 1) * cylsize);
+        if (page >= 0)
+        {
+            return page;
+        }
+
+        // The nearest cylinder with room for the rest of the file
+        const page_t need = std::min(count, cylsize);
+        for (page_t dist = 1; dist < ncyls; dist++)
+        {
+            if (cyl + dist < ncyls && map.count_free((cyl + dist) * cylsize, (cyl + dist + 1) * cylsize) >= need)
+            {
+                return map.next_free((cyl + dist) * cylsize, (cyl + dist + 1) * cylsize);
+            }
+            if (cyl - dist >= 0 && map.count_free(std::max(first_page, (cyl - dist) * cylsize), (cyl - dist + 1) * cylsize) >= need)
+            {
+                return map.next_free(std::max(first_page, (cyl - dist) * cylsize), (cyl - dist + 1) * cylsize);
+            }
+        }
+
+        return map.nearest_free(prev, first_page, map.size());
+    }
+};
+
+afs_allocator::~afs_allocator()
+{
+}
+
+/**
+ * @brief Pick the first page of a batch
+ * @param map free page bitmap
+ * @param prev previous page of the chain
+ * @param count number of pages in the batch
+ * @return the page to allocate, or -1 if there is no free page
+ */
+page_t afs_allocator::start(const afs_bitmap& map, page_t prev, page_t count) const
+{
+    return next(map, prev, count);
+}
+
+/**
+ * @brief Create the allocator for a policy
+ * @param policy allocation policy
+ * @return pointer to the new allocator, to be deleted by the caller
+ */
+afs_allocator* afs_allocator::create(afs_alloc_policy_t policy)
+{
+    switch (policy)
+    {
+        case ALLOC_FIRST_FIT:
+            return new afs_alloc_first_fit();
+        case ALLOC_BEST_FIT:
+            return new afs_alloc_best_fit();
+        case ALLOC_CYLINDER:
+            return new afs_alloc_cylinder();
+        default:
+            return new afs_alloc_nearest();
+    }
+}
+
+/**
+ * @brief Get the policy for a name
+ * @param name name of the policy (see name())
+ * @return allocation policy, or ALLOC_POLICIES if the name is unknown
+ */
+afs_alloc_policy_t afs_allocator::from_name(std::string name)
+{
+    for (int policy = 0; policy < ALLOC_POLICIES; policy++)
+    {
+        if (name == afs_allocator::name((afs_alloc_policy_t)policy))
+        {
+            return (afs_alloc_policy_t)policy;
+        }
+    }
+
+    return ALLOC_POLICIES;
+}
+
+/**
+ * @brief Get the name of a policy
+ * @param policy allocation policy
+ * @return name of the policy
+ */
+const char* afs_allocator::name(afs_alloc_policy_t policy)
+{
+    switch (policy)
+    {
+        case ALLOC_NEAREST:
+            return "nearest";
+        case ALLOC_FIRST_FIT:
+            return "first";
+        case ALLOC_BEST_FIT:
+            return "best";
+        case ALLOC_CYLINDER:
+            return "cylinder";
+        default:
+            return "unknown";
+    }
+}
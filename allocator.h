@@ -0,0 +1,52 @@
+/*******************************************************************************************
+ *
+ * Alto page allocation policies
+ *
+ *******************************************************************************************/
+#if !defined(_ALLOCATOR_H_)
+#define _ALLOCATOR_H_
+
+#include "afs_types.h"
+#include "bitmap.h"
+
+/**
+ * @brief Page allocation policies
+ */
+typedef enum {
+    ALLOC_NEAREST,                          //!< Nearest free page to the previous page (default)
+    ALLOC_FIRST_FIT,                        //!< First free extent from the start of the disk
+    ALLOC_BEST_FIT,                         //!< Smallest free extent which holds all pages
+    ALLOC_CYLINDER,                         //!< Keep a file within one cylinder
+    ALLOC_POLICIES                          //!< Number of policies
+}   afs_alloc_policy_t;
+
+/**
+ * @brief Interface of a page allocation policy
+ *
+ * A policy picks the next page to append to a page chain, given the
+ * free page bitmap, the previous page of the chain and the number of
+ * pages still to be allocated. start() picks the first page of a batch
+ * and next() the following ones. All policies continue a chain with the
+ * page right after the previous one while it is free (the cylinder
+ * policy only within the cylinder), so that files end up contiguous.
+ *
+ * The policy only picks a page; marking it as used is up to the caller.
+ */
+class afs_allocator
+{
+public:
+    virtual ~afs_allocator();
+
+    virtual afs_alloc_policy_t policy() const = 0;
+    virtual page_t start(const afs_bitmap& map, page_t prev, page_t count) const;
+    virtual page_t next(const afs_bitmap& map, page_t prev, page_t count) const = 0;
+
+    static afs_allocator* create(afs_alloc_policy_t policy);
+    static afs_alloc_policy_t from_name(std::string name);
+    static const char* name(afs_alloc_policy_t policy);
+
+protected:
+    static const page_t first_page = 2;     //!< Pages below are never searched downwards to
+};
+
+#endif // !defined(_ALLOCATOR_H_)
@@ -11,22 +11,54 @@
 
 #define FIX_FREE_PAGE_BITS   0 //!< Set to 1 to fix pages marked as free in the bit_table
 #define SWAP_GETPUT_WORD     msb()
+#define JOURNAL_MAX_SIZE     (4*1024*1024) //!< Journal size which triggers a checkpoint
 
 AltoFS::AltoFS() :
     m_little(),
     m_kdh(),
     m_bit_count(0),
     m_bit_table(),
+    m_free_map(),
     m_disk_descriptor_dirty(false),
     m_sysdir(),
     m_sysdir_dirty(false),
     m_files(),
     m_disk(),
+    m_null_page(),
+    m_journal(),
     m_doubledisk(false),
     m_dp0name(),
     m_dp1name(),
     m_verbose(0),
-    m_root_dir(0)
+    m_root_dir(0),
+    m_files_by_vda(),
+    m_open_count(),
+    m_generation(),
+    m_orphans(),
+    m_disk_descriptor_vda(-1),
+    m_delayed_pages(0),
+    m_check(false),
+    m_rebuild(false),
+    m_inplace(false),
+    m_overlay(false),
+    m_verified(false),
+    m_lazy(false),
+    m_lock(),
+    m_reader_mutex(),
+    m_atime_pages(),
+    m_alloc_mutex(),
+    m_snapshot(),
+    m_snapshot_mutex(),
+    m_snapshot_version(0),
+    m_writeback(),
+    m_writeback_mutex(),
+    m_writeback_cv(),
+    m_writeback_stop(false),
+    m_writeback_kick(false),
+    m_flush_interval(0),
+    m_dirty_max(0),
+    m_save_codec(-1),
+    m_allocator(afs_allocator::create(ALLOC_NEAREST))
 {
     /**
      * The union's little.e is initialized to 1
@@ -36,23 +68,52 @@ AltoFS::AltoFS() :
     m_little.e = 1;
 }
 
-AltoFS::AltoFS(const char* filename, int verbosity, bool check, bool rebuild) :
+AltoFS::AltoFS(const char* filename, int verbosity, bool check, bool rebuild, bool inplace, bool overlay) :
     m_little(),
     m_kdh(),
     m_bit_count(0),
     m_bit_table(),
+    m_free_map(),
     m_disk_descriptor_dirty(false),
     m_sysdir(),
     m_sysdir_dirty(false),
     m_files(),
     m_disk(),
+    m_null_page(),
+    m_journal(),
     m_doubledisk(false),
     m_dp0name(),
     m_dp1name(),
     m_verbose(verbosity),
     m_root_dir(0),
+    m_files_by_vda(),
+    m_open_count(),
+    m_generation(),
+    m_orphans(),
+    m_disk_descriptor_vda(-1),
+    m_delayed_pages(0),
  	m_check(check),
- 	m_rebuild(rebuild)
+ 	m_rebuild(rebuild),
+    m_inplace(inplace),
+    m_overlay(overlay && !inplace),
+    m_verified(false),
+    m_lazy(false),
+    m_lock(),
+    m_reader_mutex(),
+    m_atime_pages(),
+    m_alloc_mutex(),
+    m_snapshot(),
+    m_snapshot_mutex(),
+    m_snapshot_version(0),
+    m_writeback(),
+    m_writeback_mutex(),
+    m_writeback_cv(),
+    m_writeback_stop(false),
+    m_writeback_kick(false),
+    m_flush_interval(0),
+    m_dirty_max(0),
+    m_save_codec(-1),
+    m_allocator(afs_allocator::create(ALLOC_NEAREST))
 {
     /**
      * The union's little.e is initialized to 1
@@ -62,38 +123,60 @@ AltoFS::AltoFS(const char* filename, int verbosity, bool check, bool rebuild) :
     m_little.e = 1;
 	
     read_disk_file(filename);
+    m_lazy = m_disk[0].lazy() || m_disk[1].lazy();
+
+    if (m_inplace)
+	{
+        replay_journal();
+	}
+
+    if (!m_check)
+	{
+        m_verified = verify_disk_file();
+	}
 	
     // verify_headers(); // Doesn't seem to be really necessary
 	
+    // The file info nodes are the leader page index used by find_file()
+    make_fileinfo();
+	
     if (!validate_disk_descriptor())
 	{
         fix_disk_descriptor();
 	}
 	
-    make_fileinfo();
-	
     read_sysdir();
+    publish_dir();
 }
 
 AltoFS::~AltoFS()
 {
-    if (m_disk_descriptor_dirty)
-	{
-        int res = save_disk_descriptor();
-        my_assert(res >= 0, "%s: Could not save the SysDir array.\n", __func__);
-    }
+    stop_writeback();
 	
-    if (m_sysdir_dirty)
-	{
-        int res = save_sysdir();
-        my_assert(res >= 0, "%s: Could not save the SysDir array.\n", __func__);
+    {
+        // Files unlinked while open go now, unless the kernel released them
+        std::lock_guard<afs_rwlock> lock(m_lock);
+        while (!m_orphans.empty())
+		{
+            free_file(m_orphans.back());
+            m_orphans.pop_back();
+		}
     }
-	
-    save_disk_file();
+    commit(false);
+
+    if (m_journal.active() && checkpoint())
+	{
+        // Everything is in the image, so the journal is no longer needed
+        m_journal.close(true);
+	}
+
+    seal_disk_file();
 	
     delete m_root_dir;
 	
     m_root_dir = 0;
+
+    delete m_allocator;
 }
 
 void AltoFS::log(int verbosity, const char* format, ...)
@@ -136,7 +219,7 @@ void AltoFS::setVerbosity(int verbosity)
  */
 afs_leader_t* AltoFS::page_leader(page_t vda)
 {
-    afs_leader_t* lp = (afs_leader_t*)&m_disk[vda].data[0];
+    afs_leader_t* lp = (afs_leader_t*)&disk_page(vda)->data[0];
 
 #if defined(DEBUG)
     if (m_verbose > 3 && lp->proplength > 0)
@@ -198,7 +281,56 @@ afs_label_t* AltoFS::page_label(page_t vda)
 		return nullptr;
 	}
 	
-    return (afs_label_t *)&m_disk[vda].label[0];
+    return (afs_label_t *)&disk_page(vda)->label[0];
+}
+
+/**
+ * @brief Return a pointer to the afs_page_t for page vda.
+ * Pages 0 to NPAGES-1 are on dp0, pages NPAGES to 2*NPAGES-1 on dp1.
+ * @param vda page number
+ * @return pointer to afs_page_t, or to a zeroed page if vda is not on a mounted disk
+ */
+afs_page_t* AltoFS::disk_page(page_t vda)
+{
+    const int disk = vda < NPAGES ? 0 : 1;
+    afs_page_t* page = m_disk[disk].page(vda - disk * NPAGES);
+    if (!my_assert(page != NULL, "%s: page %ld is not on a mounted disk\n", __func__, vda))
+    {
+        memset(&m_null_page, 0, sizeof(m_null_page));
+        return &m_null_page;
+    }
+
+    return page;
+}
+
+/**
+ * @brief Mark the page vda as changed, so that it is written back.
+ * @param vda page number
+ */
+void AltoFS::mark_dirty(page_t vda)
+{
+    const int disk = vda < NPAGES ? 0 : 1;
+    m_disk[disk].set_dirty(vda - disk * NPAGES);
+
+    if (m_dirty_max > 0 && m_disk[0].dirty_count() + m_disk[1].dirty_count() >= m_dirty_max)
+	{
+        std::lock_guard<std::mutex> lock(m_writeback_mutex);
+        if (!m_writeback_kick)
+		{
+            m_writeback_kick = true;
+            m_writeback_cv.notify_one();
+        }
+    }
+}
+
+/**
+ * @brief Return the milliseconds elapsed since a start time
+ * @param start time point to measure from
+ * @return elapsed time in milliseconds
+ */
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 /**
@@ -228,30 +360,31 @@ int AltoFS::read_disk_file(std::string name)
 		printf("Mounting single disk image: %s\n", m_dp0name.c_str());
     }
 
-    m_disk.resize(2 * NPAGES);
-    my_assert_or_die(m_disk.data() != NULL, "%s: disk resize(%d) failed", __func__, 2 * NPAGES);
-
-    int ok = read_single_disk(m_dp0name, &m_disk[0]);
-    if (ok && m_doubledisk)
+    const char* func = __func__;
+    bool ok = for_each_disk([this, func](std::string name, afs_diskimage* disk)
 	{
-        ok = read_single_disk(m_dp1name, &m_disk[NPAGES]);
-    }
+        auto start = std::chrono::steady_clock::now();
+        bool ok = read_single_disk(name, disk) && (!m_overlay || attach_overlay(name, disk));
+        log(1, "%s: Loaded '%s' in %.1f ms\n", func, name.c_str(), elapsed_ms(start));
+        return ok;
+    });
 	
     return ok ? 0 : -ENOENT;
 }
 
 /**
- * @brief Read a single file to the in-memory disk space
+ * @brief Map a single file, or read it to the in-memory disk space
+ *
+ * Uncompressed images are memory mapped, so only the pages which
+ * are actually accessed are read from the file. Compressed images
+ * (.Z, .gz or .zst) are decoded into an anonymous mapping.
+ *
  * @param name file name
- * @param diskp pointer to the starting disk page
+ * @param disk pointer to the disk image page storage
  * @return true on success, or false on error
  */
-bool AltoFS::read_single_disk(std::string name, afs_page_t* diskp)
+bool AltoFS::read_single_disk(std::string name, afs_diskimage* disk)
 {
-    FILE *infile;
-    bool ok = true;
-    bool use_pclose = false;
-
 	if(m_check)
 	{
 // TODO: Implement disk validity check here
@@ -262,242 +395,657 @@ bool AltoFS::read_single_disk(std::string name, afs_page_t* diskp)
 // TODO: Implement disk rebuild here
 	}
 	
-    log(2, "%s: Reading disk image '%s'\n", __func__, name.c_str());
-    // We conclude the disk image is compressed if the name ends with .Z
-    int pos = (int)name.find(".Z");
-    if (pos > 0)
+    afs_codec_t codec = afs_codec::from_name(name);
+    if (codec == CODEC_FRAMES)
 	{
-        char* cmd = new char[name.size() + 10];
-        sprintf(cmd, "zcat %s", name.c_str());
-        infile = popen(cmd, "r");
-        my_assert_or_die(infile != NULL, "%s: popen failed on %s\n", __func__, cmd);
-        delete[] cmd;
-        use_pclose = true;
-    }
-	else
-	{
-        infile = fopen (name.c_str(), "rb");
-        my_assert_or_die(infile != NULL, "%s: fopen failed on %s\n", __func__, name.c_str());
+        if (m_inplace)
+		{
+            printf("Disk image %s can't be written in-place\n", name.c_str());
+		}
+		
+        bool ok = disk->open_frames(name);
+        log(2, "%s: Opened seekable disk image '%s' (%s)\n", __func__, name.c_str(), ok ? "ok" : strerror(errno));
+        return my_assert(ok, "%s: Opening %s failed (%s)\n", __func__, name.c_str(), strerror(errno));
     }
 
-    char *dp = reinterpret_cast<char *>(diskp);
-    size_t total = NPAGES * PAGESZ;
-    size_t totalbytes = 0;
-    while (totalbytes < total)
+    if (codec == CODEC_NONE)
 	{
-        size_t bytes = fread(dp, sizeof (char), total - totalbytes, infile);
-        dp += bytes;
-        totalbytes += bytes;
-		
-        ok = my_assert(!ferror(infile) && !feof(infile), "%s: Disk read failed: %d bytes read instead of %d\n", __func__, totalbytes, total);
-        if (!ok)
+        if (disk->map(name, m_inplace))
 		{
-            break;
-		}
+            log(2, "%s: Mapped disk image '%s' (%s)\n", __func__, name.c_str(), m_inplace ? "in-place" : "copy-on-write");
+            return true;
+        }
+
+        log(2, "%s: Could not map disk image '%s' (%s)\n", __func__, name.c_str(), strerror(errno));
     }
-	
-    if (use_pclose)
-	{
-        pclose(infile);
-	}
-    else
+
+    if (m_inplace)
 	{
-        fclose(infile);
-	}
+        printf("Disk image %s can't be written in-place\n", name.c_str());
+    }
+
+    my_assert_or_die(afs_codec::supported(codec), "%s: Compressed disk image %s is not supported by this build\n", __func__, name.c_str());
+    my_assert_or_die(disk->allocate(), "%s: Allocating pages for %s failed\n", __func__, name.c_str());
+
+    log(2, "%s: Reading disk image '%s'\n", __func__, name.c_str());
+    int fd = ::open(name.c_str(), O_RDONLY);
+    my_assert_or_die(fd >= 0, "%s: open failed on %s\n", __func__, name.c_str());
+
+    size_t total = disk->size();
+    size_t totalbytes = 0;
+    bool ok = afs_codec::decode(codec, fd, disk->data(), total, &totalbytes);
+    ::close(fd);
+
+    ok = my_assert(ok, "%s: Decoding %s failed (%s)\n", __func__, name.c_str(), strerror(errno)) &&
+         my_assert(totalbytes == total, "%s: Disk read failed: %d bytes read instead of %d\n", __func__, totalbytes, total);
 	
     return ok;
 }
 
 /**
- * @brief Save the in-memory disk image(s) to a file (or two files)
- * @return 0 on success,
+ * @brief Attach the overlay delta file name.delta to a disk image
+ * @param name file name of the disk image
+ * @param disk pointer to the disk image page storage
+ * @return true on success, or false on error
  */
-int AltoFS::save_disk_file()
+bool AltoFS::attach_overlay(std::string name, afs_diskimage* disk)
 {
-    bool res = save_single_disk(m_dp0name, &m_disk[0]);
-    if (res && m_doubledisk)
-	{
-        res = save_single_disk(m_dp1name, &m_disk[NPAGES]);
-	}
+    name += ".delta";
+    bool ok = disk->attach_delta(name);
+    log(1, "%s: Overlay '%s' (%s)\n", __func__, name.c_str(), ok ? "ok" : strerror(errno));
 	
-    return res;
+    return my_assert(ok, "%s: Could not use overlay %s (%s)\n", __func__, name.c_str(), strerror(errno));
 }
 
 /**
- * @brief Save a single disk image to a file
- * @param name name of the image file
- * @param diskp pointer to disk data
+ * @brief Save the in-memory disk image(s) to a file (or two files)
  * @return true on success, or false on error
  */
-bool AltoFS::save_single_disk(std::string name, afs_page_t* diskp)
+int AltoFS::save_disk_file()
 {
-    FILE *outfile;
-    bool ok = true;
+    return for_each_disk([this](std::string name, afs_diskimage* disk)
+	{
+        return save_single_disk(name, disk);
+    });
+}
 
-    // We conclude the disk image is compressed if the name ends with .Z
-    int pos = (int)name.find(".Z");
-    if (pos > 0)
+/**
+ * @brief Call a function for dp0 and, if mounted, for dp1
+ *
+ * The two disks of a double disk mount don't share any pages,
+ * so dp1 is handled by a second thread while dp0 is handled
+ * by the calling thread.
+ *
+ * @param func function to call with the file name and pages of a disk
+ * @return true, if the function returned true for all disks
+ */
+bool AltoFS::for_each_disk(std::function<bool(std::string, afs_diskimage*)> func)
+{
+    if (!m_doubledisk)
 	{
-        // Remove the .Z~ or .Z extension, as we will save uncompressed
-        name.erase(pos);
+        return func(m_dp0name, &m_disk[0]);
 	}
-	
-    // For now always write backup files
-    name += "~";
-    log(1, "%s: Writing disk image '%s'\n", __func__, name.c_str());
-
-    outfile = fopen (name.c_str(), "wb");
-    my_assert_or_die(outfile != NULL, "%s: fopen failed on Alto disk image file %s\n", __func__, name.c_str());
 
-    char *dp = reinterpret_cast<char *>(diskp);
-	
-    size_t total = NPAGES * PAGESZ;
-    size_t totalbytes = 0;
-    while (totalbytes < total)
+    bool res1 = false;
+    std::thread dp1([&]()
 	{
-        size_t bytes = fwrite(dp, sizeof (char), total - totalbytes, outfile);
-        dp += bytes;
-        totalbytes += bytes;
-		
-        ok = my_assert(!ferror(outfile), "%s: Disk write failed: %d bytes written instead of %d\n", __func__, totalbytes, total);
-        if (!ok)
-		{
-            break;
-		}
-    }
-	
-    fclose(outfile);
+        res1 = func(m_dp1name, &m_disk[1]);
+    });
+    bool res0 = func(m_dp0name, &m_disk[0]);
+    dp1.join();
 	
-    return ok;
+    return res0 && res1;
 }
 
 /**
- * @brief Dump a memory block as words and ASCII data
- * @param data pointer to data to dump
- * @param nbytes number of bytes to dump
+ * @brief Flush the saved disk image file(s) to stable storage
+ * @return true on success, or false on error
  */
-void AltoFS::dump_memory(char* data, size_t nbytes)
+bool AltoFS::sync_disk_file()
 {
-    const size_t nwords = nbytes / 2;
-    char str[17];
-
-    for (size_t row = 0; row < (nwords+7)/8; row++)
+    bool res = my_assert(m_disk[0].sync(), "%s: Syncing disk image %s failed (%s)\n", __func__, m_dp0name.c_str(), strerror(errno));
+    if (res && m_doubledisk)
 	{
-        log(3, "%04lx:", row * 8);
-        for (size_t col = 0; col < 8; col++)
-		{
-            size_t offs = row * 8 + col;
-            if (offs < nwords)
-			{
-                unsigned char h = data[(2*offs+0) ^ lsb()];
-                unsigned char l = data[(2*offs+1) ^ lsb()];
-                log(3, " %02x%02x", h, l);
-            }
-			else
-			{
-                log(3, "     ");
-            }
-        }
-
-        for (size_t col = 0; col < 8; col++)
-		{
-            size_t offs = row * 8 + col;
-            if (offs < nwords)
-			{
-                unsigned char h = data[(2*offs+0) ^ lsb()];
-                unsigned char l = data[(2*offs+1) ^ lsb()];
-                str[(col * 2) + 0] = (isprint(h)) ? h : '.';
-                str[(col * 2) + 1] = (isprint(l)) ? l : '.';
-            }
-			else
-			{
-                str[(col * 2) + 0] = ' ';
-                str[(col * 2) + 1] = ' ';
-            }
-        }
-		
-        str[16] = '\0';
-        log(3, "  %16s\n", str);
-    }
+        res = my_assert(m_disk[1].sync(), "%s: Syncing disk image %s failed (%s)\n", __func__, m_dp1name.c_str(), strerror(errno));
+	}
+	
+    return res;
 }
 
 /**
- * @brief Dump a disk block as words and ASCII data
- * @param pageno page number
+ * @brief Check if the disk image(s) are unchanged since fuse-alto wrote them
+ *
+ * The pages are compared with the CRC-32C stored in name.crc when the
+ * file was last saved or unmounted.
+ *
+ * @return true, if the checksum files of all disks match
  */
-void AltoFS::dump_disk_block(page_t pageno)
+bool AltoFS::verify_disk_file()
 {
-    char page[PAGESZ];
-    read_page(pageno, page);
-    dump_memory(page, PAGESZ);
+    const char* func = __func__;
+    return for_each_disk([this, func](std::string name, afs_diskimage* disk)
+	{
+        auto start = std::chrono::steady_clock::now();
+        bool ok = disk->verify(name);
+        log(1, "%s: Checksum of '%s' %s (%.1f ms)\n", func, name.c_str(), ok ? "matches" : "not verified", elapsed_ms(start));
+        return ok;
+    });
 }
 
 /**
- * @brief Dump the contents of a leader page
- * @param lp pointer to afs_leader_t
+ * @brief Write the checksum files for the saved disk image file(s)
+ * @return true on success, or false on error
  */
-void AltoFS::dump_leader(afs_leader_t* lp)
+bool AltoFS::seal_disk_file()
 {
-    log(2, "%s: created                    : %s\n", __func__, altotime_to_str(lp->created).c_str());
-    log(2, "%s: written                    : %s\n", __func__, altotime_to_str(lp->written).c_str());
-    log(2, "%s: read                       : %s\n", __func__, altotime_to_str(lp->read).c_str());
-    log(2, "%s: filename                   : %s\n", __func__, filename_to_string(lp->filename).c_str());
-    log(2, "%s: leader_props[]             : ...\n", __func__);
-    log(2, "%s: spare[]                    : ...\n", __func__);
-    log(2, "%s: proplength                 : %u\n", __func__, lp->proplength);
-    log(2, "%s: propbegin                  : %u\n", __func__, lp->propbegin);
-    log(2, "%s: change_SN                  : %u\n", __func__, lp->change_SN);
-    log(2, "%s: consecutive                : %u\n", __func__, lp->consecutive);
-    log(2, "%s: dir_fp_hint.fid_dir        : %#x\n", __func__, lp->dir_fp_hint.fid_dir);
-    log(2, "%s: dir_fp_hint.serialno       : %#x\n", __func__, lp->dir_fp_hint.serialno);
-    log(2, "%s: dir_fp_hint.version        : %u\n", __func__, lp->dir_fp_hint.version);
-    log(2, "%s: dir_fp_hint.blank          : %u\n", __func__, lp->dir_fp_hint.blank);
-    log(2, "%s: dir_fp_hint.leader_vda     : %u\n", __func__, lp->dir_fp_hint.leader_vda);
-    log(2, "%s: last_page_hint.vda         : %u\n", __func__, lp->last_page_hint.vda);
-    log(2, "%s: last_page_hint.filepage    : %u\n", __func__, lp->last_page_hint.filepage);
-    log(2, "%s: last_page_hint.char_pos    : %u\n", __func__, lp->last_page_hint.char_pos);
+    const char* func = __func__;
+    return for_each_disk([this, func](std::string name, afs_diskimage* disk)
+	{
+        return my_assert(disk->seal(), "%s: Writing the checksum for %s failed (%s)\n", func, name.c_str(), strerror(errno));
+    });
 }
 
 /**
- * @brief Return the length of a file by scanning its pages
- * @param leader_page_vda page number of the leader page
- * @return size in bytes
+ * @brief Check if closing a file leaves anything for commit() to do
+ *
+ * Only the shared lock is taken, so that closing a file which was
+ * just read doesn't wait for writers of other files, and doesn't make
+ * them wait. Other files' buffered bytes are left to their own close.
+ *
+ * @param leader_page_vda page number of the leader page of the file
+ * @return true, if the file has buffered bytes, or SysDir, the
+ *  DiskDescriptor or any page changed since the last commit
  */
-size_t AltoFS::file_length(page_t leader_page_vda)
+bool AltoFS::dirty(page_t leader_page_vda)
 {
-    size_t length = 0;
+    afs_read_lock lock(m_lock);
+    if (m_sysdir_dirty || m_disk[0].dirty_count() > 0 || m_disk[1].dirty_count() > 0)
+	{
+        return true;
+	}
 	
-	page_t page = leader_page_vda;
-    while (page != 0)
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (info)
 	{
-        afs_label_t* l = page_label(page);
-        if (l->filepage > 0)
+        afs_read_lock file_lock(info->lock());
+        if (!info->delayed().empty())
 		{
-            length += l->nbytes;
+            return true;
 		}
-		
-        if (l->nbytes < PAGESZ)
+	}
+	
+    std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+    return m_disk_descriptor_dirty;
+}
+
+/**
+ * @brief Commit all pending changes to the disk image file(s)
+ *
+ * The SysDir entries are written first, because writing them can
+ * allocate pages, then the DiskDescriptor with the bit table. After
+ * that all dirty pages are written in one batch, ordered by page number,
+ * along with the leader pages of files which were only read.
+ * Waiting for stable storage is done without holding the lock.
+ *
+ * @param durable if true, also flush the file(s) to stable storage
+ * @return 0 on success, or -EIO on error
+ */
+int AltoFS::commit(bool durable)
+{
+    std::unique_lock<afs_rwlock> lock(m_lock);
+    for (std::set<page_t>::const_iterator it = m_atime_pages.begin(); it != m_atime_pages.end(); ++it)
+	{
+        mark_dirty(*it);
+	}
+    m_atime_pages.clear();
+	
+    int res = flush_delayed();
+
+    if (m_sysdir_dirty)
+	{
+        int sdres = save_sysdir();
+        my_assert(sdres >= 0, "%s: Could not save the SysDir array.\n", __func__);
+        res = res < 0 ? res : sdres;
+    }
+	
+    if (m_disk_descriptor_dirty)
+	{
+        int ddres = save_disk_descriptor();
+        my_assert(ddres >= 0, "%s: Could not save the DiskDescriptor.\n", __func__);
+        res = res < 0 ? res : ddres;
+    }
+
+    if (m_journal.active())
+	{
+        // The pages must not reach the image before they are in the journal
+        if (journal_dirty_pages() < 0)
 		{
-            break;
+            return -EIO;
 		}
 		
-        page = rda_to_vda(l->next_rda);
+        // The journal record is durable, so the image needs no sync
+        durable = false;
     }
 	
-    return length;
+    if (!save_disk_file())
+	{
+        res = -EIO;
+	}
+
+    if (res == 0 && m_journal.size() > JOURNAL_MAX_SIZE && !checkpoint())
+	{
+        res = -EIO;
+	}
+
+    lock.unlock();
+
+    if (res == 0 && durable && !sync_disk_file())
+	{
+        res = -EIO;
+	}
+	
+    return res < 0 ? -EIO : 0;
 }
 
 /**
- * @brief Convert a raw disk address to a virtual disk address.
- * @param rda raw disk address (from the image)
- * @return virtual disk address (think LBA)
+ * @brief Open the journal of in-place disk images and replay it
+ *
+ * The page images of all complete journal records are copied to
+ * the pages, written to the image file(s) and synced, after which
+ * the journal is emptied. This brings the image(s) to the state of
+ * the last commit before a crash.
+ *
+ * @return 0 on success, or -EIO on error
  */
-page_t AltoFS::rda_to_vda(word rda)
+int AltoFS::replay_journal()
 {
-    const word dp1flag = (rda >> 1) & 1;
-    const word head = (rda >> 2) & 1;
-    const word cylinder = (rda >> 3) & 0x1ff;
-    const word sector = (rda >> 12) & 0xf;
+    if (!m_disk[0].inplace() || (m_doubledisk && !m_disk[1].inplace()))
+	{
+        return 0;
+	}
+	
+    std::string name = m_dp0name + ".journal";
+    if (!my_assert(m_journal.open(name), "%s: Could not open journal %s (%s)\n", __func__, name.c_str(), strerror(errno)))
+	{
+        return -EIO;
+	}
+	
+    const page_t npages = m_doubledisk ? NPAGES * 2 : NPAGES;
+    size_t pages = m_journal.replay(npages, [this](page_t vda, const afs_page_t* page)
+	{
+        *disk_page(vda) = *page;
+        mark_dirty(vda);
+    });
+
+    if (pages == 0)
+	{
+        return 0;
+	}
+	
+    printf("Replaying %lu pages from journal %s\n", pages, name.c_str());
+
+    if (!save_disk_file() || !checkpoint())
+	{
+        return -EIO;
+	}
+	
+    return 0;
+}
+
+/**
+ * @brief Append all dirty pages to the journal as one record
+ * @return 0 on success, or -EIO on error
+ */
+int AltoFS::journal_dirty_pages()
+{
+    for (int disk = 0; disk < 2; disk++)
+	{
+        const size_t npages = m_disk[disk].dirty_count() > 0 ? m_disk[disk].npages() : 0;
+        for (size_t page = 0; page < npages; page++)
+		{
+            if (m_disk[disk].dirty(page))
+			{
+                m_journal.add(disk * NPAGES + page, m_disk[disk].page(page));
+			}
+		}
+	}
+
+    size_t pages = m_journal.pending();
+    bool ok = m_journal.commit();
+    log(pages > 0 ? 2 : 3, "%s: Journaled %lu pages\n", __func__, pages);
+	
+    return my_assert(ok, "%s: Journal write failed (%s)\n", __func__, strerror(errno)) ? 0 : -EIO;
+}
+
+/**
+ * @brief Sync the image file(s) and empty the journal
+ * @return true on success, or false on error
+ */
+bool AltoFS::checkpoint()
+{
+    if (!sync_disk_file())
+	{
+        return false;
+	}
+	
+    log(2, "%s: Checkpoint at %lu journal bytes\n", __func__, m_journal.size());
+
+    return my_assert(m_journal.reset(), "%s: Journal reset failed (%s)\n", __func__, strerror(errno));
+}
+
+/**
+ * @brief Set the compression of the saved copy of the disk image(s)
+ *
+ * The saved copy gets the suffix of the codec, e.g. tdisk4.dsk.afz~
+ *
+ * @param codec compression to use
+ */
+void AltoFS::set_save_codec(afs_codec_t codec)
+{
+    std::lock_guard<afs_rwlock> lock(m_lock);
+    m_save_codec = codec;
+}
+
+/**
+ * @brief Set the policy which picks the pages alloc_page() and alloc_pages() allocate
+ * @param policy allocation policy
+ */
+void AltoFS::set_alloc_policy(afs_alloc_policy_t policy)
+{
+    std::lock_guard<afs_rwlock> lock(m_lock);
+    delete m_allocator;
+    m_allocator = afs_allocator::create(policy);
+    log(1, "%s: Allocating pages with the %s policy\n", __func__, afs_allocator::name(policy));
+}
+
+/**
+ * @brief Start the background writer
+ *
+ * The writer commits the pending changes every interval seconds,
+ * and whenever the number of dirty pages reaches dirty_max.
+ *
+ * @param interval seconds between flushes, or 0 to flush on dirty_max only
+ * @param dirty_max number of dirty pages which trigger a flush, or 0 for no limit
+ */
+void AltoFS::start_writeback(int interval, size_t dirty_max)
+{
+    stop_writeback();
+
+    if (interval <= 0 && dirty_max == 0)
+	{
+        return;
+	}
+	
+    m_flush_interval = interval;
+    m_dirty_max = dirty_max;
+    m_writeback_stop = false;
+    m_writeback_kick = false;
+    m_writeback = std::thread(&AltoFS::writeback_thread, this);
+
+    log(1, "%s: flush interval %ds, dirty max %lu pages\n", __func__, interval, dirty_max);
+}
+
+/**
+ * @brief Stop the background writer and wait for it to quit
+ */
+void AltoFS::stop_writeback()
+{
+    if (!m_writeback.joinable())
+	{
+        return;
+	}
+	
+    {
+        std::lock_guard<std::mutex> lock(m_writeback_mutex);
+        m_writeback_stop = true;
+        m_writeback_cv.notify_one();
+    }
+
+    m_writeback.join();
+    m_dirty_max = 0;
+}
+
+/**
+ * @brief Body of the background writer thread
+ */
+void AltoFS::writeback_thread()
+{
+    std::unique_lock<std::mutex> lock(m_writeback_mutex);
+    while (!m_writeback_stop)
+	{
+        auto wake = [this] { return m_writeback_stop || m_writeback_kick; };
+        if (m_flush_interval > 0)
+		{
+            m_writeback_cv.wait_for(lock, std::chrono::seconds(m_flush_interval), wake);
+		}
+		else
+		{
+            m_writeback_cv.wait(lock, wake);
+		}
+		
+        if (m_writeback_stop)
+		{
+            break;
+		}
+		
+        m_writeback_kick = false;
+
+        // Don't keep the writeback mutex, mark_dirty() needs it
+        lock.unlock();
+        int res = commit(false);
+        my_assert(res == 0, "%s: Background flush failed (%d)\n", __func__, res);
+        lock.lock();
+    }
+}
+
+/**
+ * @brief Save a single disk image to a file
+ *
+ * An image mapped in-place gets its dirty pages written to its file,
+ * an image with an overlay gets them written to the delta file.
+ * Otherwise the pages are written to a file with the same name and
+ * a '~' appended. Only the first save writes the whole image, after
+ * that just the dirty pages are written to the same file. A compressed
+ * image is written in full, with the same compression, when it changed.
+ *
+ * @param name name of the image file
+ * @param disk pointer to the disk image page storage
+ * @return true on success, or false on error
+ */
+bool AltoFS::save_single_disk(std::string name, afs_diskimage* disk)
+{
+    if (disk->overlay())
+	{
+        size_t pages = disk->dirty_count();
+        bool ok = disk->writeback();
+        log(pages > 0 ? 1 : 3, "%s: Wrote %lu dirty pages to overlay '%s.delta'\n", __func__, pages, name.c_str());
+        return my_assert(ok, "%s: Overlay write to %s.delta failed (%s)\n", __func__, name.c_str(), strerror(errno));
+    }
+
+    // A compressed image is saved with the same compression, unless set_save_codec() was used
+    afs_codec_t codec = afs_codec::from_name(name);
+    if (m_save_codec >= 0 && !disk->inplace() && m_save_codec != codec)
+	{
+        name.erase(name.size() - strlen(afs_codec::suffix(codec)));
+        codec = (afs_codec_t)m_save_codec;
+        name += afs_codec::suffix(codec);
+	}
+
+    // For now always write backup files
+    if (!disk->inplace())
+	{
+        name += "~";
+    }
+
+    if (disk->inplace() || disk->saved())
+	{
+        auto start = std::chrono::steady_clock::now();
+        size_t pages = disk->dirty_count();
+        size_t runs = 0;
+        bool ok = disk->writeback(&runs);
+        log(pages > 0 ? 1 : 3, "%s: Wrote %lu dirty pages in %lu runs to disk image '%s' in %.1f ms\n", __func__, pages, runs, name.c_str(), elapsed_ms(start));
+        return my_assert(ok, "%s: Disk write to %s failed (%s)\n", __func__, name.c_str(), strerror(errno));
+    }
+
+    if (disk->written() && disk->dirty_count() == 0)
+	{
+        // A compressed copy needs to be written only if something changed
+        return true;
+	}
+	
+    log(1, "%s: Writing disk image '%s'\n", __func__, name.c_str());
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = disk->save(name, codec);
+    log(1, "%s: Wrote disk image '%s' in %.1f ms\n", __func__, name.c_str(), elapsed_ms(start));
+    my_assert_or_die(ok || errno != ENOENT, "%s: open failed on Alto disk image file %s\n", __func__, name.c_str());
+	
+    return my_assert(ok, "%s: Disk write to %s failed (%s)\n", __func__, name.c_str(), strerror(errno));
+}
+
+/**
+ * @brief Dump a memory block as words and ASCII data
+ * @param data pointer to data to dump
+ * @param nbytes number of bytes to dump
+ */
+void AltoFS::dump_memory(char* data, size_t nbytes)
+{
+    const size_t nwords = nbytes / 2;
+    char str[17];
+
+    for (size_t row = 0; row < (nwords+7)/8; row++)
+	{
+        log(3, "%04lx:", row * 8);
+        for (size_t col = 0; col < 8; col++)
+		{
+            size_t offs = row * 8 + col;
+            if (offs < nwords)
+			{
+                unsigned char h = data[(2*offs+0) ^ lsb()];
+                unsigned char l = data[(2*offs+1) ^ lsb()];
+                log(3, " %02x%02x", h, l);
+            }
+			else
+			{
+                log(3, "     ");
+            }
+        }
+
+        for (size_t col = 0; col < 8; col++)
+		{
+            size_t offs = row * 8 + col;
+            if (offs < nwords)
+			{
+                unsigned char h = data[(2*offs+0) ^ lsb()];
+                unsigned char l = data[(2*offs+1) ^ lsb()];
+                str[(col * 2) + 0] = (isprint(h)) ? h : '.';
+                str[(col * 2) + 1] = (isprint(l)) ? l : '.';
+            }
+			else
+			{
+                str[(col * 2) + 0] = ' ';
+                str[(col * 2) + 1] = ' ';
+            }
+        }
+		
+        str[16] = '\0';
+        log(3, "  %16s\n", str);
+    }
+}
+
+/**
+ * @brief Dump a disk block as words and ASCII data
+ * @param pageno page number
+ */
+void AltoFS::dump_disk_block(page_t pageno)
+{
+    char page[PAGESZ];
+    read_page(pageno, page);
+    dump_memory(page, PAGESZ);
+}
+
+/**
+ * @brief Dump the contents of a leader page
+ * @param lp pointer to afs_leader_t
+ */
+void AltoFS::dump_leader(afs_leader_t* lp)
+{
+    log(2, "%s: created                    : %s\n", __func__, altotime_to_str(lp->created).c_str());
+    log(2, "%s: written                    : %s\n", __func__, altotime_to_str(lp->written).c_str());
+    log(2, "%s: read                       : %s\n", __func__, altotime_to_str(lp->read).c_str());
+    log(2, "%s: filename                   : %s\n", __func__, filename_to_string(lp->filename).c_str());
+    log(2, "%s: leader_props[]             : ...\n", __func__);
+    log(2, "%s: spare[]                    : ...\n", __func__);
+    log(2, "%s: proplength                 : %u\n", __func__, lp->proplength);
+    log(2, "%s: propbegin                  : %u\n", __func__, lp->propbegin);
+    log(2, "%s: change_SN                  : %u\n", __func__, lp->change_SN);
+    log(2, "%s: consecutive                : %u\n", __func__, lp->consecutive);
+    log(2, "%s: dir_fp_hint.fid_dir        : %#x\n", __func__, lp->dir_fp_hint.fid_dir);
+    log(2, "%s: dir_fp_hint.serialno       : %#x\n", __func__, lp->dir_fp_hint.serialno);
+    log(2, "%s: dir_fp_hint.version        : %u\n", __func__, lp->dir_fp_hint.version);
+    log(2, "%s: dir_fp_hint.blank          : %u\n", __func__, lp->dir_fp_hint.blank);
+    log(2, "%s: dir_fp_hint.leader_vda     : %u\n", __func__, lp->dir_fp_hint.leader_vda);
+    log(2, "%s: last_page_hint.vda         : %u\n", __func__, lp->last_page_hint.vda);
+    log(2, "%s: last_page_hint.filepage    : %u\n", __func__, lp->last_page_hint.filepage);
+    log(2, "%s: last_page_hint.char_pos    : %u\n", __func__, lp->last_page_hint.char_pos);
+}
+
+/**
+ * @brief Return the length of a file from its data pages, or by scanning them
+ * @param leader_page_vda page number of the leader page
+ * @return size in bytes
+ */
+size_t AltoFS::file_length(page_t leader_page_vda)
+{
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (info)
+	{
+        // The file ends with the first page which is not full
+        load_file_pages(info);
+        for (size_t idx = 0; idx < info->page_count(); idx++)
+		{
+            if (info->page_offset(idx + 1) - info->page_offset(idx) < PAGESZ)
+			{
+                return info->page_offset(idx + 1);
+			}
+		}
+		
+        return info->pages_size();
+	}
+	
+    size_t length = 0;
+	
+	page_t page = leader_page_vda;
+    while (page != 0)
+	{
+        afs_label_t* l = page_label(page);
+        if (l->filepage > 0)
+		{
+            length += l->nbytes;
+		}
+		
+        if (l->nbytes < PAGESZ)
+		{
+            break;
+		}
+		
+        page = rda_to_vda(l->next_rda);
+    }
+	
+    return length;
+}
+
+/**
+ * @brief Convert a raw disk address to a virtual disk address.
+ * @param rda raw disk address (from the image)
+ * @return virtual disk address (think LBA)
+ */
+page_t AltoFS::rda_to_vda(word rda)
+{
+    const word dp1flag = (rda >> 1) & 1;
+    const word head = (rda >> 2) & 1;
+    const word cylinder = (rda >> 3) & 0x1ff;
+    const word sector = (rda >> 12) & 0xf;
     const page_t vda = (dp1flag * NPAGES) + (cylinder * NHEADS * NSECS) + (head * NSECS) + sector;
     return vda;
 }
@@ -521,65 +1069,65 @@ word AltoFS::vda_to_rda(page_t vda)
 /**
  * @brief Allocate a new page from the free pages.
  *
- * Scan for pages near the given page, always alternatingly looking
- * at a page after and a page before the given page.
+ * The allocation policy picks the page, by default the one nearest to the
+ * given page, alternatingly looking at a page after and a page before it.
  *
  * @param page previous page VDA where this page is chained to
+ * @param info optional file info node whose data pages get the new page appended
  * @return new page VDA, or 0 if no free page is found
  */
-page_t AltoFS::alloc_page(page_t page)
+page_t AltoFS::alloc_page(page_t page, afs_fileinfo* info)
 {
 	log(2, "%s: prevPage=%-5ld\n", __func__, page);
 
-	// Won't find a free page anyway
-    if (m_kdh.free_pages == 0)
-	{
-        log(1, "%s: KDH free pages is 0 - no free page found\n", __func__);
-        return 0;
-    }
-
-    const page_t maxpage = m_bit_count;
     const page_t prev_vda = page;
 
     afs_label_t* lprev = page ? page_label(page) : NULL;
+    word fid_id = 0;
+    {
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
 
-    // Search a free page close to the current filepage
-    page_t dist = 1;
-    while (dist < maxpage)
-	{
-        if (page + dist < maxpage && !getPageBitmapBit(page + dist))
+        // Won't find a free page anyway, or only one promised to a delayed write buffer
+        if (available_pages() == 0)
 		{
-            page += dist;
-            break;
+            log(1, "%s: KDH free pages is %u with %lu reserved - no free page found\n", __func__, m_kdh.free_pages, m_delayed_pages);
+            return 0;
         }
-		
-        if (page - dist > 1 && !getPageBitmapBit(page - dist))
+
+        // Let the policy pick a free page, by default the one closest to the current filepage
+        const page_t found = m_allocator->start(m_free_map, page, 1);
+        if (found >= 0)
 		{
-            page -= dist;
-            break;
+            page = found;
+		}
+
+        if (getPageBitmapBit(page))
+		{
+            // No free page found
+            log(1, "%s: no free page found\n", __func__);
+            return 0;
         }
-		
-        dist++;
-    }
 
-    if (getPageBitmapBit(page))
-	{
-        // No free page found
-        log(1, "%s: no free page found\n", __func__);
-        return 0;
+        m_kdh.free_pages -= 1;
+        m_disk_descriptor_dirty = true;
+        setPageBitmapBit(page, 1);
+        if (!lprev)
+		{
+            // A new file gets the next serial number
+            fid_id = m_kdh.last_sn.sn[lsb()];
+            m_kdh.last_sn.sn[lsb()] += 1;
+        }
     }
-
-    m_kdh.free_pages -= 1;
-    m_disk_descriptor_dirty = true;
-    setPageBitmapBit(page, 1);
     zero_page(page);
 
     afs_label_t* lthis = page_label(page);
     memset(lthis, 0, sizeof(*lthis));
+    mark_dirty(page);
     // link pages
     if (lprev)
 	{
         lprev->next_rda = vda_to_rda(page);
+        mark_dirty(prev_vda);
 	}
 	
     lthis->prev_rda = vda_to_rda(prev_vda);
@@ -599,10 +1147,8 @@ page_t AltoFS::alloc_page(page_t page)
         lthis->filepage = 0;
         lthis->fid_file = 1;
         lthis->fid_dir = 0;
-        lthis->fid_id = m_kdh.last_sn.sn[lsb()];
-        m_kdh.last_sn.sn[lsb()] += 1;
+        lthis->fid_id = fid_id;
         lthis->nbytes = PAGESZ;
-        m_disk_descriptor_dirty = true;
     }
 
 #if defined(DEBUG)
@@ -632,13 +1178,139 @@ page_t AltoFS::alloc_page(page_t page)
 	
 	log(2, "%s: page=%-5ld\n", __func__, page);
 
+    if (info && info->pages_valid())
+	{
+        const size_t count = info->page_count();
+        if (prev_vda == (count > 0 ? info->page(count - 1) : info->leader_page_vda()))
+		{
+            info->append_page(page, 0);
+		}
+		else
+		{
+            info->clear_pages();
+		}
+    }
+
     return page;
 }
 
+/**
+ * @brief Allocate a number of data pages and append them to a page chain.
+ *
+ * The pages are reserved in one pass over the free page bitmap, each one
+ * picked by the allocation policy, which by default prefers a contiguous
+ * run after the given page. The labels are then linked in one sweep,
+ * without holding the allocator lock, since nobody else owns the pages.
+ *
+ * @param page last page VDA of the chain, where the new pages are chained to
+ * @param count number of pages to allocate
+ * @param pages vector which receives the new page VDAs in chain order
+ * @param info optional file info node whose data pages get the new pages appended
+ * @return number of pages allocated, less than count if the disk is full
+ */
+size_t AltoFS::alloc_pages(page_t page, size_t count, std::vector<page_t>& pages, afs_fileinfo* info)
+{
+	log(2, "%s: prevPage=%-5ld count=%lu\n", __func__, page, count);
+	
+    pages.clear();
+    my_assert_or_die(page != 0, "%s: Can't allocate a leader page\n", __func__);
+	
+    const page_t prev_vda = page;
+    size_t extents = 0;
+    {
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+        const size_t available = available_pages();
+        if (count > available)
+		{
+            log(1, "%s: KDH free pages is %u with %lu reserved - only allocating %lu\n", __func__, m_kdh.free_pages, m_delayed_pages, available);
+            count = available;
+        }
+        if (count == 0)
+		{
+            return 0;
+		}
+		
+        // Reserve the pages in the bitmap
+        pages.reserve(count);
+        while (pages.size() < count)
+		{
+            const page_t left = (page_t)(count - pages.size());
+            const page_t next = pages.empty() ? m_allocator->start(m_free_map, page, left) : m_allocator->next(m_free_map, page, left);
+            if (next < 0)
+			{
+                break;
+			}
+            extents += next != page + 1;
+            pages.push_back(next);
+            setPageBitmapBit(next, 1);
+            page = next;
+        }
+		
+        m_kdh.free_pages -= pages.size();
+        m_disk_descriptor_dirty = true;
+    }
+	
+    // Link the labels
+    afs_label_t* lprev = page_label(prev_vda);
+    page_t prev = prev_vda;
+    for (size_t i = 0; i < pages.size(); i++)
+	{
+        page = pages[i];
+        zero_page(page);
+		
+        afs_label_t* lthis = page_label(page);
+        memset(lthis, 0, sizeof(*lthis));
+        lthis->prev_rda = vda_to_rda(prev);
+        lthis->filepage = lprev->filepage + 1;
+        lthis->fid_file = lprev->fid_file;
+        lthis->fid_dir = lprev->fid_dir;
+        lthis->fid_id = lprev->fid_id;
+        lprev->next_rda = vda_to_rda(page);
+        mark_dirty(prev);
+		
+        lprev = lthis;
+        prev = page;
+    }
+    mark_dirty(prev);
+	
+	log(2, "%s: %lu pages in %lu extents from %ld to %ld\n", __func__, pages.size(), extents,
+		pages.empty() ? 0 : pages.front(), pages.empty() ? 0 : pages.back());
+	
+    if (info && info->pages_valid())
+	{
+        const size_t n = info->page_count();
+        if (prev_vda == (n > 0 ? info->page(n - 1) : info->leader_page_vda()))
+		{
+            for (size_t i = 0; i < pages.size(); i++)
+			{
+                info->append_page(pages[i], 0);
+			}
+        }
+		else
+		{
+            info->clear_pages();
+		}
+    }
+	
+    return pages.size();
+}
+
+/**
+ * @brief Get the number of free pages which are not reserved for delayed write buffers
+ * The caller holds m_alloc_mutex.
+ * @return number of pages alloc_page() and alloc_pages() may take
+ */
+size_t AltoFS::available_pages() const
+{
+    return (size_t)m_kdh.free_pages > m_delayed_pages ? m_kdh.free_pages - m_delayed_pages : 0;
+}
+
 /**
  * @brief Search disk for file %name and return leader page VDA.
+ * The file info nodes built by make_fileinfo() index the leader pages by
+ * name, so the disk is only scanned if they don't exist yet.
  * @param name filename (without the trailing dot)
- * @return page number of the
+ * @return page number of the leader page, or -1 if the file doesn't exist
  */
 page_t AltoFS::find_file(const char *name)
 {
@@ -646,6 +1318,13 @@ page_t AltoFS::find_file(const char *name)
     afs_label_t* l;
     afs_leader_t* lp;
 
+    if (m_root_dir)
+	{
+        afs_fileinfo* info = m_root_dir->find(name, strlen(name));
+        my_assert(info != NULL, "%s: File %s not found\n", __func__, name);
+        return info ? (page_t)info->leader_page_vda() : -1;
+    }
+	
     // Use linear search !
     last = m_doubledisk ? NPAGES * 2 : NPAGES;
     for (page = 0; page < last; page++)
@@ -668,8 +1347,31 @@ page_t AltoFS::find_file(const char *name)
     return -1;
 }
 
+/**
+ * @brief Get the leader page VDA of DiskDescriptor
+ * The page is looked up once and cached. The cached page is checked to
+ * still be the leader page of DiskDescriptor, which it stays unless the
+ * file is removed or renamed.
+ * @return page number of the leader page, or -1 if there is no DiskDescriptor
+ */
+page_t AltoFS::disk_descriptor_vda()
+{
+    afs_fileinfo* info = find_fileinfo(m_disk_descriptor_vda);
+    if (!info || info->name() != "DiskDescriptor")
+	{
+        m_disk_descriptor_vda = find_file("DiskDescriptor");
+	}
+	
+    return m_disk_descriptor_vda;
+}
+
 /**
  * @brief Scan the SysDir file and build an array of afs_dv_t entries.
+ *
+ * The entries are decoded in one pass and joined to the file info nodes
+ * through the VDA of their leader page. They are kept in m_files in
+ * their on-disk order.
+ *
  * @return 0 on success, or -ENOENT etc. otherwise
  */
 int AltoFS::read_sysdir()
@@ -677,6 +1379,7 @@ int AltoFS::read_sysdir()
     if (m_sysdir_dirty)
         save_sysdir();
 
+    auto start = std::chrono::steady_clock::now();
     m_files.clear();
     afs_fileinfo* info = find_fileinfo("SysDir");
     my_assert_or_die(info != NULL, "%s: The file SysDir was not found!", __func__);
@@ -687,15 +1390,15 @@ int AltoFS::read_sysdir()
     // Allocate sysdir with slack for one extra afs_dv_t
     m_sysdir.resize(sdsize + sizeof(afs_dv_t));
 
-    read_file(info->leader_page_vda(), m_sysdir.data(), sdsize, false);
+    read_file(info->leader_page_vda(), m_sysdir.data(), sdsize, 0, false);
     if (lsb())
         swabit((char *)m_sysdir.data(), sdsize);
 
     const afs_dv_t* end = (afs_dv_t *)(m_sysdir.data() + sdsize);
     afs_dv_t* pdv = (afs_dv_t *)m_sysdir.data();
-    size_t alloc = 0;
     size_t count = 0;
     size_t deleted = 0;
+
     while (pdv < end)
 	{
         byte type = pdv->typelength[lsb()];
@@ -716,34 +1419,30 @@ int AltoFS::read_sysdir()
         // Verify filename with leader page
 		afs_leader_t* lp = page_leader(pdv->fileptr.leader_vda);
 		
-		int idx = lsb();
-		// printf("lsb: %d\n", idx);
-		// printf("lp->filename: %p\n", lp->filename); // May crash here... Add pointer validation to aovid crashes to be used with scavenger
-		
-        byte fnlen2 = lp->filename[idx];
-        log(4, "%s:* directory entry    : @%u **************\n", __func__, (word)((char *)pdv - m_sysdir.data()));
-        log(4, "%s:  type               : %u (%s)\n", __func__, type, 4 == type ? "allocated" : "deleted");
-        log(4, "%s:  length             : %u\n", __func__, length);
-        log(4, "%s:  fileptr.fid_dir    : %#x\n", __func__, pdv->fileptr.fid_dir);
-        log(4, "%s:  fileptr.serialno   : %#x\n", __func__, pdv->fileptr.serialno);
-        log(4, "%s:  fileptr.version    : %#x\n", __func__, pdv->fileptr.version);
-        log(4, "%s:  fileptr.blank      : %#x\n", __func__, pdv->fileptr.blank);
-        log(4, "%s:  fileptr.leader_vda : %u\n", __func__, pdv->fileptr.leader_vda);
-        log(4, "%s:  filename length    : %u (%u)\n", __func__, fnlen, fnlen2);
-        log(4, "%s:  filename           : %s\n", __func__, fn.c_str());
-		
-		afs_dv dv(*pdv);
-		
-        if (count >= alloc)
+        if (m_verbose >= 4)
 		{
-            alloc = alloc ? alloc * 2 : 32;
-            m_files.reserve(alloc);
+            byte fnlen2 = lp->filename[lsb()];
+            log(4, "%s:* directory entry    : @%u **************\n", __func__, (word)((char *)pdv - m_sysdir.data()));
+            log(4, "%s:  type               : %u (%s)\n", __func__, type, 4 == type ? "allocated" : "deleted");
+            log(4, "%s:  length             : %u\n", __func__, length);
+            log(4, "%s:  fileptr.fid_dir    : %#x\n", __func__, pdv->fileptr.fid_dir);
+            log(4, "%s:  fileptr.serialno   : %#x\n", __func__, pdv->fileptr.serialno);
+            log(4, "%s:  fileptr.version    : %#x\n", __func__, pdv->fileptr.version);
+            log(4, "%s:  fileptr.blank      : %#x\n", __func__, pdv->fileptr.blank);
+            log(4, "%s:  fileptr.leader_vda : %u\n", __func__, pdv->fileptr.leader_vda);
+            log(4, "%s:  filename length    : %u (%u)\n", __func__, fnlen, fnlen2);
+            log(4, "%s:  filename           : %s\n", __func__, fn.c_str());
         }
 		
-        m_files.resize(count+1);
-        m_files[count++] = dv;
+        m_files.append(fn, *pdv);
+        count++;
 		
-        afs_fileinfo* info = find_fileinfo(fn);
+        // Join by the leader page, if its name matches, else by the name
+        afs_fileinfo* info = find_fileinfo((page_t)pdv->fileptr.leader_vda);
+        if (!info || memcmp(lp->filename, pdv->filename, nsize) != 0)
+		{
+            info = find_fileinfo(fn);
+		}
 		
         if (4 == type)
 		{
@@ -766,7 +1465,7 @@ int AltoFS::read_sysdir()
     }
 
     size_t eod = (size_t)((char *)pdv - m_sysdir.data());
-    log(1, "%s: SysDir usage is %u files (%u deleted) in %lu/%lu bytes\n", __func__, count, deleted, eod, sdsize);
+    log(1, "%s: SysDir usage is %u files (%u deleted) in %lu/%lu bytes (%.3f ms)\n", __func__, count, deleted, eod, sdsize, elapsed_ms(start));
 
 #if defined(DEBUG)
     if (m_verbose > 4)
@@ -791,65 +1490,34 @@ int AltoFS::save_sysdir()
 
     int res = 0;
 
+    // The size of the entries is known up front, so no rescan is needed
+    const size_t eod = m_files.bytes();
     size_t sdsize = info->statSize();
-
-    const afs_dv_t* end = (afs_dv_t *)(m_sysdir.data() + sdsize);
-    afs_dv_t* pdv = (afs_dv_t *)m_sysdir.data();
-    size_t idx = 0;
-    while (idx < m_files.size() && pdv < end) {
-        const afs_dv* dv = &m_files[idx];
-        byte fnlen = dv->data.filename[lsb()];
-        // length is always word aligned
-        size_t nsize = (fnlen | 1) + 1;
-        size_t esize = sizeof(*pdv) - sizeof(pdv->filename) + nsize;
-        memcpy(pdv, &dv->data, esize);
-        pdv = (afs_dv_t*)((char *)pdv + esize);
-        idx++;
-    }
-
-    if (idx < m_files.size()) {
-        // We need to increase sdsize and write the last entry
-        const afs_dv* dv = &m_files[idx];
-        byte fnlen = dv->data.filename[lsb()];
-        // length is always word aligned
-        size_t nsize = (fnlen | 1) + 1;
-        size_t esize = sizeof(*pdv) - sizeof(pdv->filename) + nsize;
-        size_t offs = (size_t)((char*)pdv - m_sysdir.data());
-        if (offs + esize >= m_sysdir.size()) {
-            // Resize m_sysdir
-            m_sysdir.resize(offs + esize + 1);
-            info->setStatSize(offs + esize + 1);
-            m_sysdir[offs + esize] = '\0';
-        }
-        memcpy(pdv, &dv->data, esize);
-        pdv = (afs_dv_t*)((char *)pdv + esize);
-    }
-
-    size_t eod = (size_t)((char *)pdv - m_sysdir.data());
     log(1, "%s: SysDir usage is %lu/%lu bytes\n", __func__, eod, sdsize);
-    if (eod > sdsize) {
+    if (eod > sdsize)
         sdsize = eod;
-        m_sysdir.resize(sdsize+1);
-        m_sysdir[sdsize] = '\0';
-        info->setStatSize(sdsize);
-    }
+
+    // Free entries cover the words after the last one, and the zero after them ends the directory
+    m_sysdir.assign(sdsize + 1, '\0');
+    m_files.serialize(m_sysdir.data(), sdsize);
 
 #if defined(DEBUG)
     if (m_verbose > 3)
         dump_memory(m_sysdir.data(), eod);
 #endif
+    size_t written;
     if (lsb()) {
         std::vector<char> sysdir(m_sysdir);
         swabit(sysdir.data(), sdsize);
-        size_t written = write_file(info->leader_page_vda(), sysdir.data(), eod, false);
-        if (written != eod)
-            res = -ENOSPC;
+        written = write_file(info->leader_page_vda(), sysdir.data(), sdsize, 0, false);
     } else {
-        size_t written = write_file(info->leader_page_vda(), m_sysdir.data(), eod, false);
-        if (written != eod)
-            res = -ENOSPC;
+        written = write_file(info->leader_page_vda(), m_sysdir.data(), sdsize, 0, false);
     }
-    m_sysdir_dirty = 0 == res;
+    // A grown SysDir must not wait in the delayed write buffer, since
+    // commit() flushed the buffers of all files before calling us
+    if (written != sdsize || flush_file(info) < 0)
+        res = -ENOSPC;
+    m_sysdir_dirty = 0 != res;
     return res;
 }
 
@@ -860,14 +1528,15 @@ int AltoFS::save_disk_descriptor()
     afs_fa_t fa;
 
     // Locate DiskDescriptor and copy it into the global data structure
-    ddlp = (int)find_file("DiskDescriptor");
+    ddlp = (int)disk_descriptor_vda();
 	
     my_assert_or_die(ddlp != -1, "%s: Can't find DiskDescriptor\n", __func__);
 
     l = page_label(ddlp);
 
     fa.vda = rda_to_vda(l->next_rda);
-    memcpy(&m_disk[fa.vda].data[0], &m_kdh, sizeof(m_kdh));
+    memcpy(&disk_page(fa.vda)->data[0], &m_kdh, sizeof(m_kdh));
+    mark_dirty(fa.vda);
 
     // Now copy the bit table from m_bit_table onto the disk
     fa.filepage = 1;
@@ -891,19 +1560,10 @@ int AltoFS::remove_sysdir_entry(std::string name)
 {
     log(1, "%s: searching for '%s'\n", __func__, name.c_str());
 
-    for (size_t idx = 0; idx < m_files.size(); idx++)
+    // Just mark this entry as unused
+    if (m_files.remove(name))
 	{
-        afs_dv* dv = &m_files[idx];
-        std::string fn = filename_to_string(dv->data.filename);
-        if (fn != name)
-		{
-            continue;
-		}
-		
-        // Just mark this entry as unused
-        dv->data.typelength[lsb()] = 0;
-		
-        log(2, "%s: found '%s' at index %ld\n", __func__, name.c_str(), idx);
+        log(2, "%s: found '%s'\n", __func__, name.c_str());
 		
         m_sysdir_dirty = true;
 		
@@ -933,26 +1593,20 @@ int AltoFS::rename_sysdir_entry(std::string name, std::string newname)
 
     log(1, "%s: renaming '%s' to '%s'\n", __func__, name.c_str(), newname.c_str());
 
-    // Assume failure
-    int res = -ENOENT;
-    for (size_t idx = 0; idx < m_files.size(); idx++) {
-        afs_dv* dv = &m_files[idx];
-        std::string fn = filename_to_string(dv->data.filename);
-        if (fn != name)
-            continue;
+    afs_dv_t* pdv = m_files.find(name);
+    if (!pdv)
+        return -ENOENT;
 
-        // Change the name of this array entry
-        string_to_filename(dv->data.filename, newname);
+    // Change the name of the entry where it is
+    afs_dv dv(*pdv);
+    string_to_filename(dv.data.filename, newname);
+    m_files.rename(name, newname, dv.data);
 
-        fn = filename_to_string(dv->data.filename);
-        log(1, "%s:  new filename       : %s.\n", __func__, fn.c_str());
+    log(1, "%s:  new filename       : %s.\n", __func__, filename_to_string(dv.data.filename).c_str());
 
-        // FIXME: do we need to sort the array by name?
-        m_sysdir_dirty = true;
-        break;
-    }
+    m_sysdir_dirty = true;
 
-    return res;
+    return 0;
 }
 
 /**
@@ -962,6 +1616,7 @@ int AltoFS::rename_sysdir_entry(std::string name, std::string newname)
  */
 int AltoFS::unlink_file(std::string path)
 {
+    std::lock_guard<afs_rwlock> lock(m_lock);
     log(2, "%s: path=%s\n", __func__, path.c_str());
     // Skip leading directory (we have only root)
     if (path[0] == '/')
@@ -984,36 +1639,72 @@ int AltoFS::unlink_file(std::string path)
         return -EPERM;
 	}
 	
+    // Remove this node from the file info hiearchy
+    afs_fileinfo* parent = info->parent();
+    if (!parent->remove(info))
+	{
+        log(1, "%s: Could not remove child (%p) from parent (%p).\n",
+            __func__, (void*)info, (void*)parent);
+    }
+	
+	log(2, "%s: parent: %p %s %d\n", __func__, parent, parent->name().c_str(), (int)parent->size());
+
+    if (m_open_count[info->leader_page_vda()] > 0)
+	{
+        // The handles keep working, and the pages can't be reused, until the last one is released
+        log(2, "%s: '%s' is still open\n", __func__, fn.c_str());
+        m_orphans.push_back(info);
+	}
+	else
+	{
+        free_file(info);
+	}
+
+    const int res = remove_sysdir_entry(fn);
+    publish_dir();
+	
+    return res;
+}
+
+/**
+ * @brief Free the leader and data pages of a file which is no longer in the tree
+ * The caller holds the lock exclusive. The file info node is deleted.
+ * @param info file info node
+ */
+void AltoFS::free_file(afs_fileinfo* info)
+{
+    afs_leader_t* lp = page_leader(info->leader_page_vda());
+	
+    // The bytes not yet written to pages are gone with the file
+    if (!info->delayed().empty())
+	{
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+        m_delayed_pages -= delayed_pages(info, info->delayed().size());
+        info->delayed().clear();
+    }
+	
     // FIXME: What needs to be zapped?
     memset(lp->filename, 0, sizeof(lp->filename));
     memset(&lp->last_page_hint, 0, sizeof(lp->last_page_hint));
+    mark_dirty(info->leader_page_vda());
 
     page_t page = info->leader_page_vda();
     afs_label_t* l = page_label(page);
     const word id = l->fid_id;
 
-    // mark the file pages as unused
+    // mark the file pages as unused; free_page() clears the label, so look at it first
     while (page != 0)
 	{
         l = page_label(page);
+        const page_t next = l->nbytes < PAGESZ ? 0 : rda_to_vda(l->next_rda);
         free_page(page, id);
-        if (l->nbytes < PAGESZ)
-		{
-            break;
-		}
-		
-        page = rda_to_vda(l->next_rda);
+        page = next;
     }
 
-    // Remove this node from the file info hiearchy
-    afs_fileinfo* parent = info->parent();
-    if (!parent->remove(info))
+    if ((size_t)info->leader_page_vda() < m_files_by_vda.size() && m_files_by_vda[info->leader_page_vda()] == info)
 	{
-        log(1, "%s: Could not remove child (%p) from parent (%p).\n",
-            __func__, (void*)info, (void*)parent);
-    }
-
-	log(2, "%s: parent: %p %s %d\n", __func__, parent, parent->name().c_str(), (int)parent->size());
+        m_files_by_vda[info->leader_page_vda()] = NULL;
+	}
 
     // Clean up the leader page label
     page = info->leader_page_vda();
@@ -1024,8 +1715,9 @@ int AltoFS::unlink_file(std::string path)
     l->fid_file = 0xffff;
     l->fid_dir = 0xffff;
     l->fid_id = 0xffff;
-
-    return remove_sysdir_entry(fn);
+    mark_dirty(page);
+	
+    delete info;
 }
 
 /**
@@ -1036,6 +1728,7 @@ int AltoFS::unlink_file(std::string path)
  */
 int AltoFS::rename_file(std::string path, std::string newname)
 {
+    std::lock_guard<afs_rwlock> lock(m_lock);
     log(2, "%s: path=%s\n", __func__, path.c_str());
 	
     // Skip leading directory (we have only root)
@@ -1069,24 +1762,65 @@ int AltoFS::rename_file(std::string path, std::string newname)
 
     // Set new name in the leader page
     string_to_filename(lp->filename, newname);
+    mark_dirty(info->leader_page_vda());
 
-    return rename_sysdir_entry(fn, newname);
+    const int res = rename_sysdir_entry(fn, newname);
+    publish_dir();
+	
+    return res;
 }
 
-int AltoFS::get_page_count(afs_label_t *leaderPageLabel)
+/**
+ * @brief Return the number of data pages of a file
+ * @param info pointer to the file info node
+ * @return number of pages
+ */
+int AltoFS::get_page_count(afs_fileinfo* info)
 {
-	int pageCount = 0;
+    load_file_pages(info);
 	
-	page_t page = rda_to_vda(leaderPageLabel->next_rda);
-	while (page != 0)
+	return (int)info->page_count();
+}
+
+/**
+ * @brief Look up the data pages of a file, unless they are known already
+ *
+ * The page chain is followed once; afterwards alloc_page() and free_page()
+ * keep the pages up to date, and truncate_file() looks them up again.
+ * The size of the file is set from the pages found.
+ *
+ * @param info pointer to the file info node
+ */
+void AltoFS::load_file_pages(afs_fileinfo* info)
+{
+    if (info->pages_valid())
 	{
-		pageCount++;
-		
-		afs_label_t* pageLabel = page_label(page);
-		page = pageLabel->next_rda != 0 ? rda_to_vda(pageLabel->next_rda) : 0;
+        return;
 	}
 	
-	return pageCount;
+    info->clear_pages();
+	
+    // Don't loop forever on a broken page chain
+    const size_t last = m_doubledisk ? NPAGES * 2 : NPAGES;
+    afs_label_t* l = page_label(info->leader_page_vda());
+    while (l->next_rda != 0 && info->page_count() < last)
+	{
+        const page_t page = rda_to_vda(l->next_rda);
+        if (page == 0)
+		{
+            // Page 0 is the boot page, never a data page
+            break;
+		}
+		
+        l = page_label(page);
+        info->append_page(page, l->nbytes);
+    }
+	
+    info->set_pages_valid();
+	
+    const size_t delayed = info->delayed().size();
+    info->setStatSize(info->pages_size() + delayed);
+    info->setStatBlocks(info->page_count() + delayed_pages(info, delayed));
 }
 
 /**
@@ -1097,27 +1831,62 @@ int AltoFS::get_page_count(afs_label_t *leaderPageLabel)
  */
 int AltoFS::truncate_file(std::string path, off_t offset)
 {
-	int result = 0;
-	
+    afs_read_lock lock(m_lock);
     log(2, "%s: path=%s offset=%d\n", __func__, path.c_str(), offset);
 	
-    // Skip leading directory (we have only root)
-    if (path[0] == '/')
+    afs_fileinfo* info = find_fileinfo(path);
+    if (!info)
 	{
-        path.erase(0, 1);
+        return -ENOENT;
 	}
 	
-    afs_fileinfo* info = find_fileinfo(path);
+    return truncate_file(info->leader_page_vda(), offset);
+}
+
+/**
+ * @brief Truncate an (existing) file at the given offset
+ * @param leader_page_vda page number of the leader page (the inode number)
+ * @param offset new size of the file
+ * @return 0 on success, or -ENOENT on error
+ */
+int AltoFS::truncate_file(page_t leader_page_vda, off_t offset)
+{
+    afs_read_lock lock(m_lock);
+	int result = 0;
+	
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
     if (!info)
 	{
         return -ENOENT;
 	}
 		
+    // Other files can be read and written meanwhile
+    std::lock_guard<afs_rwlock> file_lock(info->lock());
     afs_leader_t* lp = page_leader(info->leader_page_vda());
     afs_label_t* leaderLabel = page_label(info->leader_page_vda());
     const word id = leaderLabel->fid_id;
 	
-	int curPageCount = get_page_count(leaderLabel);
+    // The pages are truncated or extended, so the buffered bytes must be in them
+    if (flush_file(info) < 0)
+	{
+        // The disk is full: drop the buffered bytes after offset, keep the rest
+        std::vector<char>& delayed = info->delayed();
+        const size_t start = info->pages_size();
+        {
+            std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+            m_delayed_pages -= delayed_pages(info, delayed.size());
+            delayed.resize((size_t)offset > start ? std::min<size_t>(delayed.size(), offset - start) : 0);
+            m_delayed_pages += delayed_pages(info, delayed.size());
+        }
+        if (!delayed.empty())
+		{
+            set_last_page_hint(info);
+            publish_file(info);
+            return -ENOSPC;
+		}
+    }
+	
+	int curPageCount = get_page_count(info);
 	int newPageCount = (int)(offset / PAGESZ);
 	int lastPageSize = (int)(offset - (PAGESZ * newPageCount));
 	if (lastPageSize != 0)
@@ -1134,7 +1903,7 @@ int AltoFS::truncate_file(std::string path, off_t offset)
 		}
 	}
 	
-	log(2, "%s: path=%s curPageCount=%d newPageCount=%d lastPageSize=%d\n", __func__, path.c_str(), curPageCount, newPageCount, lastPageSize);
+	log(2, "%s: file=%s curPageCount=%d newPageCount=%d lastPageSize=%d\n", __func__, info->name().c_str(), curPageCount, newPageCount, lastPageSize);
 	
 	afs_label_t* pageLabel = 0;
 	page_t lastPage = 0;
@@ -1142,10 +1911,13 @@ int AltoFS::truncate_file(std::string path, off_t offset)
 	off_t newOffset = 0;
 	word charPos = 0;
 	page_t pageToFree = 0;
+	page_t tailPage = info->leader_page_vda();
 	page_t page = rda_to_vda(leaderLabel->next_rda);
 	while (page != 0)
 	{
 		pageLabel = page_label(page);
+		mark_dirty(page);
+		tailPage = page;
 		if (pageLabel->filepage == newPageCount)
 		{
 			pageLabel->nbytes = lastPageSize;
@@ -1172,10 +1944,15 @@ int AltoFS::truncate_file(std::string path, off_t offset)
 			pageToFree = 0;
 		}
 	}
+	// Append new pages to the last page of the chain
+	std::vector<page_t> newPages;
+	if (newPageCount > curPageCount)
+	{
+		alloc_pages(tailPage, newPageCount - curPageCount, newPages);
+	}
 	for (int pageIdx = curPageCount; pageIdx < newPageCount; pageIdx++)
 	{
-		page = alloc_page(page);
-		if (page == 0)
+		if ((size_t)(pageIdx - curPageCount) >= newPages.size())
 		{
 			// No free page found
 			info->setStatSize(static_cast<size_t>(newOffset));
@@ -1183,10 +1960,12 @@ int AltoFS::truncate_file(std::string path, off_t offset)
 			break;
 		}
 		
+		page = newPages[pageIdx - curPageCount];
 		lastPage = page;
 		
 		pageLabel = page_label(page);
-		if(pageIdx == newPageCount)
+		mark_dirty(page);
+		if(pageIdx == newPageCount - 1)
 		{
 			pageLabel->nbytes = lastPageSize;
 		}
@@ -1296,12 +2075,18 @@ int AltoFS::truncate_file(std::string path, off_t offset)
     lp->last_page_hint.vda = lastPage;
 	lp->last_page_hint.filepage = lastFilePage;
     lp->last_page_hint.char_pos = charPos;
+    mark_dirty(info->leader_page_vda());
 	
-    info->setStatSize(newOffset);
+    // The page sizes changed, so look the pages up again
+    info->clear_pages();
+    load_file_pages(info);
+    info->setStatSize(result < 0 ? info->pages_size() : newOffset);
+    info->setStatBlocks(info->page_count());
+    publish_file(info);
 	
 	log(2, "%s: lastPage=%-5ld lastFilePage=%d charPos=%d newOffset=%d\n", __func__, lastPage, lastFilePage, charPos, newOffset);
 
-    return 0;
+    return result;
 }
 
 /**
@@ -1311,6 +2096,7 @@ int AltoFS::truncate_file(std::string path, off_t offset)
  */
 int AltoFS::create_file(std::string path)
 {
+    std::lock_guard<afs_rwlock> lock(m_lock);
     log(2, "%s: path=%s\n", __func__, path.c_str());
 	
     // Skip leading directory (we have only root)
@@ -1366,70 +2152,39 @@ int AltoFS::create_file(std::string path)
     lp->last_page_hint.vda = page0;
     lp->last_page_hint.filepage = 1;
     lp->last_page_hint.char_pos = 0;
+    mark_dirty(page);
 
     dump_leader(lp);
 
-    // Find position in the SysDir array where to insert
-    std::vector<afs_dv>::iterator it;
-    int idx = 0;
-    bool match = false;
-    for (it = m_files.begin(); it != m_files.end(); it++)
-	{
-        afs_dv* dv = &m_files[idx];
-        std::string fn = filename_to_string(dv->data.filename);
-        if (fn == path && 0 == dv->data.typelength[lsb()])
-		{
-            match = true;
-            break;
-        }
-		
-        if (fn > path)
-		{
-            break;
-        }
-		
-        idx++;
-    }
-
-    afs_dv* dv = &m_files[idx];
-	
-    if (!match)
-	{
-        if (it == m_files.end())
-		{
-            // Not the last entry, so make room
-            log(2, "%s: insert entry at pos=%d/%ld in SysDir\n", __func__, idx, m_files.size());
-            // Insert a new entry at idx
-            m_files.insert(it, *dv);
-        }
-		else
-		{
-            log(2, "%s: insert entry at pos=%ld at the end of SysDir\n", __func__, m_files.size());
-            m_files[idx] = *dv;
-        }
-    }
-
-    dv->data.typelength[0] = path.length();                     // whatever "length" this is
-    dv->data.typelength[1] = 4;                                 // this is an existing file
-    dv->data.fileptr.fid_dir = 0x0000;                          // this is not a directory;
-    dv->data.fileptr.serialno = m_kdh.last_sn.sn[lsb()];		// FIXME: serialno is what?
-    dv->data.fileptr.version = 1;                               // The version is always == 1
-    dv->data.fileptr.blank = 0x0000;                            // And blank is, well, blank
-    dv->data.fileptr.leader_vda = page;                         // store the leader page
+    // Insert the new SysDir entry, which replaces a deleted one of the same name
+    afs_dv dv;
+    dv.data.typelength[0] = path.length();                      // whatever "length" this is
+    dv.data.typelength[1] = 4;                                  // this is an existing file
+    dv.data.fileptr.fid_dir = 0x0000;                           // this is not a directory;
+    dv.data.fileptr.serialno = m_kdh.last_sn.sn[lsb()];         // FIXME: serialno is what?
+    dv.data.fileptr.version = 1;                                // The version is always == 1
+    dv.data.fileptr.blank = 0x0000;                             // And blank is, well, blank
+    dv.data.fileptr.leader_vda = page;                          // store the leader page
 	
-    string_to_filename(dv->data.filename, path);
+    string_to_filename(dv.data.filename, path);
+    m_files.insert(path, dv.data);
+    log(2, "%s: inserted entry for '%s' in SysDir (%lu entries)\n", __func__, path.c_str(), m_files.size());
 	
 	int result = make_fileinfo_file(m_root_dir, (int)page, true);
 	if (result == 0)
 	{
 		m_sysdir_dirty = true;
+        // Inode numbers of the kernel still referring to a former file here become stale
+        m_generation[page]++;
 	}
+    publish_dir();
 	
 	return result;
 }
 
 int AltoFS::set_times(std::string path, const struct timespec tv[])
 {
+    std::lock_guard<afs_rwlock> lock(m_lock);
     log(2, "%s: path=%s\n", __func__, path.c_str());
 	
     // Skip leading directory (we have only root)
@@ -1444,12 +2199,38 @@ int AltoFS::set_times(std::string path, const struct timespec tv[])
         return -ENOENT;
 	}
 	
+    return set_times(info->leader_page_vda(), tv);
+}
+
+/**
+ * @brief Set the access and modification times of a file by its leader page
+ * This also works for a file which was unlinked while open.
+ * @param leader_page_vda page number of the leader page (the inode number)
+ * @param tv access time and modification time
+ * @return 0 on success, or -ENOENT if there is no such file
+ */
+int AltoFS::set_times(page_t leader_page_vda, const struct timespec tv[])
+{
+    std::lock_guard<afs_rwlock> lock(m_lock);
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (!info)
+	{
+        return -ENOENT;
+	}
+	
     afs_leader_t* lp = page_leader(info->leader_page_vda());
     // FIXME: we should not be setting the ctime, but then...
     time_to_altotime(tv[1].tv_sec, &lp->created);
     // tv[0] == last access, tv[1] == last modification
     time_to_altotime(tv[1].tv_sec, &lp->written);
     time_to_altotime(tv[0].tv_sec, &lp->read);
+    mark_dirty(info->leader_page_vda());
+    
+    struct stat* st = info->st();
+    st->st_ctime = tv[1].tv_sec;
+    st->st_mtime = tv[1].tv_sec;
+    st->st_atime = tv[0].tv_sec;
+    publish_file(info);
 	
     return 0;
 }
@@ -1476,21 +2257,22 @@ int AltoFS::make_fileinfo()
 	}
 	
     const int last = m_doubledisk ? NPAGES * 2 : NPAGES;
+    m_files_by_vda.assign(last, NULL);
+    if (m_open_count.size() != (size_t)last)
+	{
+        std::vector<std::atomic<size_t> > open_count(last);
+        m_open_count.swap(open_count);
+	}
+    m_generation.resize(last, 1);
+    // A verified image was sealed after a clean unmount, so SysDir lists all of its files
+    if ((m_lazy || m_verified) && make_fileinfo_sysdir())
+	{
+        return 0;
+	}
+	
     for (page_t page = 0; page < last; page++)
 	{
-        afs_label_t* l = page_label(page);
-        // First page of a file?
-        if (l->filepage != 0)
-		{
-            continue;
-		}
-        // Marked as a regular file?
-        if (l->fid_file != 1)
-		{
-            continue;
-		}
-        // Previous RDA is 0?
-        if (l->prev_rda != 0)
+        if (!is_leader_page(page))
 		{
             continue;
 		}
@@ -1506,6 +2288,76 @@ int AltoFS::make_fileinfo()
     return 0;
 }
 
+/**
+ * @brief Return true, if a page is the leader page of a file
+ * @param page page number
+ */
+bool AltoFS::is_leader_page(page_t page)
+{
+    afs_label_t* l = page_label(page);
+	
+    // First page of a file, marked as a regular file, with no previous page
+    return l->filepage == 0 && l->fid_file == 1 && l->prev_rda == 0;
+}
+
+/**
+ * @brief Build the file info nodes of the files listed in SysDir
+ *
+ * Only the pages of SysDir and the leader pages its entries point to are
+ * read, instead of the labels of all pages. This way the checksum of a
+ * verified image stands in for the label scan, and a lazily decoded image
+ * decodes just the frames holding them. SysDir's leader page is VDA 1.
+ *
+ * @return true on success, or false if VDA 1 is not the leader page of SysDir
+ */
+bool AltoFS::make_fileinfo_sysdir()
+{
+    const page_t sysdir_vda = 1;
+    if (!is_leader_page(sysdir_vda) || filename_to_string(page_leader(sysdir_vda)->filename) != "SysDir" ||
+        make_fileinfo_file(m_root_dir, sysdir_vda, false) < 0)
+	{
+        return false;
+	}
+	
+    afs_fileinfo* sysdir = m_files_by_vda[sysdir_vda];
+    load_file_pages(sysdir);
+	
+    // Slack for one extra afs_dv_t, like in read_sysdir()
+    const size_t sdsize = sysdir->statSize() & ~(size_t)1;
+    std::vector<char> data(sdsize + sizeof(afs_dv_t), '\0');
+    read_file(sysdir_vda, data.data(), sdsize, 0, false);
+    if (lsb())
+	{
+        swabit(data.data(), sdsize);
+	}
+	
+    const page_t last = (page_t)m_files_by_vda.size();
+    const afs_dv_t* end = (const afs_dv_t*)(data.data() + sdsize);
+    const afs_dv_t* pdv = (const afs_dv_t*)data.data();
+    while (pdv < end)
+	{
+        const byte fnlen = pdv->filename[lsb()];
+        if (fnlen == 0 || fnlen > FNLEN)
+		{
+            break;
+		}
+		
+        const page_t page = pdv->fileptr.leader_vda;
+        if (page < last && !m_files_by_vda[page] && is_leader_page(page) &&
+            make_fileinfo_file(m_root_dir, (int)page, false) < 0)
+		{
+            return false;
+		}
+		
+        const size_t nsize = (fnlen | 1) + 1;
+        pdv = (const afs_dv_t*)((const char*)pdv + sizeof(*pdv) - sizeof(pdv->filename) + nsize);
+    }
+	
+    log(1, "%s: Read %d leader pages listed in SysDir\n", __func__, m_root_dir->size());
+	
+    return true;
+}
+
 int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, bool unsetDeleteFlag)
 {
     afs_label_t* l = page_label(leader_page_vda);
@@ -1556,19 +2408,18 @@ int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, bool u
         return -ENOMEM;
 	}
 	
-    // Count the file size and pages
-    size_t npages = 0;
-    size_t size = 0;
-    while (l->next_rda != 0)
+    if (m_lazy)
 	{
-        const page_t filepage = rda_to_vda(l->next_rda);
-        l = page_label(filepage);
-        size += l->nbytes;
-        npages++;
-    }
-	
-    info->setStatSize(size);
-    info->setStatBlocks(npages);
+        // The data pages are looked up when the file is opened; until then the hint gives the size
+        const word filepage = lp->last_page_hint.filepage;
+        info->setStatSize(filepage > 0 ? (filepage - 1) * PAGESZ + lp->last_page_hint.char_pos : 0);
+        info->setStatBlocks(filepage);
+	}
+	else
+	{
+        // Look up the data pages, which also gives the file size
+        load_file_pages(info);
+	}
 
 #if defined(DEBUG)
     struct tm tm_ctime;
@@ -1591,6 +2442,10 @@ int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, bool u
 
     // Make a new entry in the parent's list of children
     parent->append(info);
+    if ((size_t)leader_page_vda < m_files_by_vda.size())
+	{
+        m_files_by_vda[leader_page_vda] = info;
+	}
 
     return 0;
 }
@@ -1600,8 +2455,9 @@ int AltoFS::make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, bool u
  * @param path file name with leading path (i.e. "/" prepended)
  * @return pointer to afs_fileinfo_t for the entry, or NULL on error
  */
-afs_fileinfo* AltoFS::find_fileinfo(std::string path) const
+afs_fileinfo* AltoFS::find_fileinfo(const std::string& path) const
 {
+    afs_read_lock lock(m_lock);
     if (!m_root_dir)
 	{
         return NULL;
@@ -1612,12 +2468,357 @@ afs_fileinfo* AltoFS::find_fileinfo(std::string path) const
         return m_root_dir;
 	}
 	
-    if (path[0] == '/')
+    // Look up the name without copying the path
+    const size_t skip = path[0] == '/' ? 1 : 0;
+	
+    return m_root_dir->find(path.data() + skip, path.size() - skip);
+}
+
+/**
+ * @brief Get a copy of the status of a file
+ * The status is taken from the current snapshot, without locking.
+ * @param path file name with leading path (i.e. "/" prepended)
+ * @param st pointer to the struct stat to fill
+ * @return 0 on success, or -ENOENT if there is no such file
+ */
+int AltoFS::getattr(const std::string& path, struct stat* st) const
+{
+    std::shared_ptr<const afs_snapshot> snap = snapshot();
+    if (!snap)
+	{
+        return -ENOENT;
+	}
+	
+    if (path == "/")
+	{
+        memcpy(st, snap->st(), sizeof(*st));
+        return 0;
+	}
+	
+    const size_t skip = path[0] == '/' ? 1 : 0;
+    const afs_dirent_t* entry = snap->find(path.data() + skip, path.size() - skip);
+    if (!entry)
+	{
+        return -ENOENT;
+	}
+	
+    memcpy(st, &entry->st, sizeof(*st));
+    live_stat((page_t)st->st_ino, st);
+	
+    return 0;
+}
+
+/**
+ * @brief Get a copy of the status of a file by its leader page (the inode number)
+ * The status is taken from the current snapshot, without locking, and
+ * for an open file updated by live_stat().
+ * @param leader_page_vda page number of the leader page
+ * @param st pointer to the struct stat to fill
+ * @return 0 on success, or -ENOENT if there is no such file
+ */
+int AltoFS::getattr(page_t leader_page_vda, struct stat* st) const
+{
+    std::shared_ptr<const afs_snapshot> snap = snapshot();
+    const ssize_t idx = snap ? snap->index_of((ino_t)leader_page_vda) : -1;
+    if (idx < 0)
+	{
+        return orphan_stat(leader_page_vda, st);
+	}
+	
+    memcpy(st, &snap->entry(idx).st, sizeof(*st));
+    live_stat(leader_page_vda, st);
+	
+    return 0;
+}
+
+/**
+ * @brief Update the status of an open file with its size and time as of its last write
+ * Writes don't replace the snapshot, so the size and modification time of
+ * a file with open handles are taken from its file info node. Files which
+ * are not open don't take any lock.
+ * @param leader_page_vda page number of the leader page
+ * @param st pointer to the struct stat to update
+ */
+void AltoFS::live_stat(page_t leader_page_vda, struct stat* st) const
+{
+    if (leader_page_vda < 0 || (size_t)leader_page_vda >= m_open_count.size() || m_open_count[leader_page_vda] == 0)
+	{
+        return;
+	}
+	
+    afs_read_lock lock(m_lock);
+    const afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (info)
+	{
+        info->live(st);
+	}
+}
+
+/**
+ * @brief Get a copy of the status of a file which was unlinked while open
+ * It is no longer in the snapshot, but its file info node stays until
+ * its last handle is released, and so does its status.
+ * @param leader_page_vda page number of the leader page
+ * @param st pointer to the struct stat to fill
+ * @return 0 on success, or -ENOENT if there is no such open file
+ */
+int AltoFS::orphan_stat(page_t leader_page_vda, struct stat* st) const
+{
+    if (leader_page_vda < 0 || (size_t)leader_page_vda >= m_open_count.size() || m_open_count[leader_page_vda] == 0)
+	{
+        return -ENOENT;
+	}
+	
+    afs_read_lock lock(m_lock);
+    const afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (info == NULL)
+	{
+        return -ENOENT;
+	}
+	
+    // Readers change the access time while holding the reader mutex
+    afs_read_lock file_lock(info->lock());
+    std::lock_guard<std::mutex> atime_lock(m_reader_mutex);
+    memcpy(st, info->st(), sizeof(*st));
+    st->st_nlink = 0;
+	
+    return 0;
+}
+
+/**
+ * @brief List a directory
+ * The filler gets ".", "..", and all files which are not deleted,
+ * with a copy of their status, and may stop the listing by returning true.
+ * The entries are taken from the current snapshot, without locking, so
+ * writers don't wait for the listing and the listing doesn't wait for them.
+ * @param path directory name (only "/" exists)
+ * @param filler function called for each entry
+ * @return 0 on success, or -ENOENT if there is no such directory
+ */
+int AltoFS::readdir(const std::string& path, std::function<bool(const char* name, const struct stat* st)> filler) const
+{
+    std::shared_ptr<const afs_snapshot> snap = snapshot();
+    if (!snap || path != "/")
+	{
+        return -ENOENT;
+	}
+	
+    if (filler(".", snap->st()) || filler("..", NULL))
+	{
+        return 0;
+	}
+	
+    for (size_t i = 0; i < snap->size(); i++)
+	{
+        const afs_dirent_t& entry = snap->entry(i);
+        if (entry.deleted)
+		{
+            continue;
+		}
+		
+        if (filler(entry.name, &entry.st))
+		{
+            break;
+		}
+    }
+	
+    return 0;
+}
+
+/**
+ * @brief Get the current snapshot of the root directory
+ * @return the snapshot, which stays valid while it is referenced, or NULL before the disk is read
+ */
+std::shared_ptr<const afs_snapshot> AltoFS::snapshot() const
+{
+    return std::atomic_load(&m_snapshot);
+}
+
+/**
+ * @brief Publish a new snapshot of the root directory
+ * The caller holds the lock exclusive, so no status changes meanwhile.
+ */
+void AltoFS::publish_dir()
+{
+    if (!m_root_dir)
+	{
+        return;
+	}
+	
+    std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+    std::shared_ptr<afs_snapshot> snap = std::make_shared<afs_snapshot>(m_snapshot_version + 1, *m_root_dir->st());
+    for (int i = 0; i < m_root_dir->size(); i++)
+	{
+        const afs_fileinfo* child = m_root_dir->child(i);
+        if (child)
+		{
+            snap->append(child->name(), *child->st(), child->deleted());
+		}
+    }
+    snap->sort();
+	
+    m_snapshot_version++;
+    std::atomic_store(&m_snapshot, std::shared_ptr<const afs_snapshot>(snap));
+}
+
+/**
+ * @brief Publish a new snapshot with the current status of a file
+ * The caller holds the lock of the file, so its status doesn't change
+ * meanwhile. Nothing is published if the snapshot has that status already.
+ * @param info file info node
+ */
+void AltoFS::publish_file(const afs_fileinfo* info)
+{
+    info->set_live();
+	
+    std::lock_guard<std::mutex> lock(m_snapshot_mutex);
+    std::shared_ptr<const afs_snapshot> snap = std::atomic_load(&m_snapshot);
+    const ssize_t idx = snap ? snap->index_of(info->statIno()) : -1;
+    if (idx < 0 || memcmp(&snap->entry(idx).st, info->st(), sizeof(struct stat)) == 0)
+	{
+        return;
+	}
+	
+    std::shared_ptr<afs_snapshot> next = std::make_shared<afs_snapshot>(*snap, m_snapshot_version + 1);
+    next->set_stat(idx, *info->st());
+	
+    m_snapshot_version++;
+    std::atomic_store(&m_snapshot, std::shared_ptr<const afs_snapshot>(next));
+}
+
+/**
+ * @brief Publish the status of a file changed by reading and writing it
+ * Called when the file is flushed or released, so that reads and writes
+ * don't copy the snapshot each time. Until then getattr() takes the size
+ * and modification time of an open file from its file info node.
+ * @param leader_page_vda page number of the leader page
+ * @return 0 on success, or -ENOENT if there is no such file
+ */
+int AltoFS::publish_file(page_t leader_page_vda)
+{
+    afs_read_lock lock(m_lock);
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (info == NULL)
+	{
+        return -ENOENT;
+	}
+	
+    // Readers change the access time while holding the reader mutex
+    afs_read_lock file_lock(info->lock());
+    std::lock_guard<std::mutex> atime_lock(m_reader_mutex);
+    publish_file(info);
+	
+    return 0;
+}
+
+/**
+ * @brief Look up the data pages of a file which is opened
+ * On a lazily decoded image the file info nodes are made from the leader
+ * pages only, so this is where the pages are read and the exact size is
+ * published.
+ * @param leader_page_vda page number of the leader page
+ * @return 0 on success, or -ENOENT if there is no such file
+ */
+int AltoFS::open_file(page_t leader_page_vda)
+{
+    afs_read_lock lock(m_lock);
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (info == NULL)
+	{
+        return -ENOENT;
+	}
+	
+    // Readers look up the data pages while holding the reader mutex
+    afs_read_lock file_lock(info->lock());
+    std::lock_guard<std::mutex> pages_lock(m_reader_mutex);
+    load_file_pages(info);
+    publish_file(info);
+    m_open_count[leader_page_vda]++;
+	
+    return 0;
+}
+
+/**
+ * @brief Drop a handle taken by open_file()
+ * A file unlinked while it was open is freed with its last handle.
+ * @param leader_page_vda page number of the leader page
+ * @return 0 on success, or -ENOENT if there is no such file
+ */
+int AltoFS::release_file(page_t leader_page_vda)
+{
+    bool orphaned = false;
+    {
+        afs_read_lock lock(m_lock);
+        if (find_fileinfo(leader_page_vda) == NULL)
+		{
+            return -ENOENT;
+		}
+		
+        std::lock_guard<std::mutex> pages_lock(m_reader_mutex);
+        if (m_open_count[leader_page_vda] > 0 && --m_open_count[leader_page_vda] == 0)
+		{
+            orphaned = std::find_if(m_orphans.begin(), m_orphans.end(), [&](const afs_fileinfo* info)
+                { return info->leader_page_vda() == leader_page_vda; }) != m_orphans.end();
+		}
+    }
+	
+    if (!orphaned)
+	{
+        return 0;
+	}
+	
+    // The file may have been opened again by its inode number in between
+    std::lock_guard<afs_rwlock> lock(m_lock);
+    if (m_open_count[leader_page_vda] > 0)
+	{
+        return 0;
+	}
+	
+    for (std::vector<afs_fileinfo*>::iterator it = m_orphans.begin(); it != m_orphans.end(); ++it)
+	{
+        if ((*it)->leader_page_vda() == leader_page_vda)
+		{
+            log(2, "%s: freeing unlinked file at %d\n", __func__, (int)leader_page_vda);
+            free_file(*it);
+            m_orphans.erase(it);
+            break;
+		}
+	}
+	
+    return 0;
+}
+
+/**
+ * @brief Return the generation of a leader page VDA
+ * Together with the inode number it identifies a file across the reuse of its leader page.
+ * @param leader_page_vda page number of the leader page
+ * @return generation number
+ */
+uint32_t AltoFS::generation(page_t leader_page_vda) const
+{
+    afs_read_lock lock(m_lock);
+    if (leader_page_vda < 0 || (size_t)leader_page_vda >= m_generation.size())
+	{
+        return 1;
+	}
+	
+    return m_generation[leader_page_vda];
+}
+
+/**
+ * @brief Get a fileinfo entry by its leader page (the inode number)
+ * @param leader_page_vda page number of the leader page
+ * @return pointer to afs_fileinfo_t for the entry, or NULL if there is none
+ */
+afs_fileinfo* AltoFS::find_fileinfo(page_t leader_page_vda) const
+{
+    afs_read_lock lock(m_lock);
+    if (leader_page_vda < 0 || (size_t)leader_page_vda >= m_files_by_vda.size())
 	{
-        path.erase(0,1);
+        return NULL;
 	}
 	
-    return m_root_dir->find(path);
+    return m_files_by_vda[leader_page_vda];
 }
 
 /**
@@ -1627,7 +2828,7 @@ afs_fileinfo* AltoFS::find_fileinfo(std::string path) const
  */
 void AltoFS::read_page(page_t filepage, char* data, size_t size)
 {
-    const char *src = (char *)&m_disk[filepage].data;
+    const char *src = (char *)&disk_page(filepage)->data;
 	
     for (size_t i = 0; i < size; i++)
 	{
@@ -1642,12 +2843,14 @@ void AltoFS::read_page(page_t filepage, char* data, size_t size)
  */
 void AltoFS::write_page(page_t filepage, const char* data, size_t size)
 {
-    char *dst = (char *)&m_disk[filepage].data;
+    char *dst = (char *)&disk_page(filepage)->data;
 	
     for (size_t i = 0; i < size; i++)
 	{
         dst[i ^ lsb()] = data[i];
 	}
+	
+    mark_dirty(filepage);
 }
 
 /**
@@ -1656,8 +2859,9 @@ void AltoFS::write_page(page_t filepage, const char* data, size_t size)
  */
 void AltoFS::zero_page(page_t filepage)
 {
-    char *dst = (char *)&m_disk[filepage].data;
+    char *dst = (char *)&disk_page(filepage)->data;
     memset(dst, 0, PAGESZ);
+    mark_dirty(filepage);
 }
 
 /**
@@ -1670,84 +2874,81 @@ void AltoFS::zero_page(page_t filepage)
  */
 size_t AltoFS::read_file(page_t leader_page_vda, char* data, size_t size, off_t offset, bool update)
 {
+    afs_read_lock lock(m_lock);
     afs_leader_t* lp = page_leader(leader_page_vda);
-    afs_label_t* l = page_label(leader_page_vda);
-    std::string fn = filename_to_string(lp->filename);
-	
-    afs_fileinfo* info = find_fileinfo(fn);
-    my_assert_or_die(info != NULL, "%s: Could not find file info for %s\n", __func__, fn.c_str());
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    // Another thread may have removed the file since it was looked up
+    my_assert(info != NULL, "%s: Could not find file info for leader page %ld\n", __func__, leader_page_vda);
     if (info == NULL)
 	{
         return -1;
 	}
 	
+    // Readers of the file wait for its writer only
+    afs_read_lock file_lock(info->lock());
+	
 #if defined(DEBUG)
-	log(3, "%s: file:%s leaderpage=%-5ld data:%p size=%d offset=%d\n", __func__, fn.c_str(), leader_page_vda, data, size, offset);
+	log(3, "%s: file:%s leaderpage=%-5ld data:%p size=%d offset=%d\n", __func__, info->name().c_str(), leader_page_vda, data, size, offset);
 #endif
 	
-    off_t offs = 0;
-	size_t done = 0;
-	page_t page = rda_to_vda(l->next_rda); // First page with data
+    {
+        // Other readers may look up the data pages of the same file
+        std::lock_guard<std::mutex> pages_lock(m_reader_mutex);
+        load_file_pages(info);
+    }
 
+	size_t done = 0;
 	char buff[PAGESZ];
 
-	while (page && size > 0)
+    // Start right at the page containing offset
+    for (size_t idx = info->page_index(offset); idx < info->page_count() && done < size; idx++)
 	{
+        const page_t page = info->page(idx);
+		afs_label_t* l = page_label(page);
+        const size_t from = offset + done - info->page_offset(idx);
+        if (from >= l->nbytes)
+		{
+            break;
+		}
+		
+        const size_t nbytes = std::min<size_t>(size - done, l->nbytes - from);
 #if defined(DEBUG)
-		log(3, "%s: page=%-5ld offs=%d size=%d\n", __func__, page, offs, size);
+        log(3, "%s: page=%-5ld from=%d nbytes=%d\n", __func__, page, from, nbytes);
 #endif
-		l = page_label(page);
-        size_t nbytes = size < l->nbytes ? size : l->nbytes;
-		
-        if (offs >= offset)
+        if (from == 0)
 		{
             // aligned page read
-#if defined(DEBUG)
-            log(3, "%s: page=%-5ld offs=%d nbytes=%d\n", __func__, page, offs, nbytes);
-#endif
-            read_page(page, data, nbytes);
-			
-            data += nbytes;
-            done += nbytes;
-
-            if (nbytes < PAGESZ)
-			{
-               break;
-            }
-
-			size -= nbytes;
-			offs += nbytes;
+            read_page(page, data + done, nbytes);
         }
-		else if ((off_t)(offs + PAGESZ) > offset)
+		else
 		{
             // partial page read
-            off_t from = offset - offs;
-            nbytes -= from;
-#if defined(DEBUG)
-            log(3, "%s: page=%-5ld offs=%d nbytes=%d from=%d\n", __func__, page, offs, nbytes, from);
-#endif
             read_page(page, buff, PAGESZ);
-            memcpy(data, buff + from, nbytes);
-			
-            data += nbytes;
-            done += nbytes;
-			
-            size -= nbytes;
-			offs += nbytes;
+            memcpy(data + done, buff + from, nbytes);
         }
-		else
+		
+        done += nbytes;
+
+        if (l->nbytes < PAGESZ)
 		{
-#if defined(DEBUG)
-            log(3, "%s: page=%-5ld offs=%d (seeking to %d)\n", __func__, page, offs, offset);
-#endif
-			offs += l->nbytes;
+            break;
         }
-		
-		page = rda_to_vda(l->next_rda);
+    }
+
+    // The bytes after the data pages may still be in the delayed write buffer
+    const std::vector<char>& delayed = info->delayed();
+    const size_t start = info->pages_size();
+    if (done < size && offset + done >= start && offset + done < start + delayed.size())
+	{
+        const size_t from = offset + done - start;
+        const size_t nbytes = std::min<size_t>(size - done, delayed.size() - from);
+        memcpy(data + done, delayed.data() + from, nbytes);
+        done += nbytes;
     }
 
     if (update)
 	{
+        std::lock_guard<std::mutex> atime_lock(m_reader_mutex);
 		time_t now;
 		time(&now);
 		info->setStatAtime(now);
@@ -1755,10 +2956,15 @@ size_t AltoFS::read_file(page_t leader_page_vda, char* data, size_t size, off_t
  		afs_time_t at;
 		time_to_altotime(now, &at);
 		lp->read = at;
+		
+        // A read time alone doesn't make the file dirty, so closing it doesn't commit
+        m_atime_pages.insert(leader_page_vda);
+		
+        // The snapshot gets the access time when the file is flushed or released
 	}
 
 #if defined(DEBUG)
-	log(3, "%s: file:%s done=%d\n", __func__, fn.c_str(), done);
+	log(3, "%s: file:%s done=%d\n", __func__, info->name().c_str(), done);
 #endif
 
     return done;
@@ -1773,108 +2979,66 @@ size_t AltoFS::read_file(page_t leader_page_vda, char* data, size_t size, off_t
  */
 size_t AltoFS::write_file(page_t leader_page_vda, const char* data, size_t size, off_t offset, bool update)
 {
+    afs_read_lock lock(m_lock);
     afs_leader_t* lp = page_leader(leader_page_vda);
-    afs_label_t* l = page_label(leader_page_vda);
-    std::string fn = filename_to_string(lp->filename);
-    afs_fileinfo* info = find_fileinfo(fn);
+    afs_fileinfo* info = find_fileinfo(leader_page_vda);
 	
-    my_assert_or_die(info != NULL, "%s: Could not find file info for %s\n", __func__, fn.c_str());
+    // Another thread may have removed the file since it was looked up
+    my_assert(info != NULL, "%s: Could not find file info for leader page %ld\n", __func__, leader_page_vda);
     if (info == NULL)
 	{
         return -1;
 	}
 	
+    // Writers of other files only meet in the allocator
+    std::lock_guard<afs_rwlock> file_lock(info->lock());
+	
 #if defined(DEBUG)
-	log(3, "%s: file:%s leaderpage=%-5ld data:%p size=%d offset=%d\n", __func__, fn.c_str(), leader_page_vda, data, size, offset);
+	log(3, "%s: file:%s leaderpage=%-5ld data:%p size=%d offset=%d\n", __func__, info->name().c_str(), leader_page_vda, data, size, offset);
 #endif
 
-	off_t offs = 0;
-    page_t page = rda_to_vda(l->next_rda);
-	
-    // See if offs is at or beyond last page
-    if (offset >= (lp->last_page_hint.filepage - 1) * PAGESZ)
-	{
-        // In this case use the leader page's last_page_hint
-        page = lp->last_page_hint.vda;
-        offs = (lp->last_page_hint.filepage - 1) * PAGESZ;
-    }
+    load_file_pages(info);
 
+    // Bytes which are in the data pages already are overwritten right away
     size_t done = 0;
-    while (page && size > 0)
+    size_t length = info->pages_size();
+    if ((size_t)offset < length)
 	{
-        l = page_label(page);
-        size_t nbytes = size < PAGESZ ? size : PAGESZ;
-        if (offs >= offset && l->nbytes == PAGESZ)
-		{
-            // aligned page write
-#if defined(DEBUG)
-            log(3, "%s: page=%-5ld offs=%d nbytes=%d size=%d\n", __func__, page, offs, nbytes, size);
-#endif
-			l->nbytes = nbytes;
-			
-            write_page(page, data, nbytes);
-			
-            data += nbytes;
-            done += nbytes;
-			
-            size -= nbytes;
-        }
-		else if (l->nbytes < PAGESZ)
+        done = write_file_pages(info, data, std::min<size_t>(size, length - offset), offset);
+	}
+	
+    // The bytes after them are buffered until the file is flushed
+    if (done < size && (size_t)offset + done >= length && delay_write(info, data + done, size - done, offset + done))
+	{
+        done = size;
+	}
+	else if (done < size && (size_t)offset + done >= length)
+	{
+        // There are not enough free pages to reserve, so write through
+        flush_file(info);
+		
+        // Fill a gap between the end of the file and offset with zeroes
+        static const char zeroes[PAGESZ] = {0};
+        length = info->pages_size();
+        while (length < (size_t)offset + done)
 		{
-            // partial page write to fill it up to PAGESZ
-            off_t to = l->nbytes;
-            nbytes = size < (size_t)(PAGESZ - to) ? size : (size_t)(PAGESZ - to);
-			
-            char buff[PAGESZ];
-            read_page(page, buff, PAGESZ);  // get the current page
-#if defined(DEBUG)
-            log(3, "%s: page=%-5ld offs=%d nbytes=%d size=%d to=%d\n", __func__, page, offs, nbytes, size, to);
-#endif
-            memcpy(buff + to, data, nbytes);
-			
-            l->nbytes = to + nbytes;
-			
-            write_page(page, buff, l->nbytes); // write the modified page
-			
-            data += nbytes;
-            done += nbytes;
-			
-            if (l->nbytes < PAGESZ)
+            const size_t nbytes = std::min<size_t>(PAGESZ, offset + done - length);
+            if (write_file_pages(info, zeroes, nbytes, length) < nbytes)
 			{
+                size = done;
                 break;
 			}
 			
-			size -= nbytes;
-        }
-		else
-		{
-#if defined(DEBUG)
-            log(3, "%s: page=%-5ld offs=%d (seeking to %d)\n", __func__, page, offs, offset);
-#endif
+            length += nbytes;
         }
 		
-        offs += PAGESZ;
-		
-        if (size > 0 && l->next_rda == 0)
-		{
-            // Need to allocate a new page
-            page = alloc_page(page);
-        }
-		else
-		{
-			page =
-			(l->next_rda);
-		}
+        done += size > done ? write_file_pages(info, data + done, size - done, offset + done) : 0;
     }
-
-    lp->last_page_hint.vda = page;
-    lp->last_page_hint.filepage = l->filepage;
-    lp->last_page_hint.char_pos = l->nbytes;
+	
+    set_last_page_hint(info);
 
     if (update)
 	{
-		info->setStatSize(done);
-
 		time_t now;
 		time(&now);
         info->setStatMtime(now);
@@ -1883,15 +3047,215 @@ size_t AltoFS::write_file(page_t leader_page_vda, const char* data, size_t size,
 		time_to_altotime(now, &at);
 		lp->written = at;
     }
+	
+    // getattr() takes the size and time of an open file from here; the snapshot gets them when it is flushed or released
+    info->set_live();
 
 #if defined(DEBUG)
-	log(3, "%s: file:%s done=%d created:%s written:%s read:%s\n", __func__, fn.c_str(), done,
+	log(3, "%s: file:%s done=%d created:%s written:%s read:%s\n", __func__, info->name().c_str(), done,
 		altotime_to_str(lp->created).c_str(), altotime_to_str(lp->written).c_str(), altotime_to_str(lp->read).c_str());
 #endif
 
 	return done;
 }
 
+/**
+ * @brief Write to the data pages of a file, appending new pages as needed
+ * @param info file info node with its data pages loaded
+ * @param data buffer to write
+ * @param size number of bytes to write
+ * @param offset start offset to write to, at most the current file size
+ * @return number of bytes actually written
+ */
+size_t AltoFS::write_file_pages(afs_fileinfo* info, const char* data, size_t size, size_t offset)
+{
+    size_t idx = info->page_index(offset);
+    if (idx > 0 && idx == info->page_count() && offset - info->page_offset(idx - 1) < PAGESZ)
+	{
+        // Continue in the partially filled last page
+        idx--;
+	}
+	
+    size_t done = 0;
+    while (done < size)
+	{
+        if (idx == info->page_count())
+		{
+            // Need to allocate new pages for the rest of the data
+            const page_t prev = idx > 0 ? info->page(idx - 1) : info->leader_page_vda();
+            std::vector<page_t> pages;
+            if (alloc_pages(prev, (size - done + PAGESZ - 1) / PAGESZ, pages, info) == 0)
+			{
+                break;
+			}
+        }
+		
+        const page_t page = info->page(idx);
+        afs_label_t* l = page_label(page);
+        const size_t from = offset + done - info->page_offset(idx);
+        const size_t nbytes = std::min<size_t>(size - done, PAGESZ - from);
+#if defined(DEBUG)
+        log(3, "%s: page=%-5ld from=%d nbytes=%d size=%d\n", __func__, page, from, nbytes, size);
+#endif
+		
+        char buff[PAGESZ];
+        read_page(page, buff, PAGESZ);  // get the current page
+        memcpy(buff + from, data + done, nbytes);
+        write_page(page, buff, PAGESZ); // write the modified page
+		
+        if (from + nbytes > l->nbytes)
+		{
+            l->nbytes = from + nbytes;
+            info->set_page_bytes(idx, l->nbytes);
+        }
+		
+        done += nbytes;
+        idx++;
+    }
+	
+    return done;
+}
+
+/**
+ * @brief Get the number of pages needed for the delayed write buffer of a file
+ * @param info file info node with its data pages loaded
+ * @param size number of bytes in the buffer
+ * @return number of pages to allocate when the buffer is flushed
+ */
+size_t AltoFS::delayed_pages(afs_fileinfo* info, size_t size) const
+{
+    // The last data page may have room for some of the bytes
+    const size_t room = info->page_count() * PAGESZ - info->pages_size();
+	
+    return size > room ? (size - room + PAGESZ - 1) / PAGESZ : 0;
+}
+
+/**
+ * @brief Buffer bytes written after the end of the data pages of a file
+ *
+ * Pages are allocated when the buffer is flushed, when the final size is
+ * known, so that the allocator can place all of them in one run. The
+ * pages are reserved up front, so that the flush can't run out of them.
+ *
+ * @param info file info node with its data pages loaded
+ * @param data buffer to write
+ * @param size number of bytes to write
+ * @param offset start offset to write to, at least the size of the data pages
+ * @return true, if the bytes were buffered, or false if there are not enough free pages
+ */
+bool AltoFS::delay_write(afs_fileinfo* info, const char* data, size_t size, size_t offset)
+{
+    std::vector<char>& buffer = info->delayed();
+    const size_t start = info->pages_size();
+    const size_t end = std::max(buffer.size(), offset + size - start);
+    const size_t reserved = delayed_pages(info, buffer.size());
+    const size_t needed = delayed_pages(info, end);
+    {
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+        if (m_delayed_pages + needed - reserved > m_kdh.free_pages)
+		{
+            return false;
+		}
+        m_delayed_pages += needed - reserved;
+    }
+	
+    // A gap between the end of the file and offset reads as zeroes
+    buffer.resize(end, 0);
+    memcpy(&buffer[offset - start], data, size);
+	
+    return true;
+}
+
+/**
+ * @brief Write the delayed write buffer of a file to its data pages
+ *
+ * Bytes which don't fit on the disk stay in the buffer, with their
+ * pages reserved again, so that a later flush can write them.
+ *
+ * @param info file info node
+ * @return 0 on success, or -ENOSPC if not all bytes could be written
+ */
+int AltoFS::flush_file(afs_fileinfo* info)
+{
+    afs_read_lock lock(m_lock);
+    std::lock_guard<afs_rwlock> file_lock(info->lock());
+    if (info->delayed().empty())
+	{
+        return 0;
+	}
+	
+    std::vector<char> buffer;
+    buffer.swap(info->delayed());
+	
+    load_file_pages(info);
+    {
+        // The reserved pages are allocated right below
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+        m_delayed_pages -= delayed_pages(info, buffer.size());
+    }
+	
+    // All pages are allocated at once, so they can be one contiguous run
+    const size_t done = write_file_pages(info, buffer.data(), buffer.size(), info->pages_size());
+    if (done < buffer.size())
+	{
+        // write() acknowledged these bytes, so they must not get lost
+        info->delayed().assign(buffer.begin() + done, buffer.end());
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+        m_delayed_pages += delayed_pages(info, info->delayed().size());
+    }
+    set_last_page_hint(info);
+    publish_file(info);
+    log(2, "%s: file:%s wrote %lu of %lu delayed bytes\n", __func__, info->name().c_str(), done, buffer.size());
+	
+    return done == buffer.size() ? 0 : -ENOSPC;
+}
+
+/**
+ * @brief Write the delayed write buffers of all files to their data pages
+ * @return 0 on success, or -ENOSPC if not all bytes could be written
+ */
+int AltoFS::flush_delayed()
+{
+    std::lock_guard<afs_rwlock> lock(m_lock);
+    if (!m_root_dir)
+	{
+        return 0;
+	}
+	
+    int res = 0;
+    for (int i = 0; i < m_root_dir->size(); i++)
+	{
+        afs_fileinfo* info = m_root_dir->child(i);
+        const int fres = info && !info->delayed().empty() ? flush_file(info) : 0;
+        res = res < 0 ? res : fres;
+    }
+	
+    return res;
+}
+
+/**
+ * @brief Update the last page hint in the leader page and the size of a file
+ * @param info file info node with its data pages loaded
+ */
+void AltoFS::set_last_page_hint(afs_fileinfo* info)
+{
+    afs_leader_t* lp = page_leader(info->leader_page_vda());
+    const size_t count = info->page_count();
+    if (count > 0)
+	{
+        const page_t last = info->page(count - 1);
+        afs_label_t* l = page_label(last);
+        lp->last_page_hint.vda = last;
+        lp->last_page_hint.filepage = l->filepage;
+        lp->last_page_hint.char_pos = l->nbytes;
+	}
+    mark_dirty(info->leader_page_vda());
+	
+    const size_t delayed = info->delayed().size();
+    info->setStatSize(info->pages_size() + delayed);
+    info->setStatBlocks(count + delayed_pages(info, delayed));
+}
+
 /**
  * @brief convert an Alto 32-bit date/time value to *nix
  *
@@ -1934,7 +3298,8 @@ void AltoFS::altotime_to_tm(afs_time_t at, struct tm& tm)
 {
     time_t time;
     altotime_to_time(at, &time);
-    memcpy(&tm, localtime(&time), sizeof(tm));
+    // Writers of different files may convert times at once
+    localtime_r(&time, &tm);
 }
 
 std::string AltoFS::altotime_to_str(afs_time_t at)
@@ -1971,7 +3336,7 @@ word AltoFS::getword(afs_fa_t *fa)
         "%s: disk corruption - expected vda %d to be filepage %d\n",
         __func__, fa->vda, l->filepage);
 
-    w = m_disk[fa->vda].data[fa->char_pos >> 1];
+    w = disk_page(fa->vda)->data[fa->char_pos >> 1];
     if (SWAP_GETPUT_WORD)
         w = (w >> 8) | (w << 8);
 
@@ -1999,7 +3364,8 @@ int AltoFS::putword(afs_fa_t* fa, word w)
 
     if (SWAP_GETPUT_WORD)
         w = (w >> 8) | (w << 8);
-    m_disk[fa->vda].data[fa->char_pos >> 1] = w;
+    disk_page(fa->vda)->data[fa->char_pos >> 1] = w;
+    mark_dirty(fa->vda);
 
     fa->char_pos += 2;
     return 0;
@@ -2044,6 +3410,7 @@ void AltoFS::setPageBitmapBit(page_t page, int val)
     if (val != ((m_bit_table[offs] >> bit) & 1))
 	{
         m_bit_table[offs] = (m_bit_table[offs] & ~(1 << bit)) | ((val & 1) << bit);
+        m_free_map.set(page, val != 0);
         m_disk_descriptor_dirty = true;
     }
 }
@@ -2057,8 +3424,9 @@ void AltoFS::setPageBitmapBit(page_t page, int val)
  *
  * @param page page number
  * @param id file id
+ * @param info optional file info node whose data pages end before this page
  */
-void AltoFS::free_page(page_t page, word id)
+void AltoFS::free_page(page_t page, word id, afs_fileinfo* info)
 {
 	log(2, "%s: page:%-5ld id:0x%X\n", __func__, page, id);
 
@@ -2079,6 +3447,7 @@ void AltoFS::free_page(page_t page, word id)
 	page_t prevPage = rda_to_vda(l->prev_rda);
 	afs_label_t *prevPageLabel = page_label(prevPage);
 	prevPageLabel->next_rda = 0;
+	mark_dirty(prevPage);
 	
 	l->prev_rda = 0;
 	l->nbytes = 0;
@@ -2087,12 +3456,35 @@ void AltoFS::free_page(page_t page, word id)
     l->fid_file = 0xffff;
     l->fid_dir = 0xffff;
     l->fid_id = 0xffff;
+    mark_dirty(page);
 	
-    m_kdh.free_pages += 1;
-    m_disk_descriptor_dirty = true;
-	
-    // mark as freed
-    setPageBitmapBit(page, 0);
+    {
+        std::lock_guard<std::mutex> alloc_lock(m_alloc_mutex);
+        m_kdh.free_pages += 1;
+        m_disk_descriptor_dirty = true;
+		
+        // mark as freed
+        setPageBitmapBit(page, 0);
+    }
+
+    if (info && info->pages_valid())
+	{
+        // The page was unchained from its predecessor, so the file ends before it
+        size_t idx = info->page_count();
+        while (idx > 0 && info->page(idx - 1) != page)
+		{
+            idx--;
+		}
+		
+        if (idx > 0)
+		{
+            info->truncate_pages(idx - 1);
+		}
+		else
+		{
+            info->clear_pages();
+		}
+    }
 }
 
 /**
@@ -2137,9 +3529,10 @@ int AltoFS::verify_headers()
     const int last = m_doubledisk ? NPAGES * 2 : NPAGES;
     for (int i = 0; i < last; i += 1)
 	{
-        ok &= my_assert(m_disk[i].pagenum == rda_to_vda(m_disk[i].header[1]),
+        afs_page_t* page = disk_page(i);
+        ok &= my_assert(page->pagenum == rda_to_vda(page->header[1]),
             "%s: page %04x header doesn't match: %04x %04x\n",
-            __func__, m_disk[i].pagenum, m_disk[i].header[0], m_disk[i].header[1]);
+            __func__, page->pagenum, page->header[0], page->header[1]);
 	}
 	
     return ok;
@@ -2157,7 +3550,8 @@ int AltoFS::validate_disk_descriptor()
     afs_fa_t fa;
 
     // Locate DiskDescriptor and copy it into the global data structure
-    ddlp = (int)find_file("DiskDescriptor");
+    m_disk_descriptor_vda = -1;
+    ddlp = (int)disk_descriptor_vda();
     my_assert_or_die(ddlp != -1, "%s: Can't find DiskDescriptor\n", __func__);
 
     lp = page_leader(ddlp);
@@ -2167,7 +3561,7 @@ int AltoFS::validate_disk_descriptor()
 
     l = page_label(ddlp);
     fa.vda = rda_to_vda(l->next_rda);
-    memcpy(&m_kdh, &m_disk[fa.vda].data[0], sizeof(m_kdh));
+    memcpy(&m_kdh, &disk_page(fa.vda)->data[0], sizeof(m_kdh));
 #pragma message "Is disk_bt_size a fixed value ?"
     m_bit_count = m_kdh.disk_bt_size * 16;
     m_bit_table.resize(m_kdh.disk_bt_size);
@@ -2180,6 +3574,7 @@ int AltoFS::validate_disk_descriptor()
 	{
         m_bit_table[i] = getword(&fa);
 	}
+    m_free_map.assign(m_bit_table, m_bit_count);
 	
     m_disk_descriptor_dirty = false;
     log(1, "%s: The bit table size is %u words (%u bits)\n", __func__, m_kdh.disk_bt_size, m_bit_count);
@@ -2202,13 +3597,23 @@ int AltoFS::validate_disk_descriptor()
     ok &= my_assert(m_kdh.def_versions_kept == 0, "%s: defaultVersions != 0\n", __func__);
 
     // Count free pages in bit table
-    nfree = 0;
-    for (int i = 0; i < m_bit_count; i++)
+    nfree = (int)m_free_map.count_free();
+	
+    ok &= my_assert(nfree == m_kdh.free_pages, "%s: Bit table free page count %d doesn't match KDH value %d\n", __func__, nfree, m_kdh.free_pages);
+
+    if (m_verified)
 	{
-        nfree += getPageBitmapBit(i) ? 0 : 1;
+        // The image is what fuse-alto wrote, with the KDH free page count kept in step
+        log(1, "%s: Skipping the free page scan of the verified image\n", __func__);
+        return ok;
 	}
 	
-    ok &= my_assert(nfree == m_kdh.free_pages, "%s: Bit table free page count %d doesn't match KDH value %d\n", __func__, nfree, m_kdh.free_pages);
+    if (m_lazy)
+	{
+        // Scanning the labels would decode every frame of the image
+        log(1, "%s: Skipping the free page scan of the lazily decoded image\n", __func__);
+        return ok;
+	}
 
     // Count pages marked as unused in actual image
     nfree = 0;
@@ -2264,10 +3669,9 @@ void AltoFS::fix_disk_descriptor()
 	{
         // Reconstruct bit_table from SysDir files and their pages
         nfree = m_doubledisk ? 2 * NPAGES : NPAGES;
-        for (size_t idx = 0; idx < m_files.size(); idx++)
+        for (afs_sysdir::const_iterator it = m_files.begin(); it != m_files.end(); it++)
 		{
-            afs_dv* file = &m_files.at(idx);
-            afs_dv_t* dv = &file->data;
+            const afs_dv_t* dv = &it->data;
             byte type = dv->typelength[lsb()];
             byte fnlen = dv->filename[lsb()];
             // Skip over deleted files
@@ -2290,6 +3694,7 @@ void AltoFS::fix_disk_descriptor()
                 word nbytes = PAGESZ;
                 size_t left = length - offs;
                 afs_label_t* l = page_label(page);
+                afs_label_t before = *l;
 
                 if (left > 0)
 				{
@@ -2347,6 +3752,11 @@ void AltoFS::fix_disk_descriptor()
                     }
                 }
 
+                if (memcmp(&before, l, sizeof(before)) != 0)
+				{
+                    mark_dirty(page);
+				}
+
                 page = rda_to_vda(l->next_rda);
                 if (filepage > 0)
 				{
@@ -2373,11 +3783,7 @@ void AltoFS::fix_disk_descriptor()
     }
 
     // Count free pages in bit table - again
-    nfree = 0;
-    for (int i = 0; i < m_bit_count; i++)
-	{
-        nfree += getPageBitmapBit(i) ? 0 : 1;
-	}
+    nfree = (int)m_free_map.count_free();
 	
     my_assert (nfree == m_kdh.free_pages, "%s: Bit table free page count %d doesn't match KDH value %d\n", __func__, nfree, m_kdh.free_pages);
 	
@@ -2534,6 +3940,7 @@ void AltoFS::string_to_filename(char* dst, std::string src)
  */
 int AltoFS::statvfs(struct statvfs* vfs)
 {
+    afs_read_lock lock(m_lock);
     memset(vfs, 0, sizeof(*vfs));
     if (NULL == m_root_dir)
         return -EBADF;
@@ -2547,14 +3954,19 @@ int AltoFS::statvfs(struct statvfs* vfs)
         vfs->f_blocks *= 2;
 	}
 	
-    vfs->f_bfree = m_kdh.free_pages;    // Total number of free blocks.
+    // Writers of the files allocate pages meanwhile
+    std::unique_lock<std::mutex> alloc_lock(m_alloc_mutex);
+    const size_t free_pages = available_pages();
+    alloc_lock.unlock();
+	
+    vfs->f_bfree = free_pages;          // Total number of free blocks.
 	
-    vfs->f_bavail = m_kdh.free_pages;   // Total number of free blocks available to non-privileged processes.
+    vfs->f_bavail = free_pages;         // Total number of free blocks available to non-privileged processes.
 	
     vfs->f_files = (int)m_files.size(); // Total number of file nodes (inodes) on the file system.
 	
     // Per 2 free pages we could create 1 file (leader page and 1st file page)
-    size_t inodes = m_kdh.free_pages / 2;
+    size_t inodes = free_pages / 2;
 	vfs->f_ffree = (fsfilcnt_t)inodes;  // Total number of free file nodes (inodes).
     vfs->f_favail = (fsfilcnt_t)inodes; // Total number of free file nodes (inodes) available to non-privileged processes.
 	
@@ -2574,6 +3986,14 @@ int AltoFS::statvfs(struct statvfs* vfs)
 
 void AltoFS::print_file_pages(page_t leader_page_vda)
 {
+    afs_read_lock lock(m_lock);
+    const afs_fileinfo* info = find_fileinfo(leader_page_vda);
+    if (!info)
+	{
+        return;
+	}
+	
+    afs_read_lock file_lock(info->lock());
 	log(1, "#### print_file_pages ####\n");
 	
 	page_t page = leader_page_vda;
@@ -2598,3 +4018,103 @@ void AltoFS::print_file_pages(page_t leader_page_vda)
 	log(1, "-------------------------\n");
 }
 
+
+/**
+ * @brief Print how well the files are laid out, now and with each policy
+ *
+ * For each file the data pages are counted in extents (runs of adjacent
+ * pages, the leader page included) and the seek distance is the sum of
+ * cylinders moved while reading the file from the leader page on.
+ * For each allocation policy the files are laid out anew, in the order
+ * of their leader pages, as if they were written one after the other.
+ */
+void AltoFS::report_layout()
+{
+    std::lock_guard<afs_rwlock> lock(m_lock);
+    if (!m_root_dir)
+	{
+        return;
+	}
+	
+    // The page chains of all files, ordered by their leader pages
+    std::vector<std::vector<page_t>> chains;
+    for (int i = 0; i < m_root_dir->size(); i++)
+	{
+        afs_fileinfo* info = m_root_dir->child(i);
+        if (!info)
+		{
+            continue;
+		}
+        if (!info->pages_valid())
+		{
+            load_file_pages(info);
+		}
+		
+        std::vector<page_t> chain(1, info->leader_page_vda());
+        for (size_t idx = 0; idx < info->page_count(); idx++)
+		{
+            chain.push_back(info->page(idx));
+		}
+        chains.push_back(chain);
+    }
+    std::sort(chains.begin(), chains.end());
+	
+    log(0, "%-10s %6s %6s %10s %8s %12s\n", "policy", "files", "pages", "fragmented", "extents", "seek (cyls)");
+	
+    // Print one line for a layout of all files
+    auto print = [&](const char* name, const std::vector<std::vector<page_t>>& layout)
+	{
+        const page_t cylsize = NHEADS * NSECS;
+        size_t pages = 0, fragmented = 0, extents = 0, seek = 0;
+        for (const std::vector<page_t>& chain : layout)
+		{
+            size_t breaks = 0;
+            for (size_t i = 1; i < chain.size(); i++)
+			{
+                breaks += chain[i] != chain[i - 1] + 1;
+                seek += std::abs((chain[i] % NPAGES) / cylsize - (chain[i - 1] % NPAGES) / cylsize);
+            }
+            pages += chain.size();
+            fragmented += breaks > 0;
+            extents += breaks + 1;
+        }
+        log(0, "%-10s %6lu %6lu %10lu %8lu %12lu\n", name, layout.size(), pages, fragmented, extents, seek);
+    };
+	
+    print("current", chains);
+	
+    // The bitmap with the data pages of all files free
+    afs_bitmap free_map = m_free_map;
+    for (const std::vector<page_t>& chain : chains)
+	{
+        for (size_t i = 1; i < chain.size(); i++)
+		{
+            free_map.set(chain[i], false);
+		}
+	}
+	
+    for (int policy = 0; policy < ALLOC_POLICIES; policy++)
+	{
+        afs_allocator* allocator = afs_allocator::create((afs_alloc_policy_t)policy);
+        afs_bitmap map = free_map;
+        std::vector<std::vector<page_t>> layout;
+        for (const std::vector<page_t>& chain : chains)
+		{
+            std::vector<page_t> pages(1, chain[0]);
+            for (size_t i = 1; i < chain.size(); i++)
+			{
+                const page_t left = (page_t)(chain.size() - i);
+                const page_t page = i == 1 ? allocator->start(map, pages.back(), left) : allocator->next(map, pages.back(), left);
+                if (page < 0)
+				{
+                    break;
+				}
+                map.set(page, true);
+                pages.push_back(page);
+            }
+            layout.push_back(pages);
+        }
+        print(afs_allocator::name((afs_alloc_policy_t)policy), layout);
+        delete allocator;
+    }
+}
@@ -12,25 +12,53 @@
 
 #include "afs_types.h"
 #include "fileinfo.h"
+#include "diskimage.h"
+#include "journal.h"
+#include "sysdir.h"
+#include "bitmap.h"
+#include "allocator.h"
+#include "rwlock.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <condition_variable>
 
 class AltoFS
 {
 public:
 
     AltoFS();
-    AltoFS(const char* filename, int verbosity = 0, bool check = false, bool rebuild = false);
+    AltoFS(const char* filename, int verbosity = 0, bool check = false, bool rebuild = false, bool inplace = false, bool overlay = false);
     ~AltoFS();
 
     int verbosity() const;
     void setVerbosity(int verbosity);
 
-    afs_fileinfo* find_fileinfo(std::string path) const;
+    afs_fileinfo* find_fileinfo(const std::string& path) const;
+    afs_fileinfo* find_fileinfo(page_t leader_page_vda) const;
+    int getattr(const std::string& path, struct stat* st) const;
+    int getattr(page_t leader_page_vda, struct stat* st) const;
+    int publish_file(page_t leader_page_vda);
+    int open_file(page_t leader_page_vda);
+    int release_file(page_t leader_page_vda);
+    uint32_t generation(page_t leader_page_vda) const;
+    int readdir(const std::string& path, std::function<bool(const char* name, const struct stat* st)> filler) const;
+    std::shared_ptr<const afs_snapshot> snapshot() const;
 
     int unlink_file(std::string path);
     int rename_file(std::string path, std::string newname);
     int truncate_file(std::string path, off_t offset);
+    int truncate_file(page_t leader_page_vda, off_t offset);
     int create_file(std::string path);
     int set_times(std::string path, const timespec tv[]);
+    int set_times(page_t leader_page_vda, const timespec tv[]);
 
     size_t read_file(page_t leader_page_vda, char* data, size_t size,
         off_t offset = 0, bool update = true);
@@ -39,6 +67,15 @@ public:
 
     int statvfs(struct statvfs* vfs);
 
+    int commit(bool durable = true);
+    bool dirty(page_t leader_page_vda);
+    int flush_file(afs_fileinfo* info);
+    void start_writeback(int interval, size_t dirty_max);
+    void stop_writeback();
+    void set_save_codec(afs_codec_t codec);
+    void set_alloc_policy(afs_alloc_policy_t policy);
+    void report_layout();
+
 	afs_leader_t* page_leader(page_t vda);
 	afs_label_t* page_label(page_t vda);
 
@@ -47,7 +84,7 @@ public:
 	void dump_leader(afs_leader_t* lp);
 	
 	void print_file_pages(page_t leader_page_vda);
-	int get_page_count(afs_label_t *leaderPageLabel);
+	int get_page_count(afs_fileinfo* info);
 
 	void altotime_to_time(afs_time_t at, time_t* ptime);
 	void time_to_altotime(time_t time, afs_time_t* at);
@@ -62,23 +99,50 @@ private:
 	// afs_label_t* page_label(page_t vda);
 
     int read_disk_file(std::string name);
-    bool read_single_disk(std::string , afs_page_t* diskp);
+    bool read_single_disk(std::string name, afs_diskimage* disk);
 
     int save_disk_file();
-    bool save_single_disk(std::string name, afs_page_t* diskp);
+    bool sync_disk_file();
+    bool verify_disk_file();
+    bool seal_disk_file();
+
+    int replay_journal();
+    int journal_dirty_pages();
+    bool checkpoint();
+    bool save_single_disk(std::string name, afs_diskimage* disk);
+    bool attach_overlay(std::string name, afs_diskimage* disk);
+    bool for_each_disk(std::function<bool(std::string, afs_diskimage*)> func);
 
 	// Used for testing
 	// void dump_memory(char* data, size_t nwords);
 	// void dump_disk_block(page_t page);
 	// void dump_leader(afs_leader_t* lp);
 
+    afs_page_t* disk_page(page_t vda);
+    void mark_dirty(page_t vda);
+    void writeback_thread();
+
     size_t file_length(page_t leader_page_vda);
+    void load_file_pages(afs_fileinfo* info);
+    size_t write_file_pages(afs_fileinfo* info, const char* data, size_t size, size_t offset);
+    size_t delayed_pages(afs_fileinfo* info, size_t size) const;
+    bool delay_write(afs_fileinfo* info, const char* data, size_t size, size_t offset);
+    int flush_delayed();
+    void set_last_page_hint(afs_fileinfo* info);
+    void free_file(afs_fileinfo* info);
+    void publish_dir();
+    void publish_file(const afs_fileinfo* info);
+    void live_stat(page_t leader_page_vda, struct stat* st) const;
+    int orphan_stat(page_t leader_page_vda, struct stat* st) const;
 
     page_t rda_to_vda(word rda);
     word vda_to_rda(page_t vda);
 
-    page_t alloc_page(page_t page);
+    size_t available_pages() const;
+    page_t alloc_page(page_t page, afs_fileinfo* info = NULL);
+    size_t alloc_pages(page_t page, size_t count, std::vector<page_t>& pages, afs_fileinfo* info = NULL);
     page_t find_file(const char *name);
+    page_t disk_descriptor_vda();
 
     int read_sysdir();
     int save_sysdir();
@@ -88,6 +152,8 @@ private:
     int rename_sysdir_entry(std::string name, std::string newname);
 
     int make_fileinfo();
+    bool make_fileinfo_sysdir();
+    bool is_leader_page(page_t page);
     int make_fileinfo_file(afs_fileinfo* parent, int leader_page_vda, bool unsetDeleteFlag);
 
     void read_page(page_t filepage, char* data, size_t size = PAGESZ);
@@ -100,7 +166,7 @@ private:
     int getPageBitmapBit(page_t page);
     void setPageBitmapBit(page_t page, int val);
 
-    void free_page(page_t page, word id);
+    void free_page(page_t page, word id, afs_fileinfo* info = NULL);
     int is_page_free(page_t page);
 
     int verify_headers();
@@ -122,18 +188,47 @@ private:
     afs_kdh_t m_kdh;                    //!< Storage for disk allocation datastructures: disk descriptor
     page_t m_bit_count;                 //!< Number of bits in bit_table
     std::vector<word> m_bit_table;      //!< bitmap for pages allocated
+    afs_bitmap m_free_map;              //!< Summary of m_bit_table to search free pages
     bool m_disk_descriptor_dirty;       //!< Flag to tell when the bit_table was written to
     std::vector<char> m_sysdir;         //!< A copy of the on-disk SysDir file
     bool m_sysdir_dirty;                //!< Flag to tell when the sysdir was written to
-    std::vector<afs_dv> m_files;        //!< The contents of SysDir as vector of files
-    std::vector<afs_page_t> m_disk;     //!< Storage for the disk image for dp0 and (optionally) dp1
+    afs_sysdir m_files;                 //!< The contents of SysDir in on-disk order
+    afs_diskimage m_disk[2];            //!< Page storage for the disk images dp0 and (optionally) dp1
+    afs_page_t m_null_page;             //!< Zeroed page returned for pages outside of the mounted disks
+    afs_journal m_journal;              //!< Write-ahead journal of changed pages for in-place images
     bool m_doubledisk;                  //!< If doubledisk is true, then both of dp0 and dp1 are loaded
     std::string m_dp0name;              //!< the name of the first disk image
     std::string m_dp1name;              //!< the name of the second disk image, if any
     int m_verbose;                      //!< verbosity value
     afs_fileinfo* m_root_dir;           //!< The root directory file info node
+    std::vector<afs_fileinfo*> m_files_by_vda;  //!< File info nodes indexed by leader page VDA (inode number)
+    std::vector<std::atomic<size_t> > m_open_count; //!< Number of open handles of each leader page VDA
+    std::vector<uint32_t> m_generation;         //!< Generation of each leader page VDA, bumped when a new file gets it
+    std::vector<afs_fileinfo*> m_orphans;       //!< Files unlinked while open, freed by their last release_file()
+    page_t m_disk_descriptor_vda;               //!< Leader page VDA of DiskDescriptor, or -1 if not known yet
+    size_t m_delayed_pages;                     //!< Free pages reserved for the delayed write buffers of the files
 	bool m_check;                      	//!< check flag
 	int m_rebuild;                      //!< rebuild flag
+    bool m_inplace;                     //!< Write changes to the disk image file(s) instead of name~
+    bool m_overlay;                     //!< Write changed pages to name.delta instead of name~
+    bool m_verified;                    //!< True, if the image(s) matched their checksum files when mounted
+    bool m_lazy;                        //!< True, if an image decodes its pages on first access, so mounting must not read them all
+    mutable afs_rwlock m_lock;          //!< Held shared by lookups and reads, exclusive by changes
+    mutable std::mutex m_reader_mutex;  //!< Serializes the updates made under a shared file lock (page maps, access times)
+    std::set<page_t> m_atime_pages;     //!< Leader pages with a new read time, which the next commit writes
+    std::mutex m_alloc_mutex;           //!< Protects the free pages (bit table, free map, free page counts) and the allocator
+    std::shared_ptr<const afs_snapshot> m_snapshot; //!< Listing of the root directory, replaced after each change
+    std::mutex m_snapshot_mutex;        //!< Serializes replacing m_snapshot
+    uint64_t m_snapshot_version;        //!< Version of the last snapshot published
+    std::thread m_writeback;            //!< Background writer thread
+    std::mutex m_writeback_mutex;       //!< Protects the writeback flags below
+    std::condition_variable m_writeback_cv; //!< Wakes up the background writer
+    bool m_writeback_stop;              //!< Tells the background writer to quit
+    bool m_writeback_kick;              //!< Tells the background writer to flush now
+    int m_flush_interval;               //!< Seconds between background flushes, 0 for none
+    size_t m_dirty_max;                 //!< Number of dirty pages which triggers a flush, 0 for none
+    int m_save_codec;                   //!< Compression for the saved copy, or -1 to keep the image's
+    afs_allocator* m_allocator;         //!< Policy which picks the pages to allocate
 };
 
 #endif // !defined(_ALTOFS_H_)
@@ -0,0 +1,322 @@
+/*******************************************************************************************
+ *
+ * Alto free page bitmap summary
+ *
+ *******************************************************************************************/
+#include "bitmap.h"
+
+afs_bitmap::afs_bitmap() :
+    m_count(0),
+    m_free(),
+    m_summary()
+{
+}
+
+/**
+ * @brief Build the bitmap from the DiskDescriptor bit table
+ * The bit table is big endian, so page 0 is in bit 15 of the first word.
+ * @param bit_table the bit table words, a set bit marks a used page
+ * @param count number of pages in the bit table
+ */
+void afs_bitmap::assign(const std::vector<word>& bit_table, page_t count)
+{
+    m_count = count;
+    m_free.assign((count + 63) / 64, 0);
+    m_summary.assign((m_free.size() + 63) / 64, 0);
+    for (page_t page = 0; page < count; page++)
+    {
+        if (!((bit_table[page / 16] >> (15 - page % 16)) & 1))
+        {
+            set(page, false);
+        }
+    }
+}
+
+/**
+ * @brief Mark a page as used or free
+ * @param page page number
+ * @param used true, if the page is used
+ */
+void afs_bitmap::set(page_t page, bool used)
+{
+    if (page < 0 || page >= m_count)
+    {
+        return;
+    }
+
+    const size_t w = page / 64;
+    const uint64_t mask = 1ull << (page % 64);
+    if (used)
+    {
+        m_free[w] &= ~mask;
+    }
+    else
+    {
+        m_free[w] |= mask;
+    }
+
+    if (m_free[w])
+    {
+        m_summary[w / 64] |= 1ull << (w % 64);
+    }
+    else
+    {
+        m_summary[w / 64] &= ~(1ull << (w % 64));
+    }
+}
+
+/**
+ * @brief Check if a page is used
+ * @param page page number
+ * @return true, if the page is used or not in the bitmap
+ */
+bool afs_bitmap::used(page_t page) const
+{
+    if (page < 0 || page >= m_count)
+    {
+        return true;
+    }
+
+    return !((m_free[page / 64] >> (page % 64)) & 1);
+}
+
+/**
+ * @brief Get the number of pages in the bitmap
+ * @return number of pages
+ */
+page_t afs_bitmap::size() const
+{
+    return m_count;
+}
+
+/**
+ * @brief Count the free pages
+ * @return number of free pages
+ */
+page_t afs_bitmap::count_free() const
+{
+    page_t nfree = 0;
+    for (size_t w = 0; w < m_free.size(); w++)
+    {
+        nfree += __builtin_popcountll(m_free[w]);
+    }
+
+    return nfree;
+}
+
+/**
+ * @brief Count the free pages in a range
+ * @param first first page of the range
+ * @param end page after the last page of the range
+ * @return number of free pages in the range
+ */
+page_t afs_bitmap::count_free(page_t first, page_t end) const
+{
+    if (first < 0)
+    {
+        first = 0;
+    }
+    if (end > m_count)
+    {
+        end = m_count;
+    }
+
+    page_t nfree = 0;
+    for (page_t page = first; page < end; page = (page | 63) + 1)
+    {
+        uint64_t bits = m_free[page / 64] & (~0ull << (page % 64));
+        if (end - (page & ~(page_t)63) < 64)
+        {
+            bits &= ~0ull >> (64 - (end - (page & ~(page_t)63)));
+        }
+        nfree += __builtin_popcountll(bits);
+    }
+
+    return nfree;
+}
+
+/**
+ * @brief Find the first free page in a range
+ * @param first first page of the range
+ * @param end page after the last page of the range
+ * @return the lowest free page number in the range, or -1 if there is none
+ */
+page_t afs_bitmap::next_free(page_t first, page_t end) const
+{
+    if (first < 0)
+    {
+        first = 0;
+    }
+    if (end > m_count)
+    {
+        end = m_count;
+    }
+    if (first >= end)
+    {
+        return -1;
+    }
+
+    // The rest of the word of the first page
+    size_t w = first / 64;
+    uint64_t bits = m_free[w] & (~0ull << (first % 64));
+    if (!bits)
+    {
+        // Look up the next word with any free page in the summary
+        const size_t next = w + 1;
+        size_t s = next / 64;
+        if (s >= m_summary.size())
+        {
+            return -1;
+        }
+        uint64_t sbits = m_summary[s] & (~0ull << (next % 64));
+        while (!sbits)
+        {
+            if (++s >= m_summary.size())
+            {
+                return -1;
+            }
+            sbits = m_summary[s];
+        }
+        w = s * 64 + __builtin_ctzll(sbits);
+        bits = m_free[w];
+    }
+
+    const page_t page = (page_t)(w * 64 + __builtin_ctzll(bits));
+
+    return page < end ? page : -1;
+}
+
+/**
+ * @brief Find the last free page in a range
+ * @param first first page of the range
+ * @param end page after the last page of the range
+ * @return the highest free page number in the range, or -1 if there is none
+ */
+page_t afs_bitmap::prev_free(page_t first, page_t end) const
+{
+    if (first < 0)
+    {
+        first = 0;
+    }
+    if (end > m_count)
+    {
+        end = m_count;
+    }
+    if (first >= end)
+    {
+        return -1;
+    }
+
+    // The start of the word of the last page
+    const page_t last = end - 1;
+    size_t w = last / 64;
+    uint64_t bits = m_free[w] & (~0ull >> (63 - last % 64));
+    if (!bits)
+    {
+        // Look up the previous word with any free page in the summary
+        if (w == 0)
+        {
+            return -1;
+        }
+        const size_t prev = w - 1;
+        size_t s = prev / 64;
+        uint64_t sbits = m_summary[s] & (~0ull >> (63 - prev % 64));
+        while (!sbits)
+        {
+            if (s-- == 0)
+            {
+                return -1;
+            }
+            sbits = m_summary[s];
+        }
+        w = s * 64 + 63 - __builtin_clzll(sbits);
+        bits = m_free[w];
+    }
+
+    const page_t page = (page_t)(w * 64 + 63 - __builtin_clzll(bits));
+
+    return page >= first ? page : -1;
+}
+
+/**
+ * @brief Find the free page nearest to a page
+ * On equal distance the page after the given page wins.
+ * @param page page number to start from (itself not a candidate)
+ * @param first first page which may be returned if below page
+ * @param end page after the last page which may be returned
+ * @return the free page number nearest to page, or -1 if there is none
+ */
+page_t afs_bitmap::nearest_free(page_t page, page_t first, page_t end) const
+{
+    const page_t after = next_free(page + 1, end);
+    const page_t before = prev_free(first, page);
+
+    if (after < 0)
+    {
+        return before;
+    }
+    if (before < 0)
+    {
+        return after;
+    }
+
+    return after - page <= page - before ? after : before;
+}
+
+/**
+ * @brief Find the first used page in a range
+ * @param first first page of the range
+ * @param end page after the last page of the range
+ * @return the lowest used page number in the range, or -1 if there is none
+ */
+page_t afs_bitmap::next_used(page_t first, page_t end) const
+{
+    if (first < 0)
+    {
+        first = 0;
+    }
+    if (end > m_count)
+    {
+        end = m_count;
+    }
+
+    for (page_t page = first; page < end; page = (page | 63) + 1)
+    {
+        const uint64_t bits = ~m_free[page / 64] & (~0ull << (page % 64));
+        if (bits)
+        {
+            const page_t used = (page & ~(page_t)63) + __builtin_ctzll(bits);
+            return used < end ? used : -1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Find the first run of contiguous free pages in a range
+ * @param first first page of the range
+ * @param end page after the last page of the range
+ * @param count number of free pages needed
+ * @return the first page number of the run, or -1 if there is none
+ */
+page_t afs_bitmap::find_run(page_t first, page_t end, page_t count) const
+{
+    if (end > m_count)
+    {
+        end = m_count;
+    }
+
+    page_t page = next_free(first, end);
+    while (page >= 0 && page + count <= end)
+    {
+        const page_t used = next_used(page, page + count);
+        if (used < 0)
+        {
+            return page;
+        }
+        page = next_free(used + 1, end);
+    }
+
+    return -1;
+}
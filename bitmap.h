@@ -0,0 +1,49 @@
+/*******************************************************************************************
+ *
+ * Alto free page bitmap summary
+ *
+ *******************************************************************************************/
+#if !defined(_BITMAP_H_)
+#define _BITMAP_H_
+
+#include <vector>
+
+#include "afs_types.h"
+
+/**
+ * @brief Class to find free pages quickly
+ *
+ * This keeps a copy of the DiskDescriptor bit table with one bit per free
+ * page, in 64 bit words. A second level has one bit per word of the first
+ * level, set if that word has any free page. A search skips 4096 pages
+ * per summary word and finds the page in a word with ctz/clz, so even a
+ * nearly full disk costs only a few word operations per allocation.
+ *
+ * The bit table in the DiskDescriptor stays the master copy. The caller
+ * updates this one through set() whenever a bit of that table changes.
+ */
+class afs_bitmap
+{
+public:
+    afs_bitmap();
+
+    void assign(const std::vector<word>& bit_table, page_t count);
+    void set(page_t page, bool used);
+    bool used(page_t page) const;
+    page_t size() const;
+    page_t count_free() const;
+    page_t count_free(page_t first, page_t end) const;
+
+    page_t next_free(page_t first, page_t end) const;
+    page_t prev_free(page_t first, page_t end) const;
+    page_t nearest_free(page_t page, page_t first, page_t end) const;
+    page_t next_used(page_t first, page_t end) const;
+    page_t find_run(page_t first, page_t end, page_t count) const;
+
+private:
+    page_t m_count;                         //!< Number of pages in the bitmap
+    std::vector<uint64_t> m_free;           //!< One bit per page, set if the page is free
+    std::vector<uint64_t> m_summary;        //!< One bit per word of m_free, set if that word is not 0
+};
+
+#endif // !defined(_BITMAP_H_)
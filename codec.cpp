@@ -0,0 +1,790 @@
+/*******************************************************************************************
+ *
+ * Alto disk image compression codecs
+ *
+ *******************************************************************************************/
+#include <algorithm>
+#include <unordered_map>
+
+#include "config.h"
+#include "codec.h"
+#include "frames.h"
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#define CODEC_BUFSIZE   (1024*1024)     //!< Size of the read and write buffers
+#define LZW_MAGIC0      0x1f            //!< First byte of a compress(1) file
+#define LZW_MAGIC1      0x9d            //!< Second byte of a compress(1) file
+#define LZW_BLOCK_MODE  0x80            //!< Flag for the CLEAR code being used
+#define LZW_BITS_MASK   0x1f            //!< Mask for the maximum number of bits
+#define LZW_MAXBITS     16              //!< Maximum number of bits written by encode_lzw()
+#define LZW_CLEAR       256             //!< Code to clear the dictionary in block mode
+
+/**
+ * @brief Read until the buffer is full or the end of the file is reached
+ * @return number of bytes read, or -1 on error
+ */
+static ssize_t read_block(int fd, void* buf, size_t size)
+{
+    char* dst = reinterpret_cast<char*>(buf);
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t bytes = ::read(fd, dst + total, size - total);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes < 0)
+        {
+            return -1;
+        }
+
+        if (bytes == 0)
+        {
+            break;
+        }
+
+        total += bytes;
+    }
+
+    return (ssize_t)total;
+}
+
+/**
+ * @brief Write a buffer completely
+ * @return true on success, or false on error (errno is set)
+ */
+static bool write_block(int fd, const void* buf, size_t size)
+{
+    const char* src = reinterpret_cast<const char*>(buf);
+    while (size > 0)
+    {
+        ssize_t bytes = ::write(fd, src, size);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes <= 0)
+        {
+            return false;
+        }
+
+        src += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Align a bit position to the next group of n_bits bytes
+ *
+ * compress(1) reads and writes the codes in groups of n_bits bytes,
+ * and skips the rest of a group when the code size changes.
+ */
+static uint64_t lzw_align(uint64_t pos, uint64_t origin, int n_bits)
+{
+    const uint64_t group = (uint64_t)n_bits * 8;
+    return origin + (pos - origin + group - 1) / group * group;
+}
+
+/**
+ * @brief Determine the compression of a disk image from its file name
+ *
+ * A trailing '~' of a saved copy is ignored.
+ *
+ * @param name file name
+ * @return the codec
+ */
+afs_codec_t afs_codec::from_name(std::string name)
+{
+    while (!name.empty() && name[name.size() - 1] == '~')
+    {
+        name.erase(name.size() - 1);
+    }
+
+    const afs_codec_t codecs[] = {CODEC_LZW, CODEC_GZIP, CODEC_ZSTD, CODEC_FRAMES};
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+    {
+        std::string sfx = suffix(codecs[i]);
+        if (name.size() >= sfx.size() && name.compare(name.size() - sfx.size(), sfx.size(), sfx) == 0)
+        {
+            return codecs[i];
+        }
+    }
+
+    return CODEC_NONE;
+}
+
+/**
+ * @brief Return the file name suffix of a codec
+ */
+const char* afs_codec::suffix(afs_codec_t codec)
+{
+    switch (codec)
+    {
+        case CODEC_LZW:
+            return ".Z";
+        case CODEC_GZIP:
+            return ".gz";
+        case CODEC_ZSTD:
+            return ".zst";
+        case CODEC_FRAMES:
+            return ".afz";
+        default:
+            return "";
+    }
+}
+
+/**
+ * @brief Return true, if a codec was compiled in
+ */
+bool afs_codec::supported(afs_codec_t codec)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+        case CODEC_LZW:
+        case CODEC_FRAMES:
+            return true;
+#if defined(HAVE_ZLIB)
+        case CODEC_GZIP:
+            return true;
+#endif
+#if defined(HAVE_ZSTD)
+        case CODEC_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Decode a compressed file into a buffer
+ * @param codec compression of the file
+ * @param fd file descriptor to read from
+ * @param dst buffer to decode to
+ * @param size size of the buffer; any data beyond it is ignored
+ * @param done pointer to store the number of bytes decoded
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_codec::decode(afs_codec_t codec, int fd, char* dst, size_t size, size_t* done)
+{
+    *done = 0;
+
+    switch (codec)
+    {
+        case CODEC_LZW:
+            return decode_lzw(fd, dst, size, done);
+        case CODEC_GZIP:
+            return decode_gzip(fd, dst, size, done);
+        case CODEC_ZSTD:
+            return decode_zstd(fd, dst, size, done);
+        case CODEC_FRAMES:
+            return afs_frames::decode(fd, dst, size, done);
+        default:
+        {
+            ssize_t bytes = read_block(fd, dst, size);
+            *done = bytes > 0 ? (size_t)bytes : 0;
+            return bytes >= 0;
+        }
+    }
+}
+
+/**
+ * @brief Encode a buffer to a file
+ * @param codec compression to use
+ * @param fd file descriptor to write to
+ * @param src buffer to encode
+ * @param size size of the buffer
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_codec::encode(afs_codec_t codec, int fd, const char* src, size_t size)
+{
+    switch (codec)
+    {
+        case CODEC_LZW:
+            return encode_lzw(fd, src, size);
+        case CODEC_GZIP:
+            return encode_gzip(fd, src, size);
+        case CODEC_ZSTD:
+            return encode_zstd(fd, src, size);
+        case CODEC_FRAMES:
+            return afs_frames::encode(fd, src, size);
+        default:
+            return write_block(fd, src, size);
+    }
+}
+
+/**
+ * @brief Compress a block in memory
+ *
+ * Only CODEC_NONE, CODEC_GZIP (as a zlib stream) and CODEC_ZSTD can be used.
+ *
+ * @param codec compression to use
+ * @param src pointer to the data
+ * @param size number of bytes
+ * @param out vector to store the compressed block
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_codec::compress(afs_codec_t codec, const char* src, size_t size, std::vector<char>& out)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+            out.assign(src, src + size);
+            return true;
+#if defined(HAVE_ZLIB)
+        case CODEC_GZIP:
+        {
+            uLongf length = compressBound((uLong)size);
+            out.resize(length);
+            if (compress2(reinterpret_cast<Bytef*>(out.data()), &length, reinterpret_cast<const Bytef*>(src), (uLong)size, Z_DEFAULT_COMPRESSION) != Z_OK)
+            {
+                errno = EINVAL;
+                return false;
+            }
+            out.resize(length);
+            return true;
+        }
+#endif
+#if defined(HAVE_ZSTD)
+        case CODEC_ZSTD:
+        {
+            out.resize(ZSTD_compressBound(size));
+            size_t length = ZSTD_compress(out.data(), out.size(), src, size, ZSTD_CLEVEL_DEFAULT);
+            if (ZSTD_isError(length))
+            {
+                errno = EINVAL;
+                return false;
+            }
+            out.resize(length);
+            return true;
+        }
+#endif
+        default:
+            errno = ENOTSUP;
+            return false;
+    }
+}
+
+/**
+ * @brief Uncompress a block in memory
+ * @param codec compression of the block
+ * @param src pointer to the compressed block
+ * @param srcsize size of the compressed block
+ * @param dst buffer to decode to
+ * @param size expected size of the data
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_codec::uncompress(afs_codec_t codec, const char* src, size_t srcsize, char* dst, size_t size)
+{
+    switch (codec)
+    {
+        case CODEC_NONE:
+            if (srcsize != size)
+            {
+                errno = EINVAL;
+                return false;
+            }
+            memcpy(dst, src, size);
+            return true;
+#if defined(HAVE_ZLIB)
+        case CODEC_GZIP:
+        {
+            uLongf length = (uLongf)size;
+            if (::uncompress(reinterpret_cast<Bytef*>(dst), &length, reinterpret_cast<const Bytef*>(src), (uLong)srcsize) != Z_OK || length != size)
+            {
+                errno = EINVAL;
+                return false;
+            }
+            return true;
+        }
+#endif
+#if defined(HAVE_ZSTD)
+        case CODEC_ZSTD:
+        {
+            size_t length = ZSTD_decompress(dst, size, src, srcsize);
+            if (ZSTD_isError(length) || length != size)
+            {
+                errno = EINVAL;
+                return false;
+            }
+            return true;
+        }
+#endif
+        default:
+            errno = ENOTSUP;
+            return false;
+    }
+}
+
+/**
+ * @brief Decode a compress(1) .Z file
+ */
+bool afs_codec::decode_lzw(int fd, char* dst, size_t size, size_t* done)
+{
+    std::vector<uint8_t> buf(CODEC_BUFSIZE + 4);
+    ssize_t have = read_block(fd, buf.data(), CODEC_BUFSIZE);
+    if (have < 3 || buf[0] != LZW_MAGIC0 || buf[1] != LZW_MAGIC1)
+    {
+        errno = have < 0 ? errno : EINVAL;
+        return false;
+    }
+
+    const int maxbits = buf[2] & LZW_BITS_MASK;
+    const bool block_mode = (buf[2] & LZW_BLOCK_MODE) != 0;
+    if (maxbits < 9 || maxbits > 16)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    // The window buf holds the bytes [wbeg, wend) of the code stream
+    bool eof = have < CODEC_BUFSIZE;
+    memmove(buf.data(), buf.data() + 3, have - 3);
+    memset(buf.data() + have - 3, 0, 4);
+    size_t wbeg = 0;
+    size_t wend = have - 3;
+
+    const uint32_t maxmaxcode = 1u << maxbits;
+    std::vector<uint16_t> prefix(maxmaxcode);
+    std::vector<uint8_t> suffix(maxmaxcode);
+    std::vector<uint8_t> stack(maxmaxcode + 1);
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        suffix[i] = (uint8_t)i;
+    }
+
+    int n_bits = 9;
+    uint32_t maxcode = (1u << n_bits) - 1;
+    uint32_t free_ent = block_mode ? LZW_CLEAR + 1 : LZW_CLEAR;
+    int32_t oldcode = -1;
+    uint8_t finchar = 0;
+    uint64_t pos = 0;
+    uint64_t origin = 0;
+    size_t out = 0;
+
+    while (out < size)
+    {
+        if (free_ent > maxcode)
+        {
+            pos = origin = lzw_align(pos, origin, n_bits);
+            n_bits++;
+            maxcode = n_bits == maxbits ? maxmaxcode : (1u << n_bits) - 1;
+            continue;
+        }
+
+        // Make sure the next 3 bytes are in the window
+        size_t b = pos >> 3;
+        while (!eof && b + 3 > wend)
+        {
+            size_t keep = b < wend ? wend - b : 0;
+            memmove(buf.data(), buf.data() + (wend - keep - wbeg), keep);
+            wbeg = wend - keep;
+            ssize_t bytes = read_block(fd, buf.data() + keep, CODEC_BUFSIZE - keep);
+            if (bytes < 0)
+            {
+                return false;
+            }
+            wend += bytes;
+            eof = bytes < (ssize_t)(CODEC_BUFSIZE - keep);
+            memset(buf.data() + keep + bytes, 0, 4);
+        }
+
+        if (pos + n_bits > (uint64_t)wend * 8)
+        {
+            break;
+        }
+
+        const uint8_t* p = buf.data() + (b - wbeg);
+        uint32_t code = ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16)) >> (pos & 7);
+        code &= (1u << n_bits) - 1;
+        pos += n_bits;
+
+        if (oldcode == -1)
+        {
+            if (code >= 256)
+            {
+                errno = EINVAL;
+                return false;
+            }
+            oldcode = (int32_t)code;
+            finchar = (uint8_t)code;
+            dst[out++] = (char)finchar;
+            continue;
+        }
+
+        if (code == LZW_CLEAR && block_mode)
+        {
+            free_ent = LZW_CLEAR;
+            pos = origin = lzw_align(pos, origin, n_bits);
+            n_bits = 9;
+            maxcode = (1u << n_bits) - 1;
+            continue;
+        }
+
+        const uint32_t incode = code;
+        size_t sp = 0;
+        if (code >= free_ent)
+        {
+            if (code > free_ent)
+            {
+                errno = EINVAL;
+                return false;
+            }
+            // The KwKwK case
+            stack[sp++] = finchar;
+            code = (uint32_t)oldcode;
+        }
+
+        while (code >= 256)
+        {
+            stack[sp++] = suffix[code];
+            code = prefix[code];
+        }
+        finchar = suffix[code];
+        stack[sp++] = finchar;
+
+        while (sp > 0 && out < size)
+        {
+            dst[out++] = (char)stack[--sp];
+        }
+
+        if (free_ent < maxmaxcode)
+        {
+            prefix[free_ent] = (uint16_t)oldcode;
+            suffix[free_ent] = finchar;
+            free_ent++;
+        }
+        oldcode = (int32_t)incode;
+    }
+
+    *done = out;
+
+    return true;
+}
+
+/**
+ * @brief Encode to a compress(1) .Z file with 16 bit codes in block mode
+ *
+ * The dictionary is cleared whenever it is full.
+ */
+bool afs_codec::encode_lzw(int fd, const char* src, size_t size)
+{
+    std::vector<uint8_t> out;
+    out.reserve(CODEC_BUFSIZE + 64);
+    out.push_back(LZW_MAGIC0);
+    out.push_back(LZW_MAGIC1);
+    out.push_back(LZW_BLOCK_MODE | LZW_MAXBITS);
+
+    if (size == 0)
+    {
+        return write_block(fd, out.data(), out.size());
+    }
+
+    const uint32_t maxmaxcode = 1u << LZW_MAXBITS;
+    std::unordered_map<uint32_t, uint32_t> dict;
+    dict.reserve(maxmaxcode);
+
+    int n_bits = 9;
+    uint32_t maxcode = (1u << n_bits) - 1;
+    uint32_t free_ent = LZW_CLEAR + 1;
+    uint64_t pos = 0;
+    uint64_t origin = 0;
+    uint32_t acc = 0;
+    int nacc = 0;
+    bool ok = true;
+
+    auto put = [&](uint32_t code, int bits)
+    {
+        acc |= code << nacc;
+        nacc += bits;
+        pos += bits;
+        while (nacc >= 8)
+        {
+            out.push_back((uint8_t)acc);
+            acc >>= 8;
+            nacc -= 8;
+        }
+
+        if (out.size() >= CODEC_BUFSIZE)
+        {
+            ok = ok && write_block(fd, out.data(), out.size());
+            out.clear();
+        }
+    };
+
+    auto align = [&]()
+    {
+        uint64_t target = lzw_align(pos, origin, n_bits);
+        while (pos < target)
+        {
+            put(0, (int)std::min<uint64_t>(16, target - pos));
+        }
+        origin = pos;
+    };
+
+    auto emit = [&](uint32_t code)
+    {
+        // The decoder sees free_ent one code later than we do
+        if (free_ent > maxcode + 1)
+        {
+            align();
+            n_bits++;
+            maxcode = n_bits == LZW_MAXBITS ? maxmaxcode : (1u << n_bits) - 1;
+        }
+        put(code, n_bits);
+    };
+
+    uint32_t ent = (uint8_t)src[0];
+    for (size_t i = 1; i < size && ok; i++)
+    {
+        const uint8_t c = (uint8_t)src[i];
+        const uint32_t key = (ent << 8) | c;
+        std::unordered_map<uint32_t, uint32_t>::const_iterator it = dict.find(key);
+        if (it != dict.end())
+        {
+            ent = it->second;
+            continue;
+        }
+
+        emit(ent);
+        if (free_ent < maxmaxcode)
+        {
+            dict[key] = free_ent++;
+        }
+        else
+        {
+            emit(LZW_CLEAR);
+            align();
+            dict.clear();
+            free_ent = LZW_CLEAR + 1;
+            n_bits = 9;
+            maxcode = (1u << n_bits) - 1;
+        }
+        ent = c;
+    }
+    emit(ent);
+
+    if (nacc > 0)
+    {
+        out.push_back((uint8_t)acc);
+    }
+
+    return ok && write_block(fd, out.data(), out.size());
+}
+
+/**
+ * @brief Decode a gzip (or zlib) file
+ */
+bool afs_codec::decode_gzip(int fd, char* dst, size_t size, size_t* done)
+{
+#if defined(HAVE_ZLIB)
+    std::vector<unsigned char> buf(CODEC_BUFSIZE);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    // 32 + 15: detect gzip or zlib headers, 32K window
+    if (inflateInit2(&zs, 32 + 15) != Z_OK)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    zs.next_out = reinterpret_cast<Bytef*>(dst);
+    zs.avail_out = (uInt)size;
+
+    int res = Z_OK;
+    while (zs.avail_out > 0)
+    {
+        if (zs.avail_in == 0)
+        {
+            ssize_t bytes = read_block(fd, buf.data(), buf.size());
+            if (bytes <= 0)
+            {
+                res = bytes < 0 ? Z_ERRNO : Z_STREAM_END;
+                break;
+            }
+            zs.next_in = buf.data();
+            zs.avail_in = (uInt)bytes;
+        }
+
+        res = inflate(&zs, Z_NO_FLUSH);
+        if (res == Z_STREAM_END && zs.avail_in > 0)
+        {
+            // Concatenated gzip members
+            res = inflateReset(&zs);
+        }
+
+        if (res != Z_OK && res != Z_STREAM_END)
+        {
+            break;
+        }
+    }
+
+    *done = size - zs.avail_out;
+    inflateEnd(&zs);
+
+    if (res != Z_OK && res != Z_STREAM_END)
+    {
+        errno = res == Z_ERRNO ? errno : EINVAL;
+        return false;
+    }
+
+    return true;
+#else
+    (void)fd; (void)dst; (void)size; (void)done;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+/**
+ * @brief Encode to a gzip file
+ */
+bool afs_codec::encode_gzip(int fd, const char* src, size_t size)
+{
+#if defined(HAVE_ZLIB)
+    std::vector<unsigned char> buf(CODEC_BUFSIZE);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    // 16 + 15: write a gzip header, 32K window
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src));
+    zs.avail_in = (uInt)size;
+
+    bool ok = true;
+    int res = Z_OK;
+    while (ok && res != Z_STREAM_END)
+    {
+        zs.next_out = buf.data();
+        zs.avail_out = (uInt)buf.size();
+        res = deflate(&zs, Z_FINISH);
+        if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+        {
+            errno = EINVAL;
+            ok = false;
+            break;
+        }
+        ok = write_block(fd, buf.data(), buf.size() - zs.avail_out);
+    }
+
+    deflateEnd(&zs);
+
+    return ok;
+#else
+    (void)fd; (void)src; (void)size;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+/**
+ * @brief Decode a Zstandard file
+ */
+bool afs_codec::decode_zstd(int fd, char* dst, size_t size, size_t* done)
+{
+#if defined(HAVE_ZSTD)
+    std::vector<char> buf(CODEC_BUFSIZE);
+    ZSTD_DStream* zds = ZSTD_createDStream();
+    if (!zds)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    ZSTD_initDStream(zds);
+    ZSTD_outBuffer output = {dst, size, 0};
+    ZSTD_inBuffer input = {buf.data(), 0, 0};
+    bool ok = true;
+
+    while (output.pos < output.size)
+    {
+        if (input.pos == input.size)
+        {
+            ssize_t bytes = read_block(fd, buf.data(), buf.size());
+            if (bytes <= 0)
+            {
+                ok = bytes == 0;
+                break;
+            }
+            input.size = (size_t)bytes;
+            input.pos = 0;
+        }
+
+        size_t res = ZSTD_decompressStream(zds, &output, &input);
+        if (ZSTD_isError(res))
+        {
+            errno = EINVAL;
+            ok = false;
+            break;
+        }
+    }
+
+    *done = output.pos;
+    ZSTD_freeDStream(zds);
+
+    return ok;
+#else
+    (void)fd; (void)dst; (void)size; (void)done;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
+/**
+ * @brief Encode to a Zstandard file
+ */
+bool afs_codec::encode_zstd(int fd, const char* src, size_t size)
+{
+#if defined(HAVE_ZSTD)
+    std::vector<char> buf(CODEC_BUFSIZE);
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    if (!cctx)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    ZSTD_inBuffer input = {src, size, 0};
+    bool ok = true;
+    size_t left = 1;
+
+    while (ok && left != 0)
+    {
+        ZSTD_outBuffer output = {buf.data(), buf.size(), 0};
+        left = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(left))
+        {
+            errno = EINVAL;
+            ok = false;
+            break;
+        }
+        ok = write_block(fd, buf.data(), output.pos);
+    }
+
+    ZSTD_freeCCtx(cctx);
+
+    return ok;
+#else
+    (void)fd; (void)src; (void)size;
+    errno = ENOTSUP;
+    return false;
+#endif
+}
@@ -0,0 +1,51 @@
+/*******************************************************************************************
+ *
+ * Alto disk image compression codecs
+ *
+ *******************************************************************************************/
+#if !defined(_CODEC_H_)
+#define _CODEC_H_
+
+#include "afs_types.h"
+
+/**
+ * @brief Compression formats of disk image files
+ */
+typedef enum {
+    CODEC_NONE,                             //!< Not compressed
+    CODEC_LZW,                              //!< compress(1) LZW, suffix .Z
+    CODEC_GZIP,                             //!< gzip, suffix .gz
+    CODEC_ZSTD,                             //!< Zstandard, suffix .zst
+    CODEC_FRAMES                            //!< Seekable frames (see afs_frames), suffix .afz
+}   afs_codec_t;
+
+/**
+ * @brief Class with the built-in streaming decoders and encoders
+ *
+ * The decoders read the compressed file in large blocks and decode
+ * straight into the caller's buffer, i.e. the page store of a disk.
+ * gzip needs zlib (HAVE_ZLIB) and Zstandard needs libzstd (HAVE_ZSTD).
+ */
+class afs_codec
+{
+public:
+    static afs_codec_t from_name(std::string name);
+    static const char* suffix(afs_codec_t codec);
+    static bool supported(afs_codec_t codec);
+
+    static bool decode(afs_codec_t codec, int fd, char* dst, size_t size, size_t* done);
+    static bool encode(afs_codec_t codec, int fd, const char* src, size_t size);
+
+    static bool compress(afs_codec_t codec, const char* src, size_t size, std::vector<char>& out);
+    static bool uncompress(afs_codec_t codec, const char* src, size_t srcsize, char* dst, size_t size);
+
+private:
+    static bool decode_lzw(int fd, char* dst, size_t size, size_t* done);
+    static bool encode_lzw(int fd, const char* src, size_t size);
+    static bool decode_gzip(int fd, char* dst, size_t size, size_t* done);
+    static bool encode_gzip(int fd, const char* src, size_t size);
+    static bool decode_zstd(int fd, char* dst, size_t size, size_t* done);
+    static bool encode_zstd(int fd, const char* src, size_t size);
+};
+
+#endif // !defined(_CODEC_H_)
@@ -0,0 +1,137 @@
+/*******************************************************************************************
+ *
+ * CRC-32C (Castagnoli) checksum
+ *
+ *******************************************************************************************/
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+/**
+ * @brief Build the lookup table for the reflected polynomial 0x82f63b78
+ */
+static const uint32_t* crc32c_table()
+{
+    static uint32_t table[256];
+    static bool init = false;
+
+    if (!init)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+            }
+            table[i] = crc;
+        }
+        init = true;
+    }
+
+    return table;
+}
+
+#if defined(CRC32C_SSE42)
+/**
+ * @brief Update a CRC-32C checksum using the SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* src, size_t size)
+{
+    uint64_t crc64 = ~crc;
+    while (size > 0 && ((uintptr_t)src & 7))
+    {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *src++);
+        size--;
+    }
+
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        src += 8;
+        size -= 8;
+    }
+
+    while (size--)
+    {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *src++);
+    }
+
+    return ~(uint32_t)crc64;
+}
+
+static bool crc32c_hw_supported()
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(CRC32C_ARM)
+/**
+ * @brief Update a CRC-32C checksum using the ARMv8 crc32c instructions
+ */
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* src, size_t size)
+{
+    crc = ~crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        crc = __crc32cd(crc, word);
+        src += 8;
+        size -= 8;
+    }
+
+    while (size--)
+    {
+        crc = __crc32cb(crc, *src++);
+    }
+
+    return ~crc;
+}
+
+static bool crc32c_hw_supported()
+{
+    return true;
+}
+#endif
+
+/**
+ * @brief Update a CRC-32C checksum with a block of data
+ *
+ * The crc32 instruction of the CPU is used, if there is one.
+ *
+ * @param crc previous checksum, 0 for the first block
+ * @param data pointer to the data
+ * @param size number of bytes
+ * @return the new checksum
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+{
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+#if defined(CRC32C_SSE42) || defined(CRC32C_ARM)
+    static const bool hw = crc32c_hw_supported();
+    if (hw)
+    {
+        return crc32c_hw(crc, src, size);
+    }
+#endif
+
+    static const uint32_t* table = crc32c_table();
+
+    crc = ~crc;
+    while (size--)
+    {
+        crc = table[(crc ^ *src++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
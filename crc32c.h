@@ -0,0 +1,14 @@
+/*******************************************************************************************
+ *
+ * CRC-32C (Castagnoli) checksum
+ *
+ *******************************************************************************************/
+#if !defined(_CRC32C_H_)
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+#endif // !defined(_CRC32C_H_)
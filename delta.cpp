@@ -0,0 +1,414 @@
+/*******************************************************************************************
+ *
+ * Alto disk image overlay delta file
+ *
+ *******************************************************************************************/
+#include "delta.h"
+#include "crc32c.h"
+
+#define DELTA_MAGIC         0x32444641  //!< "AFD2" in little endian
+#define DELTA_HEADER_SIZE   16          //!< Size of the header
+#define DELTA_SLOT_SIZE     (8 + sizeof(afs_page_t))   //!< Size of one slot
+#define DELTA_COMMIT        0xffffffff  //!< Page number of a commit slot
+#define DELTA_COMPACT_MIN   1024        //!< Minimum number of slots before compacting
+
+static void set32(char* dst, uint32_t val)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        dst[i] = (char)(val >> (8 * i));
+    }
+}
+
+static uint32_t get32(const char* src)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(src);
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool pwrite_full(int fd, const char* src, size_t size, off_t offs)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pwrite(fd, src, size, offs);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes <= 0)
+        {
+            return false;
+        }
+
+        src += bytes;
+        offs += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+static bool flush_fd(int fd)
+{
+#if defined(__APPLE__)
+    return fcntl(fd, F_FULLFSYNC) == 0 || fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+}
+
+static off_t slot_offset(size_t slot)
+{
+    return DELTA_HEADER_SIZE + (off_t)slot * DELTA_SLOT_SIZE;
+}
+
+static bool write_header(int fd, size_t npages)
+{
+    char header[DELTA_HEADER_SIZE];
+    set32(header, DELTA_MAGIC);
+    set32(header + 4, (uint32_t)npages);
+    set32(header + 8, sizeof(afs_page_t));
+    set32(header + 12, 0);
+    return pwrite_full(fd, header, sizeof(header), 0);
+}
+
+afs_delta::afs_delta() :
+    m_fd(-1),
+    m_name(),
+    m_slot(),
+    m_count(0),
+    m_end(0),
+    m_next(0),
+    m_sequence(0),
+    m_crc(0),
+    m_pending()
+{
+}
+
+afs_delta::~afs_delta()
+{
+    close();
+}
+
+/**
+ * @brief Open (or create) a delta file and apply its pages
+ *
+ * The page slots of each complete commit are applied in order.
+ * The scan stops at the first slot with a bad checksum, or a commit
+ * which doesn't match the slots before it, e.g. from a crash during
+ * a writeback, and the file is cut off after the last good commit.
+ *
+ * @param name file name of the delta file
+ * @param npages number of pages of the base image
+ * @param apply function called with each page stored in the file
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_delta::open(std::string name, size_t npages, std::function<void(page_t, const afs_page_t*)> apply)
+{
+    close();
+
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    char header[DELTA_HEADER_SIZE];
+    ssize_t bytes = pread(fd, header, sizeof(header), 0);
+    if (bytes == 0)
+    {
+        if (!write_header(fd, npages))
+        {
+            int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+    }
+    else if (bytes != (ssize_t)sizeof(header) || get32(header) != DELTA_MAGIC ||
+             get32(header + 4) != npages || get32(header + 8) != sizeof(afs_page_t))
+    {
+        ::close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    m_fd = fd;
+    m_name = name;
+    m_slot.assign(npages, -1);
+    m_count = 0;
+    m_end = 0;
+    m_sequence = 0;
+
+    std::vector<std::pair<page_t, int32_t> > pending;
+    std::vector<afs_page_t> data;
+    uint32_t crc = 0;
+    char slot[DELTA_SLOT_SIZE];
+    size_t n = 0;
+    while (pread(m_fd, slot, sizeof(slot), slot_offset(n)) == (ssize_t)sizeof(slot))
+    {
+        const uint32_t page = get32(slot);
+        if (page == DELTA_COMMIT)
+        {
+            if (get32(slot + 4) != m_sequence || get32(slot + 8) != pending.size() || get32(slot + 12) != crc)
+            {
+                break;
+            }
+
+            for (size_t i = 0; i < pending.size(); i++)
+            {
+                const page_t p = pending[i].first;
+                if (m_slot[p] < 0)
+                {
+                    m_count++;
+                }
+                m_slot[p] = pending[i].second;
+                apply(p, &data[i]);
+            }
+
+            pending.clear();
+            data.clear();
+            crc = 0;
+            m_sequence++;
+            m_end = ++n;
+            continue;
+        }
+
+        const afs_page_t* page_data = reinterpret_cast<const afs_page_t*>(slot + 8);
+        if (page >= npages || get32(slot + 4) != crc32c(0, page_data, sizeof(*page_data)))
+        {
+            break;
+        }
+
+        pending.push_back(std::make_pair((page_t)page, (int32_t)n));
+        data.push_back(*page_data);
+        crc = crc32c(crc, slot, sizeof(slot));
+        n++;
+    }
+
+    // Drop the slots of an incomplete writeback
+    if (ftruncate(m_fd, slot_offset(m_end)) < 0)
+    {
+        int err = errno;
+        close();
+        errno = err;
+        return false;
+    }
+
+    m_next = m_end;
+    m_crc = 0;
+    m_pending.clear();
+
+    return true;
+}
+
+void afs_delta::close()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    m_name.clear();
+    m_slot.clear();
+    m_count = 0;
+    m_end = 0;
+    m_next = 0;
+    m_sequence = 0;
+    m_crc = 0;
+    m_pending.clear();
+}
+
+bool afs_delta::active() const
+{
+    return m_fd >= 0;
+}
+
+/**
+ * @brief Return the number of pages with a committed copy in the delta file
+ */
+size_t afs_delta::count() const
+{
+    return m_count;
+}
+
+/**
+ * @brief Append a page to the delta file
+ *
+ * The page becomes visible to the next open() only after commit().
+ * If the write fails, the slots written before are kept for the next
+ * commit(), and a retry overwrites the failed slot.
+ *
+ * @param page page number relative to the base image
+ * @param data pointer to the page contents
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_delta::write(page_t page, const afs_page_t* data)
+{
+    if (m_fd < 0 || page < 0 || (size_t)page >= m_slot.size())
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    char buf[DELTA_SLOT_SIZE];
+    set32(buf, (uint32_t)page);
+    set32(buf + 4, crc32c(0, data, sizeof(*data)));
+    memcpy(buf + 8, data, sizeof(*data));
+
+    if (!pwrite_full(m_fd, buf, sizeof(buf), slot_offset(m_next)))
+    {
+        return false;
+    }
+
+    m_crc = crc32c(m_crc, buf, sizeof(buf));
+    m_pending.push_back(std::make_pair(page, (int32_t)m_next));
+    m_next++;
+
+    return true;
+}
+
+/**
+ * @brief Write a commit slot
+ * @param fd file descriptor of the delta file
+ * @param slot slot number of the commit
+ * @param nslots number of page slots before the commit
+ * @param crc CRC-32C of the page slots
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_delta::write_commit(int fd, size_t slot, uint32_t nslots, uint32_t crc)
+{
+    char buf[DELTA_SLOT_SIZE];
+    memset(buf, 0, sizeof(buf));
+    set32(buf, DELTA_COMMIT);
+    set32(buf + 4, m_sequence);
+    set32(buf + 8, nslots);
+    set32(buf + 12, crc);
+    return pwrite_full(fd, buf, sizeof(buf), slot_offset(slot));
+}
+
+/**
+ * @brief Commit the pages written since the last commit
+ *
+ * No sync is done between the pages and the commit slot: the commit
+ * holds the CRC-32C of its page slots, so a commit which reached the
+ * disk before its pages is rejected by open().
+ *
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_delta::commit()
+{
+    if (m_fd < 0)
+    {
+        errno = EBADF;
+        return false;
+    }
+
+    if (m_pending.empty())
+    {
+        return true;
+    }
+
+    if (!write_commit(m_fd, m_next, (uint32_t)m_pending.size(), m_crc))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < m_pending.size(); i++)
+    {
+        const page_t page = m_pending[i].first;
+        if (m_slot[page] < 0)
+        {
+            m_count++;
+        }
+        m_slot[page] = m_pending[i].second;
+    }
+
+    m_pending.clear();
+    m_crc = 0;
+    m_sequence++;
+    m_end = ++m_next;
+
+    if (m_end >= DELTA_COMPACT_MIN && m_end > 2 * m_count)
+    {
+        // A failed compaction leaves the old file, which is still valid
+        compact();
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write the latest copy of each page to name.tmp and rename it over the delta file
+ *
+ * The new file is flushed before the rename, so that it replaces
+ * the old one only when it is complete.
+ *
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_delta::compact()
+{
+    std::string temp = m_name + ".tmp";
+    int fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    std::vector<int32_t> slots(m_slot.size(), -1);
+    const uint32_t sequence = m_sequence;
+    m_sequence = 0;
+
+    bool ok = write_header(fd, m_slot.size());
+    uint32_t crc = 0;
+    size_t n = 0;
+    char buf[DELTA_SLOT_SIZE];
+    for (size_t page = 0; ok && page < m_slot.size(); page++)
+    {
+        if (m_slot[page] < 0)
+        {
+            continue;
+        }
+
+        ok = pread(m_fd, buf, sizeof(buf), slot_offset(m_slot[page])) == (ssize_t)sizeof(buf) &&
+             pwrite_full(fd, buf, sizeof(buf), slot_offset(n));
+        crc = crc32c(crc, buf, sizeof(buf));
+        slots[page] = (int32_t)n++;
+    }
+
+    ok = ok && write_commit(fd, n, (uint32_t)n, crc);
+    if (!ok || !flush_fd(fd) || rename(temp.c_str(), m_name.c_str()) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        unlink(temp.c_str());
+        m_sequence = sequence;
+        errno = err;
+        return false;
+    }
+
+    ::close(m_fd);
+    m_fd = fd;
+    m_slot.swap(slots);
+    m_sequence = 1;
+    m_end = m_next = n + 1;
+
+    return true;
+}
+
+/**
+ * @brief Flush the delta file to stable storage
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_delta::sync()
+{
+    if (m_fd < 0)
+    {
+        errno = EBADF;
+        return false;
+    }
+
+    return flush_fd(m_fd);
+}
@@ -0,0 +1,62 @@
+/*******************************************************************************************
+ *
+ * Alto disk image overlay delta file
+ *
+ *******************************************************************************************/
+#if !defined(_DELTA_H_)
+#define _DELTA_H_
+
+#include <functional>
+
+#include "afs_types.h"
+
+/**
+ * @brief Class to keep the changed pages of a read-only base image in a delta file
+ *
+ * The file starts with a header ("AFD2", number of pages, page size, 0 as
+ * 32 bit little endian numbers), followed by slots of the page size plus 8
+ * bytes. A page slot holds the page number, the CRC-32C of the page (32 bit
+ * each) and the page itself.
+ *
+ * Slots are only ever appended. Each writeback appends the changed pages,
+ * followed by a commit slot (page number 0xffffffff) with a sequence number,
+ * the number of page slots and the CRC-32C of these slots. When the file is
+ * opened, only the page slots of complete commits are applied, so a crash
+ * during a writeback leaves the pages of the previous one. Whatever follows
+ * the last complete commit is cut off.
+ *
+ * When the file holds more than twice as many slots as there are changed
+ * pages (and at least DELTA_COMPACT_MIN slots), the latest copy of each page
+ * is written to a new file, which then replaces the old one.
+ */
+class afs_delta
+{
+public:
+    afs_delta();
+    ~afs_delta();
+
+    bool open(std::string name, size_t npages, std::function<void(page_t, const afs_page_t*)> apply);
+    void close();
+    bool active() const;
+    size_t count() const;
+
+    bool write(page_t page, const afs_page_t* data);
+    bool commit();
+    bool sync();
+
+private:
+    bool write_commit(int fd, size_t slot, uint32_t nslots, uint32_t crc);
+    bool compact();
+
+    int m_fd;                               //!< File descriptor of the delta file, or -1
+    std::string m_name;                     //!< File name of the delta file
+    std::vector<int32_t> m_slot;            //!< Slot number of the committed copy of each page, or -1
+    size_t m_count;                         //!< Number of pages with a committed copy
+    size_t m_end;                           //!< Number of slots up to and including the last commit
+    size_t m_next;                          //!< Number of slots including those written since the last commit
+    uint32_t m_sequence;                    //!< Sequence number of the next commit
+    uint32_t m_crc;                         //!< CRC-32C of the slots written since the last commit
+    std::vector<std::pair<page_t, int32_t> > m_pending; //!< Pages and slots written since the last commit
+};
+
+#endif // !defined(_DELTA_H_)
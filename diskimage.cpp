@@ -0,0 +1,810 @@
+/*******************************************************************************************
+ *
+ * Alto disk image page storage
+ *
+ *******************************************************************************************/
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "diskimage.h"
+#include "crc32c.h"
+
+#define SAVE_CHUNK      (1024 * 1024)   //!< Size of the writes done by save()
+#define SIDECAR_SUFFIX  ".crc"          //!< Suffix of the checksum file of a saved image
+
+/**
+ * @brief Flush a file to stable storage
+ * @param fd file descriptor
+ * @return true on success, or false on error (errno is set)
+ */
+static bool flush_fd(int fd)
+{
+#if defined(__APPLE__)
+    // There is no fdatasync() on OS X; F_FULLFSYNC also flushes the drive cache
+    return fcntl(fd, F_FULLFSYNC) == 0 || fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+}
+
+/**
+ * @brief Flush the directory containing a file, so that a rename is durable
+ * @param name file name
+ */
+static void flush_dir(const std::string& name)
+{
+    size_t pos = name.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : pos == 0 ? "/" : name.substr(0, pos);
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+/**
+ * @brief Write the checksum file of an image, replacing it atomically
+ * @param name file name of the checksum file
+ * @param crc CRC-32C of the pages
+ * @param size size of the pages in bytes
+ * @return true on success, or false on error (errno is set)
+ */
+static bool write_sidecar(const std::string& name, uint32_t crc, size_t size)
+{
+    std::string temp = name + ".tmp";
+    FILE* fp = fopen(temp.c_str(), "w");
+    if (!fp)
+    {
+        return false;
+    }
+
+    bool ok = fprintf(fp, "crc32c %08x %lu\n", crc, (unsigned long)size) > 0;
+    ok = fflush(fp) == 0 && ok;
+    ok = flush_fd(fileno(fp)) && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(temp.c_str(), name.c_str()) < 0)
+    {
+        int err = errno;
+        unlink(temp.c_str());
+        errno = err;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read the checksum file of an image
+ * @param name file name of the checksum file
+ * @param crc pointer to store the CRC-32C of the pages
+ * @param size pointer to store the size of the pages in bytes
+ * @return true on success, or false if there is no valid checksum file
+ */
+static bool read_sidecar(const std::string& name, uint32_t* crc, size_t* size)
+{
+    FILE* fp = fopen(name.c_str(), "r");
+    if (!fp)
+    {
+        return false;
+    }
+
+    unsigned int value = 0;
+    unsigned long length = 0;
+    bool ok = fscanf(fp, "crc32c %x %lu", &value, &length) == 2;
+    fclose(fp);
+
+    *crc = value;
+    *size = length;
+
+    return ok;
+}
+
+afs_diskimage::afs_diskimage() :
+    m_pages(0),
+    m_npages(0),
+    m_fd(-1),
+    m_inplace(false),
+    m_save_fd(-1),
+    m_written(false),
+    m_dirty(),
+    m_ndirty(0),
+    m_dirty_mutex(),
+    m_frames(),
+    m_loaded(),
+    m_load_mutex(),
+    m_delta(),
+    m_sidecar(),
+    m_sealed(false)
+{
+}
+
+afs_diskimage::~afs_diskimage()
+{
+    unmap();
+}
+
+/**
+ * @brief Map a disk image file into memory
+ *
+ * The file must be at least NPAGES pages long; shorter files can't be
+ * mapped, because accessing pages beyond the end of the file would fault.
+ *
+ * @param name file name of the disk image
+ * @param inplace if true, writeback() writes the changes to the file
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::map(std::string name, bool inplace)
+{
+    unmap();
+
+    int fd = ::open(name.c_str(), inplace ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    const size_t size = NPAGES * sizeof(afs_page_t);
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < size)
+    {
+        ::close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        return false;
+    }
+
+    m_pages = reinterpret_cast<afs_page_t*>(addr);
+    m_npages = NPAGES;
+    m_fd = fd;
+    m_inplace = inplace;
+    clear_dirty();
+
+    if (inplace)
+    {
+        // writeback() changes the file, so its checksum file becomes invalid
+        m_sidecar = name + SIDECAR_SUFFIX;
+        m_sealed = access(m_sidecar.c_str(), F_OK) == 0;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Allocate an anonymous, zero filled mapping for NPAGES pages
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::allocate()
+{
+    unmap();
+
+    const size_t size = NPAGES * sizeof(afs_page_t);
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_pages = reinterpret_cast<afs_page_t*>(addr);
+    m_npages = NPAGES;
+    m_fd = -1;
+    m_inplace = false;
+    clear_dirty();
+
+    return true;
+}
+
+/**
+ * @brief Open a seekable .afz image, whose frames are decoded on demand
+ * @param name file name of the container
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::open_frames(std::string name)
+{
+    if (!allocate())
+    {
+        return false;
+    }
+
+    if (!m_frames.open(name))
+    {
+        return false;
+    }
+
+    if (m_frames.npages() != m_npages)
+    {
+        m_frames.close();
+        errno = EINVAL;
+        return false;
+    }
+
+    std::vector<std::atomic<char> >(m_frames.nframes()).swap(m_loaded);
+    std::vector<std::mutex>(m_frames.nframes()).swap(m_load_mutex);
+
+    return true;
+}
+
+/**
+ * @brief Attach an overlay delta file to the loaded pages
+ *
+ * The pages stored in the delta file replace the pages of the image.
+ * They are copied into the private mapping, so that every page accessor
+ * sees the merged image, while the image file is never written.
+ *
+ * @param name file name of the delta file
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::attach_delta(std::string name)
+{
+    return m_delta.open(name, m_npages, [this](page_t page, const afs_page_t* data)
+    {
+        afs_page_t* dst = this->page(page);
+        if (dst)
+        {
+            *dst = *data;
+        }
+    });
+}
+
+/**
+ * @brief Decode a frame into the pages, if it wasn't already
+ *
+ * A frame already decoded takes no lock. Otherwise only the lock of
+ * this frame is taken, so readers of other frames don't wait.
+ *
+ * @param frame frame number
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::load_frame(size_t frame) const
+{
+    if (frame >= m_loaded.size() || m_loaded[frame].load(std::memory_order_acquire))
+    {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(m_load_mutex[frame]);
+    if (m_loaded[frame].load(std::memory_order_relaxed))
+    {
+        return true;
+    }
+
+    char* dst = data() + frame * m_frames.frame_pages() * sizeof(afs_page_t);
+    if (!m_frames.load(frame, dst))
+    {
+        return false;
+    }
+
+    m_loaded[frame].store(1, std::memory_order_release);
+
+    return true;
+}
+
+/**
+ * @brief Decode all frames, which were not yet decoded
+ *
+ * The frames are independent, so they are decoded by as many threads
+ * as there are CPUs, each one taking the next frame not yet taken.
+ *
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::load_all() const
+{
+    const size_t nframes = m_loaded.size();
+    const size_t nthreads = std::min<size_t>(nframes, std::max(1u, std::thread::hardware_concurrency()));
+    std::atomic<size_t> next(0);
+    std::atomic<int> error(0);
+
+    auto worker = [&]()
+    {
+        size_t frame;
+        while (error == 0 && (frame = next++) < nframes)
+        {
+            if (!load_frame(frame))
+            {
+                error = errno ? errno : EIO;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < nthreads; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (error != 0)
+    {
+        errno = error;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Release the mapping and close the image file
+ */
+void afs_diskimage::unmap()
+{
+    if (m_pages)
+    {
+        munmap(m_pages, size());
+        m_pages = 0;
+        m_npages = 0;
+    }
+
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    if (m_save_fd >= 0)
+    {
+        ::close(m_save_fd);
+        m_save_fd = -1;
+    }
+
+    m_inplace = false;
+    m_written = false;
+    m_dirty.clear();
+    m_frames.close();
+    m_loaded.clear();
+    m_load_mutex.clear();
+    m_delta.close();
+    m_ndirty = 0;
+    m_sidecar.clear();
+    m_sealed = false;
+}
+
+/**
+ * @brief Compare the pages with the checksum file of an image
+ *
+ * A checksum file name.crc is written by save() and seal(). If it matches,
+ * the pages are exactly what fuse-alto wrote the last time.
+ *
+ * @param name file name of the image
+ * @return true, if the checksum file exists and matches the pages
+ */
+bool afs_diskimage::verify(std::string name) const
+{
+    // Checking a lazily decoded image would decode all of it
+    if (lazy())
+    {
+        return false;
+    }
+
+    uint32_t crc;
+    size_t length;
+    if (!read_sidecar(name + SIDECAR_SUFFIX, &crc, &length) || length != size() || !load_all())
+    {
+        return false;
+    }
+
+    return crc32c(0, data(), size()) == crc;
+}
+
+/**
+ * @brief Write the checksum file for the file writeback() writes to
+ *
+ * This is done when unmounting, after the last writeback(), so that
+ * the next mount can verify() the image.
+ *
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::seal()
+{
+    if (m_sealed || m_sidecar.empty() || dirty_count() > 0 || m_delta.active())
+    {
+        return true;
+    }
+
+    if (!load_all() || !write_sidecar(m_sidecar, crc32c(0, data(), size()), size()))
+    {
+        return false;
+    }
+
+    m_sealed = true;
+
+    return true;
+}
+
+/**
+ * @brief Write all pages to a file
+ *
+ * The pages are written to name.tmp, which is flushed and then renamed
+ * to name, so that a crash never leaves a partly written image behind.
+ * The CRC-32C of the pages is computed while writing them, and stored
+ * in the checksum file name.crc.
+ *
+ * An uncompressed file is kept open, so that later calls to writeback()
+ * only have to write the pages which changed in the meantime.
+ *
+ * @param name file name to write to
+ * @param codec compression to use for the file
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::save(std::string name, afs_codec_t codec)
+{
+    if (m_save_fd >= 0)
+    {
+        ::close(m_save_fd);
+        m_save_fd = -1;
+    }
+
+    if (!load_all())
+    {
+        return false;
+    }
+
+    std::string temp = name + ".tmp";
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    uint32_t crc = 0;
+    bool ok = true;
+    if (codec == CODEC_NONE)
+    {
+        // Checksum each chunk right before writing it, while it is in the cache
+        for (size_t offs = 0; ok && offs < size(); offs += SAVE_CHUNK)
+        {
+            size_t length = std::min<size_t>(SAVE_CHUNK, size() - offs);
+            crc = crc32c(crc, data() + offs, length);
+            ok = afs_codec::encode(CODEC_NONE, fd, data() + offs, length);
+        }
+    }
+    else
+    {
+        crc = crc32c(0, data(), size());
+        ok = afs_codec::encode(codec, fd, data(), size());
+    }
+
+    if (!ok || !flush_fd(fd) || rename(temp.c_str(), name.c_str()) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        unlink(temp.c_str());
+        errno = err;
+        return false;
+    }
+
+    flush_dir(name);
+
+    if (codec == CODEC_NONE)
+    {
+        m_save_fd = fd;
+    }
+    else
+    {
+        ::close(fd);
+    }
+
+    m_sidecar = name + SIDECAR_SUFFIX;
+    m_sealed = write_sidecar(m_sidecar, crc, size());
+    m_written = true;
+    clear_dirty();
+
+    return true;
+}
+
+/**
+ * @brief Write the dirty pages to the image file, or to the saved copy
+ *
+ * Consecutive dirty pages are coalesced into runs, so that each run
+ * takes one pwrite().
+ *
+ * @param runs optional pointer to store the number of runs written
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::writeback(size_t* runs)
+{
+    if (runs)
+    {
+        *runs = 0;
+    }
+
+    const int fd = m_inplace ? m_fd : m_save_fd;
+    if (fd < 0 && !m_delta.active())
+    {
+        errno = EBADF;
+        return false;
+    }
+
+    // Pages marked dirty from now on are left to the next writeback
+    size_t ndirty;
+    std::vector<uint64_t> dirty = take_dirty(&ndirty);
+    const std::vector<uint64_t> taken = m_delta.active() ? dirty : std::vector<uint64_t>();
+    auto is_dirty = [&dirty](size_t page) { return (dirty[page / 64] >> (page % 64)) & 1; };
+
+    if (ndirty > 0 && m_sealed && !m_delta.active())
+    {
+        // The file no longer matches its checksum; seal() writes a new one
+        unlink(m_sidecar.c_str());
+        m_sealed = false;
+    }
+
+    size_t page = 0;
+    while (ndirty > 0 && page < m_npages)
+    {
+        // Skip over words without dirty pages
+        if (dirty[page / 64] == 0)
+        {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+
+        if (!is_dirty(page))
+        {
+            page++;
+            continue;
+        }
+
+        size_t last = page;
+        while (last + 1 < m_npages && is_dirty(last + 1))
+        {
+            last++;
+        }
+
+        bool ok = true;
+        if (m_delta.active())
+        {
+            // The pages are appended to the delta file
+            for (size_t i = page; ok && i <= last; i++)
+            {
+                ok = m_delta.write((page_t)i, &m_pages[i]);
+            }
+        }
+        else
+        {
+            const char* src = data() + page * sizeof(afs_page_t);
+            size_t length = (last + 1 - page) * sizeof(afs_page_t);
+            off_t offs = (off_t)(page * sizeof(afs_page_t));
+            while (ok && length > 0)
+            {
+                ssize_t bytes = pwrite(fd, src, length, offs);
+                if (bytes < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                ok = bytes > 0;
+                if (ok)
+                {
+                    src += bytes;
+                    offs += bytes;
+                    length -= bytes;
+                }
+            }
+        }
+
+        if (!ok)
+        {
+            // The pages of this run and the following runs stay dirty
+            const int err = errno;
+            restore_dirty(m_delta.active() ? taken : dirty);
+            errno = err;
+            return false;
+        }
+
+        for (size_t i = page; i <= last; i++)
+        {
+            dirty[i / 64] &= ~((uint64_t)1 << (i % 64));
+        }
+        ndirty -= last + 1 - page;
+
+        if (runs)
+        {
+            *runs += 1;
+        }
+
+        page = last + 1;
+    }
+
+    // The appended pages count only after the commit slot
+    if (m_delta.active() && !m_delta.commit())
+    {
+        const int err = errno;
+        restore_dirty(taken);
+        errno = err;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Flush the image file, or the saved copy, to stable storage
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_diskimage::sync()
+{
+    if (m_delta.active())
+    {
+        return m_delta.sync();
+    }
+
+    int fd = m_inplace ? m_fd : m_save_fd;
+    if (fd < 0)
+    {
+        // A compressed copy was already flushed by save()
+        if (m_written)
+        {
+            return true;
+        }
+
+        errno = EBADF;
+        return false;
+    }
+
+    return flush_fd(fd);
+}
+
+bool afs_diskimage::mapped() const
+{
+    return m_fd >= 0;
+}
+
+bool afs_diskimage::inplace() const
+{
+    return m_inplace;
+}
+
+/**
+ * @brief Return true, if writeback() has a file to write to
+ */
+bool afs_diskimage::saved() const
+{
+    return m_inplace || m_save_fd >= 0 || m_delta.active();
+}
+
+/**
+ * @brief Return true, if changes go to an overlay delta file
+ */
+bool afs_diskimage::overlay() const
+{
+    return m_delta.active();
+}
+
+/**
+ * @brief Return true, if the pages are decoded when they are first accessed
+ */
+bool afs_diskimage::lazy() const
+{
+    return !m_loaded.empty();
+}
+
+bool afs_diskimage::written() const
+{
+    return m_written;
+}
+
+size_t afs_diskimage::npages() const
+{
+    return m_npages;
+}
+
+size_t afs_diskimage::size() const
+{
+    return m_npages * sizeof(afs_page_t);
+}
+
+char* afs_diskimage::data() const
+{
+    return reinterpret_cast<char*>(m_pages);
+}
+
+/**
+ * @brief Return a pointer to a page of this disk image
+ * @param page page number relative to this disk
+ * @return pointer to afs_page_t, or NULL if the page is out of range
+ * or its frame could not be decoded
+ */
+afs_page_t* afs_diskimage::page(page_t page) const
+{
+    if (page < 0 || (size_t)page >= m_npages)
+    {
+        return NULL;
+    }
+
+    if (!m_loaded.empty() && !load_frame(page / m_frames.frame_pages()))
+    {
+        return NULL;
+    }
+
+    return &m_pages[page];
+}
+
+/**
+ * @brief Mark a page as changed
+ * @param page page number relative to this disk
+ */
+void afs_diskimage::set_dirty(page_t page)
+{
+    if (page < 0 || (size_t)page >= m_npages)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    uint64_t& bits = m_dirty[page / 64];
+    const uint64_t mask = (uint64_t)1 << (page % 64);
+    if (!(bits & mask))
+    {
+        bits |= mask;
+        m_ndirty++;
+    }
+}
+
+/**
+ * @brief Return true, if a page was changed since the last save or writeback
+ * @param page page number relative to this disk
+ */
+bool afs_diskimage::dirty(page_t page) const
+{
+    if (page < 0 || (size_t)page >= m_npages)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    return (m_dirty[page / 64] >> (page % 64)) & 1;
+}
+
+size_t afs_diskimage::dirty_count() const
+{
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    return m_ndirty;
+}
+
+void afs_diskimage::clear_dirty()
+{
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    m_dirty.assign((m_npages + 63) / 64, 0);
+    m_ndirty = 0;
+}
+
+/**
+ * @brief Take the dirty pages, leaving none marked
+ * @param count pointer to store the number of dirty pages taken
+ * @return bitmap of the pages taken
+ */
+std::vector<uint64_t> afs_diskimage::take_dirty(size_t* count)
+{
+    std::vector<uint64_t> dirty((m_npages + 63) / 64, 0);
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    m_dirty.swap(dirty);
+    *count = m_ndirty;
+    m_ndirty = 0;
+    return dirty;
+}
+
+/**
+ * @brief Mark pages taken by take_dirty() as dirty again, after writing them failed
+ * @param dirty bitmap of the pages
+ */
+void afs_diskimage::restore_dirty(const std::vector<uint64_t>& dirty)
+{
+    std::lock_guard<std::mutex> lock(m_dirty_mutex);
+    for (size_t i = 0; i < dirty.size() && i < m_dirty.size(); i++)
+    {
+        m_ndirty += __builtin_popcountll(dirty[i] & ~m_dirty[i]);
+        m_dirty[i] |= dirty[i];
+    }
+}
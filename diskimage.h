@@ -0,0 +1,99 @@
+/*******************************************************************************************
+ *
+ * Alto disk image page storage
+ *
+ *******************************************************************************************/
+#if !defined(_DISKIMAGE_H_)
+#define _DISKIMAGE_H_
+
+#include <atomic>
+#include <mutex>
+
+#include "afs_types.h"
+#include "codec.h"
+#include "frames.h"
+#include "delta.h"
+
+/**
+ * @brief Class to keep the pages of one disk image (dp0 or dp1)
+ *
+ * The pages are either memory mapped from the image file, or they live
+ * in an anonymous mapping which the caller fills (e.g. from a compressed
+ * image). Pages of a mapped image which are never touched are never read
+ * and cost no memory. The same is true for a seekable .afz image opened
+ * with open_frames(): a frame is decoded when one of its pages is first
+ * accessed.
+ *
+ * The mapping is always private (MAP_PRIVATE), so changes stay in memory
+ * until they are written explicitly. This way nothing reaches the image
+ * file before the caller decides so, e.g. after journaling the pages.
+ *
+ * Changed pages are tracked in a dirty bitmap, so that writeback() only
+ * needs to write those pages, either to the image file itself (if it was
+ * mapped in-place) or to the copy written by the last save(). A compressed
+ * copy can't be updated in place, so it is written anew by every save().
+ * With an overlay delta file attached, the image itself is left alone
+ * and writeback() writes the dirty pages to the delta file instead.
+ *
+ * save() replaces the file atomically and writes a checksum file next to
+ * it, which writeback() removes and seal() writes again, so that the next
+ * mount can verify() that the image is unchanged since it was written.
+ */
+class afs_diskimage
+{
+public:
+    afs_diskimage();
+    ~afs_diskimage();
+
+    bool map(std::string name, bool inplace);
+    bool allocate();
+    bool open_frames(std::string name);
+    bool attach_delta(std::string name);
+    void unmap();
+    bool verify(std::string name) const;
+    bool seal();
+
+    bool save(std::string name, afs_codec_t codec = CODEC_NONE);
+    bool writeback(size_t* runs = NULL);
+    bool sync();
+
+    bool mapped() const;
+    bool inplace() const;
+    bool saved() const;
+    bool written() const;
+    bool overlay() const;
+    bool lazy() const;
+    size_t npages() const;
+    size_t size() const;
+    char* data() const;
+    afs_page_t* page(page_t page) const;
+
+    void set_dirty(page_t page);
+    bool dirty(page_t page) const;
+    size_t dirty_count() const;
+
+private:
+    void clear_dirty();
+    std::vector<uint64_t> take_dirty(size_t* count);
+    void restore_dirty(const std::vector<uint64_t>& dirty);
+    bool load_frame(size_t frame) const;
+    bool load_all() const;
+
+    afs_page_t* m_pages;                    //!< Start of the mapped pages
+    size_t m_npages;                        //!< Number of pages in the mapping
+    int m_fd;                               //!< File descriptor of a mapped image file, or -1
+    bool m_inplace;                         //!< True, if writeback() writes to the image file itself
+    int m_save_fd;                          //!< File descriptor of the copy written by save(), or -1
+    bool m_written;                         //!< True, if save() wrote the pages at least once
+    std::vector<uint64_t> m_dirty;          //!< Bitmap of pages changed since the last save or writeback
+    size_t m_ndirty;                        //!< Number of bits set in m_dirty
+    mutable std::mutex m_dirty_mutex;       //!< Protects m_dirty and m_ndirty against concurrent writers of different files
+    afs_frames m_frames;                    //!< Seekable container the pages are loaded from
+    mutable std::vector<std::atomic<char> > m_loaded;   //!< Frames of m_frames already decoded, read without locking
+    mutable std::vector<std::mutex> m_load_mutex;       //!< Per frame, serializes decoding it by concurrent readers
+    afs_delta m_delta;                      //!< Overlay delta file for the changed pages
+    std::string m_sidecar;                  //!< Checksum file of the file writeback() writes to
+    bool m_sealed;                          //!< True, if m_sidecar matches that file
+};
+
+#endif // !defined(_DISKIMAGE_H_)
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include "fileinfo.h"
 
 afs_fileinfo::afs_fileinfo() :
@@ -6,7 +7,16 @@ afs_fileinfo::afs_fileinfo() :
     m_st(),
     m_leader_page_vda(0),
     m_deleted(true),
-    m_children()
+    m_children(),
+    m_index(),
+    m_pages_valid(false),
+    m_pages(),
+    m_page_end(),
+    m_lock(),
+    m_delayed(),
+    m_live_size(0),
+    m_live_blocks(0),
+    m_live_mtime(0)
 {
 }
 
@@ -16,7 +26,16 @@ afs_fileinfo::afs_fileinfo(afs_fileinfo* parent, std::string name, struct stat s
     m_st(st),
     m_leader_page_vda(vda),
     m_deleted(deleted),
-    m_children()
+    m_children(),
+    m_index(),
+    m_pages_valid(false),
+    m_pages(),
+    m_page_end(),
+    m_lock(),
+    m_delayed(),
+    m_live_size(st.st_size),
+    m_live_blocks(st.st_blocks),
+    m_live_mtime(st.st_mtime)
 {
 }
 
@@ -88,16 +107,86 @@ const afs_fileinfo* afs_fileinfo::child(int idx) const
 
 afs_fileinfo* afs_fileinfo::find(std::string name)
 {
-    std::vector<afs_fileinfo*>::iterator it;
-    for (it = m_children.begin(); it != m_children.end(); it++) {
-        afs_fileinfo* node = *it.base();
-        if (!node)
-            continue;
-        if (name == node->name())
-            return node;
+    return find(name.data(), name.size());
+}
+
+/**
+ * @brief Find a child node by name
+ * @param name pointer to the name (need not be 0 terminated)
+ * @param length length of the name
+ * @return pointer to the first child with that name, or NULL if there is none
+ */
+afs_fileinfo* afs_fileinfo::find(const char* name, size_t length)
+{
+    afs_fileinfo* found = NULL;
+    size_t matches = 0;
+    auto range = m_index.equal_range(hash(name, length));
+    for (auto it = range.first; it != range.second; it++)
+	{
+        afs_fileinfo* node = it->second;
+        if (node->m_name.compare(0, std::string::npos, name, length) == 0)
+		{
+            found = node;
+            matches++;
+        }
+    }
+
+    if (matches > 1)
+	{
+        // More than one child with this name: the first one wins
+        for (afs_fileinfo* node : m_children)
+		{
+            if (node && node->m_name.compare(0, std::string::npos, name, length) == 0)
+			{
+                return node;
+			}
+        }
+    }
+	
+    return found;
+}
+
+/**
+ * @brief Hash a name with FNV-1a
+ * @param name pointer to the name
+ * @param length length of the name
+ * @return hash value
+ */
+size_t afs_fileinfo::hash(const char* name, size_t length)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+	{
+        h = (h ^ (uint8_t)name[i]) * 1099511628211ull;
     }
-    return NULL;
+	
+    return (size_t)h;
+}
 
+void afs_fileinfo::index_add(afs_fileinfo* child)
+{
+    if (child)
+	{
+        m_index.emplace(hash(child->m_name.data(), child->m_name.size()), child);
+	}
+}
+
+void afs_fileinfo::index_remove(afs_fileinfo* child)
+{
+    if (!child)
+	{
+        return;
+	}
+	
+    auto range = m_index.equal_range(hash(child->m_name.data(), child->m_name.size()));
+    for (auto it = range.first; it != range.second; it++)
+	{
+        if (it->second == child)
+		{
+            m_index.erase(it);
+            return;
+        }
+    }
 }
 
 ino_t afs_fileinfo::statIno() const
@@ -222,6 +311,7 @@ void afs_fileinfo::erase(int pos, int count)
         if (idx >= pos + count)
             break;
 		
+        index_remove(*it);
         m_children.erase(it);
         m_st.st_nlink -= 1;
 		
@@ -231,35 +321,189 @@ void afs_fileinfo::erase(int pos, int count)
 
 void afs_fileinfo::erase(std::vector<afs_fileinfo*>::iterator pos)
 {
+    index_remove(*pos);
     m_children.erase(pos);
 }
 
 void afs_fileinfo::rename(std::string newname)
 {
+    // The parent's index is keyed by the name
+    if (m_parent)
+	{
+        m_parent->index_remove(this);
+	}
+	
     m_name = newname;
+	
+    if (m_parent)
+	{
+        m_parent->index_add(this);
+	}
 }
 
 void afs_fileinfo::append(afs_fileinfo* info)
 {
     m_children.push_back(info);
+    index_add(info);
     m_st.st_nlink += 1;
 }
 
 bool afs_fileinfo::remove(afs_fileinfo* child)
 {
+    afs_fileinfo* node = find(child->m_name.data(), child->m_name.size());
+    if (!node)
+	{
+        return false;
+	}
+	
     std::vector<afs_fileinfo*>::iterator it;
-    int idx = 0;
     for (it = m_children.begin(); it != m_children.end(); it++)
 	{
-        afs_fileinfo* node = m_children.at(idx);
-        if (child->name() == node->name())
+        if (*it == node)
 		{
+            index_remove(node);
             m_children.erase(it);
             return true;
         }
-		
-        idx++;
     }
 	
     return false;
 }
+
+/**
+ * @brief Return true, if the data pages were set up and set_pages_valid() was called
+ */
+bool afs_fileinfo::pages_valid() const
+{
+    return m_pages_valid;
+}
+
+size_t afs_fileinfo::page_count() const
+{
+    return m_pages.size();
+}
+
+/**
+ * @brief Return the VDA of a data page
+ * @param idx index of the data page (0 for file page 1)
+ */
+page_t afs_fileinfo::page(size_t idx) const
+{
+    return m_pages.at(idx);
+}
+
+/**
+ * @brief Return the byte offset of the start of a data page
+ * @param idx index of the data page
+ */
+size_t afs_fileinfo::page_offset(size_t idx) const
+{
+    return idx == 0 ? 0 : m_page_end.at(idx - 1);
+}
+
+/**
+ * @brief Find the data page containing a byte offset
+ * @param offset byte offset in the file
+ * @return index of the data page, or page_count() if offset is at or beyond the end
+ */
+size_t afs_fileinfo::page_index(size_t offset) const
+{
+    return std::upper_bound(m_page_end.begin(), m_page_end.end(), offset) - m_page_end.begin();
+}
+
+/**
+ * @brief Return the number of bytes in all data pages
+ */
+size_t afs_fileinfo::pages_size() const
+{
+    return m_page_end.empty() ? 0 : m_page_end.back();
+}
+
+void afs_fileinfo::append_page(page_t page, size_t nbytes)
+{
+    m_pages.push_back(page);
+    m_page_end.push_back(pages_size() + nbytes);
+}
+
+/**
+ * @brief Change the number of bytes in a data page
+ * @param idx index of the data page
+ * @param nbytes new number of bytes
+ */
+void afs_fileinfo::set_page_bytes(size_t idx, size_t nbytes)
+{
+    const size_t old = m_page_end.at(idx) - page_offset(idx);
+    for (size_t i = idx; i < m_page_end.size(); i++)
+	{
+        m_page_end[i] = m_page_end[i] - old + nbytes;
+    }
+}
+
+void afs_fileinfo::truncate_pages(size_t count)
+{
+    if (count < m_pages.size())
+	{
+        m_pages.resize(count);
+        m_page_end.resize(count);
+    }
+}
+
+void afs_fileinfo::set_pages_valid()
+{
+    m_pages_valid = true;
+}
+
+/**
+ * @brief Forget the data pages, so that they are looked up again
+ */
+void afs_fileinfo::clear_pages()
+{
+    m_pages.clear();
+    m_page_end.clear();
+    m_pages_valid = false;
+}
+
+/**
+ * @brief Get the lock of the data of this file
+ * @return reference to the lock
+ */
+afs_rwlock& afs_fileinfo::lock() const
+{
+    return m_lock;
+}
+
+/**
+ * @brief Get the delayed write buffer of this file
+ * @return reference to the bytes following the data pages
+ */
+std::vector<char>& afs_fileinfo::delayed()
+{
+    return m_delayed;
+}
+
+const std::vector<char>& afs_fileinfo::delayed() const
+{
+    return m_delayed;
+}
+
+/**
+ * @brief Copy the size and modification time from the status
+ * Called with the file lock held exclusive, or by the only user of the node.
+ */
+void afs_fileinfo::set_live() const
+{
+    m_live_size.store(m_st.st_size, std::memory_order_relaxed);
+    m_live_blocks.store(m_st.st_blocks, std::memory_order_relaxed);
+    m_live_mtime.store(m_st.st_mtime, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Put the size and modification time of the last set_live() into a status
+ * @param st pointer to the struct stat to update
+ */
+void afs_fileinfo::live(struct stat* st) const
+{
+    st->st_size = m_live_size.load(std::memory_order_relaxed);
+    st->st_blocks = m_live_blocks.load(std::memory_order_relaxed);
+    st->st_mtime = m_live_mtime.load(std::memory_order_relaxed);
+}
@@ -2,14 +2,31 @@
 #define _FILEINFO_H_
 
 #include <sys/stat.h>
+#include <atomic>
 #include <cstddef>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include "afs_types.h"
+#include "rwlock.h"
 
 /**
  * @brief Class to keep information about a file or directory
+ *
+ * The children of a directory are indexed by a hash of their names,
+ * so that find() takes constant time and needs no string copies.
+ *
+ * A file caches the VDAs of its data pages together with the byte offset
+ * where each page ends, so that the page containing any offset can be
+ * found with a binary search instead of following the page chain.
+ *
+ * Each file has its own lock, held shared while its data is read and
+ * exclusive while it is written, so that different files can be read
+ * and written in parallel. Bytes written after the data pages, which
+ * have no pages allocated yet, are kept in the delayed write buffer.
+ * The size and modification time as of the last write are kept apart
+ * from the status, so getattr() can read them without the file lock.
  */
 class afs_fileinfo
 {
@@ -31,6 +48,7 @@ public:
     const afs_fileinfo* child(int idx) const;
 
     afs_fileinfo* find(std::string name);
+    afs_fileinfo* find(const char* name, size_t length);
 
     ino_t statIno() const;
     time_t statCtime() const;
@@ -62,13 +80,48 @@ public:
     void append(afs_fileinfo* child);
     bool remove(afs_fileinfo* child);
 
+    bool pages_valid() const;
+    size_t page_count() const;
+    page_t page(size_t idx) const;
+    size_t page_offset(size_t idx) const;
+    size_t page_index(size_t offset) const;
+    size_t pages_size() const;
+    void append_page(page_t page, size_t nbytes);
+    void set_page_bytes(size_t idx, size_t nbytes);
+    void truncate_pages(size_t count);
+    void set_pages_valid();
+    void clear_pages();
+
+    afs_rwlock& lock() const;
+    std::vector<char>& delayed();
+    const std::vector<char>& delayed() const;
+
+    void set_live() const;
+    void live(struct stat* st) const;
+
 private:
+    static size_t hash(const char* name, size_t length);
+    void index_add(afs_fileinfo* child);
+    void index_remove(afs_fileinfo* child);
+
+    afs_fileinfo(const afs_fileinfo&);
+    afs_fileinfo& operator=(const afs_fileinfo&);
+
     afs_fileinfo* m_parent;                 //!< Parent directory
     std::string m_name;                     //!< Filename
     struct stat m_st;                       //!< Status
     page_t m_leader_page_vda;               //!< Leader page of this file
     bool m_deleted;                         //!< True, if the file is marked as deleted
     std::vector<afs_fileinfo*> m_children;  //!< Vector of child nodes
+    std::unordered_multimap<size_t, afs_fileinfo*> m_index;   //!< Child nodes by hash of their name
+    bool m_pages_valid;                     //!< True, if m_pages reflects the page chain
+    std::vector<page_t> m_pages;            //!< VDAs of the data pages
+    std::vector<size_t> m_page_end;         //!< Byte offset of the end of each data page
+    mutable afs_rwlock m_lock;              //!< Held shared by reads, exclusive by writes of the data
+    std::vector<char> m_delayed;            //!< Bytes written after the data pages, not yet in pages
+    mutable std::atomic<off_t> m_live_size;         //!< Size as of the last set_live()
+    mutable std::atomic<blkcnt_t> m_live_blocks;    //!< Number of blocks as of the last set_live()
+    mutable std::atomic<time_t> m_live_mtime;       //!< Modification time as of the last set_live()
 };
 
 #endif // !defined(_FILEINFO_H_)
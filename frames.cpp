@@ -0,0 +1,350 @@
+/*******************************************************************************************
+ *
+ * Seekable compressed disk image container
+ *
+ *******************************************************************************************/
+#include <algorithm>
+
+#include "config.h"
+#include "frames.h"
+#include "crc32c.h"
+
+#define FRAMES_MAGIC        0x315a4641  //!< "AFZ1" in little endian
+#define FRAMES_INDEX_MAGIC  0x495a4641  //!< "AFZI" in little endian
+#define FRAMES_HEADER_SIZE  20          //!< Size of the header
+#define FRAMES_ENTRY_SIZE   16          //!< Size of one index entry
+#define FRAMES_TRAILER_SIZE 16          //!< Size of the trailer
+
+static void put32(std::vector<char>& buf, uint32_t val)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        buf.push_back((char)(val >> (8 * i)));
+    }
+}
+
+static void put64(std::vector<char>& buf, uint64_t val)
+{
+    put32(buf, (uint32_t)val);
+    put32(buf, (uint32_t)(val >> 32));
+}
+
+static uint32_t get32(const char* src)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(src);
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const char* src)
+{
+    return (uint64_t)get32(src) | ((uint64_t)get32(src + 4) << 32);
+}
+
+static bool pread_full(int fd, void* buf, size_t size, off_t offs)
+{
+    char* dst = reinterpret_cast<char*>(buf);
+    while (size > 0)
+    {
+        ssize_t bytes = pread(fd, dst, size, offs);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes <= 0)
+        {
+            errno = bytes < 0 ? errno : EINVAL;
+            return false;
+        }
+
+        dst += bytes;
+        offs += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+static bool write_full(int fd, const std::vector<char>& buf)
+{
+    const char* src = buf.data();
+    size_t size = buf.size();
+    while (size > 0)
+    {
+        ssize_t bytes = ::write(fd, src, size);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes <= 0)
+        {
+            return false;
+        }
+
+        src += bytes;
+        size -= bytes;
+    }
+
+    return true;
+}
+
+afs_frames::afs_frames() :
+    m_fd(-1),
+    m_npages(0),
+    m_frame_pages(0),
+    m_codec(CODEC_NONE),
+    m_index()
+{
+}
+
+afs_frames::~afs_frames()
+{
+    close();
+}
+
+/**
+ * @brief Open a container and read its index
+ * @param name file name of the container
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_frames::open(std::string name)
+{
+    close();
+
+    m_fd = ::open(name.c_str(), O_RDONLY);
+    if (m_fd < 0)
+    {
+        return false;
+    }
+
+    if (!read_index())
+    {
+        int err = errno;
+        close();
+        errno = err;
+        return false;
+    }
+
+    return true;
+}
+
+void afs_frames::close()
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    m_npages = 0;
+    m_frame_pages = 0;
+    m_index.clear();
+}
+
+bool afs_frames::active() const
+{
+    return m_fd >= 0;
+}
+
+size_t afs_frames::npages() const
+{
+    return m_npages;
+}
+
+size_t afs_frames::frame_pages() const
+{
+    return m_frame_pages;
+}
+
+size_t afs_frames::nframes() const
+{
+    return m_index.size();
+}
+
+/**
+ * @brief Read and check the header, the trailer and the frame index
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_frames::read_index()
+{
+    struct stat st;
+    if (fstat(m_fd, &st) < 0)
+    {
+        return false;
+    }
+
+    char header[FRAMES_HEADER_SIZE];
+    char trailer[FRAMES_TRAILER_SIZE];
+    if ((size_t)st.st_size < sizeof(header) + sizeof(trailer) ||
+        !pread_full(m_fd, header, sizeof(header), 0) ||
+        !pread_full(m_fd, trailer, sizeof(trailer), st.st_size - sizeof(trailer)))
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    m_npages = get32(header + 4);
+    m_frame_pages = get32(header + 12);
+    m_codec = (afs_codec_t)get32(header + 16);
+    const uint64_t index_offset = get64(trailer);
+    const uint32_t nframes = get32(trailer + 8);
+
+    if (get32(header) != FRAMES_MAGIC || get32(trailer + 12) != FRAMES_INDEX_MAGIC ||
+        get32(header + 8) != sizeof(afs_page_t) || m_frame_pages == 0 ||
+        nframes != (m_npages + m_frame_pages - 1) / m_frame_pages ||
+        index_offset + (uint64_t)nframes * FRAMES_ENTRY_SIZE + sizeof(trailer) != (uint64_t)st.st_size)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    std::vector<char> index((size_t)nframes * FRAMES_ENTRY_SIZE);
+    if (!pread_full(m_fd, index.data(), index.size(), (off_t)index_offset))
+    {
+        return false;
+    }
+
+    m_index.resize(nframes);
+    for (uint32_t i = 0; i < nframes; i++)
+    {
+        const char* entry = index.data() + (size_t)i * FRAMES_ENTRY_SIZE;
+        m_index[i].offset = get64(entry);
+        m_index[i].size = get32(entry + 8);
+        m_index[i].crc = get32(entry + 12);
+        if (m_index[i].offset + m_index[i].size > index_offset)
+        {
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Decode one frame
+ * @param frame frame number
+ * @param dst buffer for the pages of the frame (the last frame may be shorter)
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_frames::load(size_t frame, char* dst) const
+{
+    if (frame >= m_index.size())
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    const afs_frame_t& f = m_index[frame];
+    const size_t first = frame * m_frame_pages;
+    const size_t size = std::min(m_frame_pages, m_npages - first) * sizeof(afs_page_t);
+
+    std::vector<char> buf(f.size);
+    if (!pread_full(m_fd, buf.data(), buf.size(), (off_t)f.offset) ||
+        !afs_codec::uncompress(m_codec, buf.data(), buf.size(), dst, size))
+    {
+        return false;
+    }
+
+    if (crc32c(0, dst, size) != f.crc)
+    {
+        errno = EIO;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Write a container for a buffer of pages
+ *
+ * The frames are compressed with Zstandard if available, else with zlib.
+ *
+ * @param fd file descriptor to write to
+ * @param src pointer to the pages
+ * @param size size of the pages in bytes
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_frames::encode(int fd, const char* src, size_t size)
+{
+#if defined(HAVE_ZSTD)
+    const afs_codec_t codec = CODEC_ZSTD;
+#elif defined(HAVE_ZLIB)
+    const afs_codec_t codec = CODEC_GZIP;
+#else
+    const afs_codec_t codec = CODEC_NONE;
+#endif
+    const size_t npages = size / sizeof(afs_page_t);
+    const size_t nframes = (npages + FRAME_PAGES - 1) / FRAME_PAGES;
+
+    std::vector<char> buf;
+    put32(buf, FRAMES_MAGIC);
+    put32(buf, (uint32_t)npages);
+    put32(buf, sizeof(afs_page_t));
+    put32(buf, FRAME_PAGES);
+    put32(buf, codec);
+    if (!write_full(fd, buf))
+    {
+        return false;
+    }
+
+    uint64_t offset = buf.size();
+    std::vector<char> index;
+    std::vector<char> frame;
+    for (size_t i = 0; i < nframes; i++)
+    {
+        const char* data = src + i * FRAME_PAGES * sizeof(afs_page_t);
+        const size_t length = std::min<size_t>(FRAME_PAGES, npages - i * FRAME_PAGES) * sizeof(afs_page_t);
+        if (!afs_codec::compress(codec, data, length, frame) || !write_full(fd, frame))
+        {
+            return false;
+        }
+
+        put64(index, offset);
+        put32(index, (uint32_t)frame.size());
+        put32(index, crc32c(0, data, length));
+        offset += frame.size();
+    }
+
+    put64(index, offset);
+    put32(index, (uint32_t)nframes);
+    put32(index, FRAMES_INDEX_MAGIC);
+
+    return write_full(fd, index);
+}
+
+/**
+ * @brief Decode all frames of a container
+ * @param fd file descriptor to read from
+ * @param dst buffer to decode to
+ * @param size size of the buffer
+ * @param done pointer to store the number of bytes decoded
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_frames::decode(int fd, char* dst, size_t size, size_t* done)
+{
+    afs_frames frames;
+    frames.m_fd = fd;
+    bool ok = frames.read_index();
+
+    size_t total = 0;
+    for (size_t i = 0; ok && i < frames.nframes(); i++)
+    {
+        const size_t first = i * frames.m_frame_pages;
+        const size_t length = std::min(frames.m_frame_pages, frames.m_npages - first) * sizeof(afs_page_t);
+        if (total + length > size)
+        {
+            break;
+        }
+
+        ok = frames.load(i, dst + total);
+        total += ok ? length : 0;
+    }
+
+    // The caller owns the file descriptor
+    frames.m_fd = -1;
+    *done = total;
+
+    return ok;
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************************
+ *
+ * Seekable compressed disk image container
+ *
+ *******************************************************************************************/
+#if !defined(_FRAMES_H_)
+#define _FRAMES_H_
+
+#include "afs_types.h"
+#include "codec.h"
+
+#define FRAME_PAGES     (NHEADS*NSECS)  //!< Number of pages in one frame: one cylinder
+
+/**
+ * @brief Index entry of one frame
+ */
+typedef struct {
+    uint64_t offset;                        //!< File offset of the compressed frame
+    uint32_t size;                          //!< Size of the compressed frame
+    uint32_t crc;                           //!< CRC-32C of the uncompressed frame
+}   afs_frame_t;
+
+/**
+ * @brief Class to read and write the seekable .afz disk image format
+ *
+ * The pages of an image are grouped into frames of FRAME_PAGES pages,
+ * and each frame is compressed on its own. An index after the frames
+ * tells where each frame starts, so that any frame can be decoded
+ * without touching the others.
+ *
+ * The layout of the file is, with all numbers in little endian:
+ *
+ *   header:  "AFZ1", npages, page size, frame pages, frame codec (5 x 32 bit)
+ *   frames:  the compressed frames
+ *   index:   per frame its offset (64 bit), size and CRC-32C (32 bit each)
+ *   trailer: index offset (64 bit), number of frames (32 bit), "AFZI"
+ */
+class afs_frames
+{
+public:
+    afs_frames();
+    ~afs_frames();
+
+    bool open(std::string name);
+    void close();
+    bool active() const;
+
+    size_t npages() const;
+    size_t frame_pages() const;
+    size_t nframes() const;
+    bool load(size_t frame, char* dst) const;
+
+    static bool encode(int fd, const char* src, size_t size);
+    static bool decode(int fd, char* dst, size_t size, size_t* done);
+
+private:
+    bool read_index();
+
+    int m_fd;                               //!< File descriptor of the container, or -1
+    size_t m_npages;                        //!< Number of pages in the image
+    size_t m_frame_pages;                   //!< Number of pages per frame
+    afs_codec_t m_codec;                    //!< Compression of the frames
+    std::vector<afs_frame_t> m_index;       //!< The frame index
+};
+
+#endif // !defined(_FRAMES_H_)
@@ -5,10 +5,17 @@
  * Copyright (c) 2016 Jürgen Buchmüller <pullmoll@t-online.de>
  *
  *******************************************************************************************/
+#include "config.h"
+
+#if defined(HAVE_FUSE3)
+// 3.2 is the first version taking a struct fuse_loop_config (clone_fd, max_idle_threads)
+#define FUSE_USE_VERSION 32
+#else
 #define FUSE_USE_VERSION 26
+#endif
 
-#include "config.h"
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <libgen.h>
 #include <errno.h>
@@ -33,12 +40,30 @@ static int multithreaded = 1;
 static int nonopt_seen = 0;
 static char* mountpoint = NULL;
 static char* filenames = NULL;
+#if FUSE_VERSION >= 30
+static bool mounted = false;
+static struct fuse_conn_info_opts* conn_opts = NULL;
+static struct fuse_loop_config loop_config;
+#else
 static struct fuse_chan* chan = NULL;
+#endif
 static struct fuse* fuse = NULL;
 static struct fuse_operations* fuse_ops = NULL;
+static struct fuse_session* session = NULL;
+static struct fuse_lowlevel_ops* fuse_ll_ops = NULL;
 static AltoFS* afs = 0;
 static bool check = false;
 static bool rebuild = false;
+static bool inplace = false;
+static bool overlay = false;
+static bool layout = false;
+static bool lowlevel = false;
+static double entry_timeout = 1.0;
+static double attr_timeout = 1.0;
+static int flush_interval = 30;
+static long dirty_max = 1024;
+static int save_codec = -1;
+static int alloc_policy = -1;
 
 enum
 {
@@ -49,7 +74,11 @@ enum
 	KEY_VERBOSE,
 	KEY_VERSION,
 	KEY_CHECK,
-	KEY_REBUILD
+	KEY_REBUILD,
+	KEY_INPLACE,
+	KEY_OVERLAY,
+	KEY_LAYOUT,
+	KEY_LOWLEVEL
 };
 
 /**
@@ -73,6 +102,10 @@ static struct fuse_opt alto_opts[] =
 	FUSE_OPT_KEY("--check",    	 KEY_CHECK),
 	FUSE_OPT_KEY("--r",    		 KEY_REBUILD),
 	FUSE_OPT_KEY("--rebuild",    KEY_REBUILD),
+	FUSE_OPT_KEY("--inplace",    KEY_INPLACE),
+	FUSE_OPT_KEY("--overlay",    KEY_OVERLAY),
+	FUSE_OPT_KEY("--layout",     KEY_LAYOUT),
+	FUSE_OPT_KEY("--lowlevel",   KEY_LOWLEVEL),
 	FUSE_OPT_END
 };
 
@@ -138,7 +171,11 @@ static int create_alto(const char* path, mode_t mode, dev_t dev)
 	return 0;
 }
 
+#if FUSE_VERSION >= 30
+static int getattr_alto(const char *path, struct stat *stbuf, struct fuse_file_info*)
+#else
 static int getattr_alto(const char *path, struct stat *stbuf)
+#endif
 {
 	log(2, "%s: %s\n", __func__, path);
 
@@ -154,109 +191,83 @@ static int getattr_alto(const char *path, struct stat *stbuf)
 
 	memset(stbuf, 0, sizeof(struct stat));
 
-	afs_fileinfo* info = afs->find_fileinfo(path);
-	if (!info)
+	// A copy, so that other threads can change the file meanwhile
+	if (afs->getattr(path, stbuf) < 0)
 	{
 		log(2, "%s: %s result: ENOENT\n", __func__, path);
 
 		return -ENOENT;
 	}
 	
-	page_t leaderPage = info->leader_page_vda();
-	if (leaderPage != 0)
-	{
-		afs_leader_t* lp = afs->page_leader(info->leader_page_vda());
-		afs->dump_leader(lp);
-	}
-	
-	info->setStatUid(ctx->uid);
-	info->setStatGid(ctx->gid);
-	
 	// Using the umask may cause an error!
 	// Why the umask changes between calls?
-	// printf("##### pid:0x%X umask:0x%X -> st_mode:0x%X\n", ctx->pid, ctx->umask, info->st()->st_mode & ~ctx->umask);
-	info->setStatMode(info->statMode() /*& ~(ctx->umask)*/);
-	
-	memcpy(stbuf, info->st(), sizeof(*stbuf));
-
-	log(3, "    st_dev:     0x%X\n", info->st()->st_dev);
-	log(3, "    st_ino:     0x%llX\n", info->st()->st_ino);
-	log(3, "    st_mode:    0x%X\n", info->st()->st_mode);
-	log(3, "    st_nlink:   0x%X\n", info->st()->st_nlink);
-	log(3, "    st_uid:     0x%X\n", info->st()->st_uid);
-	log(3, "    st_gid:     0x%X\n", info->st()->st_gid);
-	log(3, "    st_rdev:    0x%X\n", info->st()->st_rdev);
-	log(3, "    st_size:    0x%llX\n", info->st()->st_size);
-	log(3, "    st_blocks:  0x%llX\n", info->st()->st_blocks);
-	log(3, "    st_blksize: 0x%X\n", info->st()->st_blksize);
-	log(3, "    st_flags:   0x%X\n", info->st()->st_flags);
-	log(3, "    st_gen:     0x%X\n", info->st()->st_gen);
-	log(3, "    st_lspare:	0x%X\n", info->st()->st_lspare);
-	log(3, "    st_qspare:  0x%llX 0x%llX\n", info->st()->st_qspare[0], info->st()->st_qspare[1]);
+	stbuf->st_uid = ctx->uid;
+	stbuf->st_gid = ctx->gid;
+
+	log(3, "    st_dev:     0x%X\n", stbuf->st_dev);
+	log(3, "    st_ino:     0x%llX\n", stbuf->st_ino);
+	log(3, "    st_mode:    0x%X\n", stbuf->st_mode);
+	log(3, "    st_nlink:   0x%X\n", stbuf->st_nlink);
+	log(3, "    st_uid:     0x%X\n", stbuf->st_uid);
+	log(3, "    st_gid:     0x%X\n", stbuf->st_gid);
+	log(3, "    st_rdev:    0x%X\n", stbuf->st_rdev);
+	log(3, "    st_size:    0x%llX\n", stbuf->st_size);
+	log(3, "    st_blocks:  0x%llX\n", stbuf->st_blocks);
+	log(3, "    st_blksize: 0x%X\n", stbuf->st_blksize);
+#if defined(__APPLE__)
+	log(3, "    st_flags:   0x%X\n", stbuf->st_flags);
+	log(3, "    st_gen:     0x%X\n", stbuf->st_gen);
+	log(3, "    st_lspare:	0x%X\n", stbuf->st_lspare);
+	log(3, "    st_qspare:  0x%llX 0x%llX\n", stbuf->st_qspare[0], stbuf->st_qspare[1]);
+#endif
 
 	log(2, "%s: path: %s result: 0\n", __func__, path);
 
 	return 0;
 }
 
+#if FUSE_VERSION >= 30
+static int readdir_alto(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+#else
 static int readdir_alto(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+#endif
 {
 	log(2, "%s: path: %s\n", __func__, path);
 
 	struct fuse_context* ctx = fuse_get_context();
 	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
 	
-	afs_fileinfo* info = afs->find_fileinfo("/");
-	if (!info)
+	auto fill = [&](const char* name, const struct stat* st)
 	{
-		log(2, "%s: path: %s result: ENOENT\n", __func__, path);
-
-		return -ENOENT;
-	}
-	
-	info->setStatUid(ctx->uid);
-	info->setStatGid(ctx->gid);
-	
-	// Using the umask may cause an error!
-	// Why the umask changes between calls?
-	info->setStatMode(info->statMode() /*& ~ctx->umask*/);
-	
-	filler(buf, ".", info->st(), 0);
-	filler(buf, "..", NULL, 0);
-	
-	log(2, "%s: parent: %p %s %d\n", __func__, info, info->name().c_str(), (int)info->size());
+#if FUSE_VERSION >= 30
+		// The status is complete, so the kernel needs no lookup of the entries
+		const bool plus = st && (flags & FUSE_READDIR_PLUS);
+		return filler(buf, name, st, 0, plus ? FUSE_FILL_DIR_PLUS : (enum fuse_fill_dir_flags)0) != 0;
+#else
+		return filler(buf, name, st, 0) != 0;
+#endif
+	};
 	
-	for (int i = 0; i < info->size(); i++)
+	// The entries are copies, which get the caller's uid and gid
+	int result = afs->readdir("/", [&](const char* name, const struct stat* st)
 	{
-		afs_fileinfo* child = info->child(i);
-		if (!child)
-		{
-			printf(" NULL CHILD!!!\n");
-			continue;
-		}
-		
-		if (child->deleted())
+		if (!st)
 		{
-			// printf(" DELETED!\n");
-			continue;
+			return fill(name, NULL);
 		}
 		
-		child->setStatUid(ctx->uid);
-		child->setStatGid(ctx->gid);
-		
 		// Using the umask may cause an error!
 		// Why the umask changes between calls?
-		child->setStatMode(child->statMode() /* & ~ctx->umask*/);
+		struct stat entry = *st;
+		entry.st_uid = ctx->uid;
+		entry.st_gid = ctx->gid;
 		
-		if (filler(buf, child->name().c_str(), child->st(), 0))
-		{
-			break;
-		}
-	}
+		return fill(name, &entry);
+	});
 	
-	log(2, "%s: path: %s result: 0\n", __func__, path);
+	log(2, "%s: path: %s result: %d\n", __func__, path, result);
 
-	return 0;
+	return result;
 }
 
 static int open_alto(const char *path, struct fuse_file_info *fi)
@@ -274,42 +285,39 @@ static int open_alto(const char *path, struct fuse_file_info *fi)
 		return -ENOENT;
 	}
 	
-	fi->fh = (uint64_t)info;
+	// The handle is the leader page, so reading and writing need no lookup
+	fi->fh = (uint64_t)info->leader_page_vda();
+	
+	// A lazily decoded image reads the data pages of a file only now
+	afs->open_file((page_t)fi->fh);
 	
 	log(2, "%s: path: %s  result: 0\n", __func__, path);
 
 	return 0;
 }
 
-static int read_alto(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info*)
+static int read_alto(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi)
 {
 	log(2, "%s: path: %s\n", __func__, path);
 
 	struct fuse_context* ctx = fuse_get_context();
 	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
 	
-	afs_fileinfo* info = afs->find_fileinfo(path);
-	if (!info)
+	// The handle is the leader page, so there is no need to look up the file.
+	// read_file() stops at the end of the file, since the size in the snapshot
+	// may lag behind writes until the file is flushed.
+	const page_t vda = (page_t)fi->fh;
+	log(2, "%s: path: %s vda:0x%zX  size:%zu buf:%p offset:%lld\n", __func__, path, (size_t)vda, size, buf, offset);
+
+	size_t done = afs->read_file(vda, buf, size, offset);
+	if (done == (size_t)-1)
 	{
 		log(1, "%s: path: %s result: ENOENT\n", __func__, path);
 
 		return -ENOENT;
 	}
-
-	log(2, "%s: path: %s st_size:%lld\n", __func__, path, info->st()->st_size);
-
-	if (offset >= info->st()->st_size)
-	{
-		log(1, "%s: path: %s result: 0\n", __func__, path);
-
-		return 0;
-	}
-
-	log(2, "%s: path: %s vda:0x%zX  size:%zu buf:%p offset:%lld\n", __func__, path, info->leader_page_vda(), size, buf, offset);
-
-	size_t done = afs->read_file(info->leader_page_vda(), buf, size, offset);
 	
-	log(2, "%s: path: %s vda:0x%zX size:%zu buf:%p offset:%lld  result: %zu\n", __func__, path, info->leader_page_vda(), size, buf, offset, done);
+	log(2, "%s: path: %s vda:0x%zX size:%zu buf:%p offset:%lld  result: %zu\n", __func__, path, (size_t)vda, size, buf, offset, done);
 	
 	// printBufferChars(buf, size);
 	// printBuffer(buf, size);
@@ -322,29 +330,20 @@ static int read_alto(const char *path, char *buf, size_t size, off_t offset, str
 	return (int)done;
 }
 
-static int write_alto(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info*)
+static int write_alto(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi)
 {
 	log(2, "%s: path: %s\n", __func__, path);
 	
 	struct fuse_context* ctx = fuse_get_context();
 	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
 	
-	afs_fileinfo* info = afs->find_fileinfo(path);
-	if (!info)
-	{
-		log(1, "%s: path: %s result: ENOENT\n", __func__, path);
-
-		return -ENOENT;
-	}
-	
-	log(2, "%s: path: %s st_size:%lld\n", __func__, path, info->st()->st_size);
-
-	afs->print_file_pages(info->leader_page_vda());
+	// The handle is the leader page, so there is no need to look up the file
+	const page_t vda = (page_t)fi->fh;
 
 	// Convert some chars from Mac to Alto
 	const char *convBuff = convertWriteChars(buf, size);
 	
-	size_t done = afs->write_file(info->leader_page_vda(), convBuff, size, offset);
+	size_t done = afs->write_file(vda, convBuff, size, offset);
 	
 	// free the newly allocated buffer if there is one
 	if (convBuff != buf)
@@ -352,39 +351,60 @@ static int write_alto(const char *path, const char *buf, size_t size, off_t offs
 		free((void*)convBuff);
 	}
 	
-	log(2, "%s: path: size: %zu  offset: %lld  result: %zu\n", __func__, size, offset, done);
-
-	info = afs->find_fileinfo(path);
-	log(2, "%s: path: %s st_size:%lld\n", __func__, path, info->st()->st_size);
+	if (done == (size_t)-1)
+	{
+		log(1, "%s: path: %s result: ENOENT\n", __func__, path);
 
-	afs->print_file_pages(info->leader_page_vda());
+		return -ENOENT;
+	}
+	
+	log(2, "%s: path: size: %zu  offset: %lld  result: %zu\n", __func__, size, offset, done);
 	
 	return (int)done;
 }
 
+#if FUSE_VERSION >= 30
+static int truncate_alto(const char* path, off_t offset, struct fuse_file_info*)
+#else
 static int truncate_alto(const char* path, off_t offset)
+#endif
 {
 	log(2, "%s: path: %s offset:%lld\n", __func__, path, offset);
 
 	struct fuse_context* ctx = fuse_get_context();
 	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
 	
-	afs_fileinfo* info = afs->find_fileinfo(path);
-	log(2, "%s: st_size:%lld\n", __func__, info->st()->st_size);
+	struct stat st;
+	if (afs->getattr(path, &st) < 0)
+	{
+		return -ENOENT;
+	}
 	
-	afs->print_file_pages(info->leader_page_vda());
+	// The file may be open and written, so get its current size
+	afs->publish_file((page_t)st.st_ino);
+	afs->getattr(path, &st);
+	log(2, "%s: st_size:%lld\n", __func__, st.st_size);
+	
+	// Walking the page chain takes as long as the file is, so only when asked for
+	if (verbose)
+	{
+		afs->print_file_pages((page_t)st.st_ino);
+	}
 
 	int result = 0;
-	if(offset != info->st()->st_size)
+	if(offset != st.st_size)
 	{
 		result = afs->truncate_file(path, offset);
 
-		info = afs->find_fileinfo(path);
+		afs->getattr(path, &st);
 	}
 
-	log(2, "%s: st_size:%lld result: %d\n", __func__, info->st()->st_size, result);
+	log(2, "%s: st_size:%lld result: %d\n", __func__, st.st_size, result);
 
-	afs->print_file_pages(info->leader_page_vda());
+	if (verbose)
+	{
+		afs->print_file_pages((page_t)st.st_ino);
+	}
 
 	return result;
 }
@@ -403,10 +423,22 @@ static int unlink_alto(const char *path)
 	return result;
 }
 
+#if FUSE_VERSION >= 30
+static int rename_alto(const char *path, const char* newname, unsigned int flags)
+#else
 static int rename_alto(const char *path, const char* newname)
+#endif
 {
 	log(2, "%s: path: %s\n", __func__, path);
 
+#if FUSE_VERSION >= 30
+	// Neither RENAME_NOREPLACE nor RENAME_EXCHANGE
+	if (flags)
+	{
+		return -EINVAL;
+	}
+#endif
+
 	struct fuse_context* ctx = fuse_get_context();
 	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
 
@@ -417,7 +449,11 @@ static int rename_alto(const char *path, const char* newname)
 	return result;
 }
 
+#if FUSE_VERSION >= 30
+static int utimens_alto(const char* path, const struct timespec tv[2], struct fuse_file_info*)
+#else
 static int utimens_alto(const char* path, const struct timespec tv[2])
+#endif
 {
 	log(2, "%s: path: %s\n", __func__, path);
 
@@ -453,6 +489,67 @@ static int statfs_alto(const char *path, struct statvfs* vfs)
 	return result;
 }
 
+static int flush_alto(const char *path, struct fuse_file_info* fi)
+{
+	log(2, "%s: path: %s\n", __func__, path);
+
+	struct fuse_context* ctx = fuse_get_context();
+	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+
+	// Reads and writes left the new size and times for getattr to here
+	afs->publish_file((page_t)fi->fh);
+	
+	// Hand the changes over to the kernel, but don't wait for the disk.
+	// Closing a file which was only opened must not write the image.
+	int result = afs->dirty((page_t)fi->fh) ? afs->commit(false) : 0;
+	
+	log(2, "%s: path: %s result: %d\n", __func__, path, result);
+	
+	return result;
+}
+
+static int fsync_alto(const char *path, int datasync, struct fuse_file_info*)
+{
+	log(2, "%s: path: %s datasync: %d\n", __func__, path, datasync);
+
+	struct fuse_context* ctx = fuse_get_context();
+	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+
+	int result = afs->commit(true);
+	
+	log(2, "%s: path: %s result: %d\n", __func__, path, result);
+	
+	return result;
+}
+
+static int release_alto(const char *path, struct fuse_file_info* fi)
+{
+	log(2, "%s: path: %s\n", __func__, path);
+
+	struct fuse_context* ctx = fuse_get_context();
+	AltoFS* afs = reinterpret_cast<AltoFS*>(ctx->private_data);
+
+	// flush_alto() already committed the changes, but reads may have followed it
+	afs->publish_file((page_t)fi->fh);
+	afs->release_file((page_t)fi->fh);
+	
+	return 0;
+}
+
+static void destroy_alto(void* private_data)
+{
+	log(2, "%s: private_data: %p\n", __func__, private_data);
+
+	AltoFS* afs = reinterpret_cast<AltoFS*>(private_data);
+	if (afs)
+	{
+		afs->commit(true);
+	}
+
+	delete afs;
+	::afs = nullptr;
+}
+
 #if DEBUG
 static const char* fuse_cap(unsigned flags)
 {
@@ -468,8 +565,10 @@ static const char* fuse_cap(unsigned flags)
 		dst += snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", ATOMIC_O_TRUNC");
 	if (flags & FUSE_CAP_EXPORT_SUPPORT)
 		dst += snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", EXPORT_SUPPORT");
+#if defined(FUSE_CAP_BIG_WRITES)
 	if (flags & FUSE_CAP_BIG_WRITES)
 		dst += snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", BIG_WRITES");
+#endif
 	if (flags & FUSE_CAP_DONT_MASK)
 		dst += snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", DONT_MASK");
 	if (flags & FUSE_CAP_SPLICE_WRITE)
@@ -481,22 +580,68 @@ static const char* fuse_cap(unsigned flags)
 	if (flags & FUSE_CAP_FLOCK_LOCKS)
 		dst += snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", FLOCK_LOCKS");
 	if (flags & FUSE_CAP_IOCTL_DIR)
-		snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", IOCTL_DIR");
+		dst += snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", IOCTL_DIR");
+#if defined(FUSE_CAP_WRITEBACK_CACHE)
+	if (flags & FUSE_CAP_WRITEBACK_CACHE)
+		snprintf(dst, sizeof(buff) - (size_t)(dst - buff), "%s", ", WRITEBACK_CACHE");
+#endif
 	return buff + 2;
 }
 #endif
 
+#if FUSE_VERSION >= 30
+/**
+ * @brief Ask the kernel for what makes reading and writing cheaper
+ * A large max_write lets the kernel send writes of up to 256 pages (libfuse
+ * derives max_pages from max_write and limits it to its buffer). Requests are
+ * spliced from /dev/fuse, if the kernel can do that. The writeback cache is
+ * left off: the kernel would write back whole pages, and converting the line
+ * ends of the bytes the application didn't write would change them. Options
+ * like -o max_write=N or -o writeback_cache given on the command line override
+ * this.
+ * @param conn connection info to change
+ */
+static void tune_conn(struct fuse_conn_info* conn)
+{
+	const unsigned wanted = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE;
+	conn->want |= conn->capable & wanted;
+	conn->max_write = 1024 * 1024;
+	
+	if (conn_opts)
+	{
+		fuse_apply_conn_info_opts(conn_opts, conn);
+	}
+}
+
+void* init_alto(fuse_conn_info* info, struct fuse_config*)
+#else
 void* init_alto(fuse_conn_info* info)
+#endif
 {
+#if FUSE_VERSION >= 30
+	tune_conn(info);
+#else
 	(void)info;
+#endif
 	
-	afs = new AltoFS(filenames, verbose, check, rebuild);
+	afs = new AltoFS(filenames, verbose, check, rebuild, inplace, overlay);
+	if (save_codec >= 0)
+	{
+		afs->set_save_codec((afs_codec_t)save_codec);
+	}
+	if (alloc_policy >= 0)
+	{
+		afs->set_alloc_policy((afs_alloc_policy_t)alloc_policy);
+	}
+	afs->start_writeback(flush_interval, (size_t)dirty_max);
 	
 #if DEBUG
 	log(3, "%s: fuse_conn_info* = %p\n", __func__, (void*)info);
 	log(3, "%s:   proto_major             : %u\n", __func__, info->proto_major);
 	log(3, "%s:   proto_minor             : %u\n", __func__, info->proto_minor);
+#if FUSE_VERSION < 30
 	log(3, "%s:   async_read              : %u\n", __func__, info->async_read);
+#endif
 	log(3, "%s:   max_write               : %u\n", __func__, info->max_write);
 	log(3, "%s:   max_readahead           : %u\n", __func__, info->max_readahead);
 	log(3, "%s:   capable                 : %#x\n", __func__, info->capable);
@@ -509,91 +654,716 @@ void* init_alto(fuse_conn_info* info)
 	return afs;
 }
 
-static int usage(const char* program)
+/*******************************************************************************************
+ *
+ * Low-level (inode based) interface, selected with --lowlevel
+ *
+ * The inode number of a file is its leader page VDA plus one, since the root
+ * directory is FUSE_ROOT_ID (1) and SysDir's leader page is VDA 1. As the
+ * numbers need no table, lookup() and forget() keep no state; the generation
+ * of the leader page tells a reused number from the file that had it before.
+ * An open file carries its leader page in fi->fh and an open directory a
+ * snapshot of the directory, so reading and writing never look at a name.
+ * An unlinked file keeps its pages until its last handle is released.
+ *
+ *******************************************************************************************/
+
+static fuse_ino_t vda_to_ino(page_t vda)
 {
-	const char* prog = strrchr(program, '/');
-	prog = prog ? prog + 1 : program;
+	return (fuse_ino_t)vda + FUSE_ROOT_ID;
+}
+
+static page_t ino_to_vda(fuse_ino_t ino)
+{
+	return (page_t)(ino - FUSE_ROOT_ID);
+}
+
+static AltoFS* alto_ll(fuse_req_t req)
+{
+	return *reinterpret_cast<AltoFS**>(fuse_req_userdata(req));
+}
+
+/**
+ * @brief Fill the entry parameters for a file of the snapshot
+ * @param req request, which gives the caller's uid and gid
+ * @param st status of the file, with the leader page as inode number
+ * @param e entry parameters to fill
+ */
+static void fill_entry_ll(fuse_req_t req, const struct stat* st, struct fuse_entry_param* e)
+{
+	const struct fuse_ctx* ctx = fuse_req_ctx(req);
+	
+	memset(e, 0, sizeof(*e));
+	e->ino = vda_to_ino((page_t)st->st_ino);
+	e->generation = alto_ll(req)->generation((page_t)st->st_ino);
+	e->attr = *st;
+	e->attr.st_ino = e->ino;
+	e->attr.st_uid = ctx->uid;
+	e->attr.st_gid = ctx->gid;
+	e->attr_timeout = attr_timeout;
+	e->entry_timeout = entry_timeout;
+}
+
+/**
+ * @brief Get the status of an inode
+ * @param req request, which gives the caller's uid and gid
+ * @param ino inode number
+ * @param st pointer to the struct stat to fill
+ * @return 0 on success, or -ENOENT if there is no such inode
+ */
+static int stat_ll(fuse_req_t req, fuse_ino_t ino, struct stat* st)
+{
+	AltoFS* afs = alto_ll(req);
+	const int res = ino == FUSE_ROOT_ID ? afs->getattr("/", st) : afs->getattr(ino_to_vda(ino), st);
+	if (res < 0)
+	{
+		return res;
+	}
 	
-	char dateStr[32];
-	sprintf(dateStr, "%s %s", __DATE__, __TIME__);
+	const struct fuse_ctx* ctx = fuse_req_ctx(req);
+	st->st_ino = ino;
+	st->st_uid = ctx->uid;
+	st->st_gid = ctx->gid;
 	
-	fprintf(stderr, "fuse-alto Version %s (%s) by Luca Severini <lucaseverini@mac.com>\n", FUSE_ALTO_VERSION, dateStr);
-	fprintf(stderr, "Copyright (c) 2016, Juergen Buchmueller <pullmoll@t-online.de>\n\n");
-	fprintf(stderr, "usage: %s <mountpoint> [options] <disk image file> [<second disk image file>]\n", prog);
-	fprintf(stderr, "Where [options] can be one or more of\n");
-	fprintf(stderr, "    -h|--help          prints this help and all possible options, then quits\n");
-	fprintf(stderr, "    -d|--debug         prints debug messages\n");
-	fprintf(stderr, "    -f|--foreground    runs fuse-alto in the foreground\n");
-	fprintf(stderr, "    -s|--single        runs fuse-alto single threaded\n");
-	fprintf(stderr, "    -v|--verbose       sets verbose mode (can be repeated)\n");
-	fprintf(stderr, "    -c|--check         (not implemented yet) checks the validity of disk structure\n");
-	fprintf(stderr, "    -r|--rebuild       (not implemented yet) rebuilds the disk structure like the scavenger programs does\n");
-	fprintf(stderr, "    -V|--version       prints version of fuse and fuse-alto programs, then quits\n");
 	return 0;
 }
 
-static int is_alto_opt(const char* arg)
+static void init_ll(void* userdata, struct fuse_conn_info* conn)
 {
-	// no "-o option" yet
-	return 0;
+	log(2, "%s: userdata: %p\n", __func__, userdata);
+
+	// Sets the AltoFS* at userdata, which is &afs
+#if FUSE_VERSION >= 30
+	init_alto(conn, NULL);
+#else
+	init_alto(conn);
+#endif
 }
 
-static int alto_fuse_main(struct fuse_args *args)
+static void destroy_ll(void* userdata)
 {
-	return fuse_main(args->argc, args->argv, fuse_ops, NULL);
+	destroy_alto(*reinterpret_cast<AltoFS**>(userdata));
 }
 
-static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs)
+static void lookup_ll(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-	// char* arg0 = reinterpret_cast<char *>(data);
+	log(2, "%s: parent: %lu name: %s\n", __func__, (unsigned long)parent, name);
+
+	std::shared_ptr<const afs_snapshot> snap = alto_ll(req)->snapshot();
+	const afs_dirent_t* entry = parent == FUSE_ROOT_ID && snap ? snap->find(name, strlen(name)) : NULL;
 	
-	switch (key)
+	struct fuse_entry_param e;
+	if (entry)
 	{
-		case FUSE_OPT_KEY_OPT:
-			if (is_alto_opt(arg))
-			{
-				size_t size = strlen(arg) + 3;
-				char* tmp = new char[size];
-				snprintf(tmp, size, "-o%s", arg);
-				// Not yet
-				// fuse_opt_add_arg(atlto_args, arg, -1);
-				delete[] tmp;
-				
-				return 0;
-			}
-			break;
-			
-		case FUSE_OPT_KEY_NONOPT:
-			if (nonopt_seen++ == 0)
-			{
-				return 1;
-			}
-			
-			if (NULL == filenames)
-			{
-				size_t size = strlen(arg) + 1;
-				filenames = new char[size];
-				snprintf(filenames, size, "%s", arg);
-				
-				return 0;
-			}
-			else
-			{
-				size_t size = strlen(filenames) + 1 + strlen(arg) + 1;
-				char* tmp = new char[size];
-				snprintf(tmp, size, "%s,%s", filenames, arg);
-				delete[] filenames;
-				filenames = tmp;
-				
-				return 0;
-			}
-			break;
-			
-		case KEY_HELP:
-			help = 1;
-			return 0;
-
-		case KEY_DEBUG:
+		fill_entry_ll(req, &entry->st, &e);
+	}
+	else
+	{
+		// A negative entry, which the kernel caches as well
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = entry_timeout;
+	}
+	
+	fuse_reply_entry(req, &e);
+}
+
+#if FUSE_VERSION >= 30
+static void forget_ll(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+#else
+static void forget_ll(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+#endif
+{
+	log(3, "%s: ino: %lu nlookup: %lu\n", __func__, (unsigned long)ino, (unsigned long)nlookup);
+
+	// Nothing is kept per inode
+	fuse_reply_none(req);
+}
+
+static void getattr_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*)
+{
+	log(2, "%s: ino: %lu\n", __func__, (unsigned long)ino);
+
+	struct stat st;
+	const int res = stat_ll(req, ino, &st);
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	
+	fuse_reply_attr(req, &st, attr_timeout);
+}
+
+static void setattr_ll(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info*)
+{
+	log(2, "%s: ino: %lu to_set: %#x\n", __func__, (unsigned long)ino, to_set);
+
+	AltoFS* afs = alto_ll(req);
+	struct stat st;
+	if (ino != FUSE_ROOT_ID)
+	{
+		// The file may be open and written, so get its current size
+		afs->publish_file(ino_to_vda(ino));
+	}
+	int res = stat_ll(req, ino, &st);
+	
+	if (res == 0 && ino != FUSE_ROOT_ID && (to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != st.st_size)
+	{
+		res = afs->truncate_file(ino_to_vda(ino), attr->st_size);
+	}
+	
+	const int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+	if (res == 0 && ino != FUSE_ROOT_ID && (to_set & times))
+	{
+		struct timespec tv[2];
+		tv[0].tv_sec = to_set & FUSE_SET_ATTR_ATIME_NOW ? time(NULL) : to_set & FUSE_SET_ATTR_ATIME ? attr->st_atime : st.st_atime;
+		tv[1].tv_sec = to_set & FUSE_SET_ATTR_MTIME_NOW ? time(NULL) : to_set & FUSE_SET_ATTR_MTIME ? attr->st_mtime : st.st_mtime;
+		tv[0].tv_nsec = tv[1].tv_nsec = 0;
+		
+		// A file unlinked while open has no name any more
+		res = afs->set_times(ino_to_vda(ino), tv);
+	}
+	
+	if (res == 0)
+	{
+		res = stat_ll(req, ino, &st);
+	}
+	
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	
+	fuse_reply_attr(req, &st, attr_timeout);
+}
+
+/**
+ * @brief Create a file in the root directory, replacing an existing one
+ * @param req request
+ * @param parent inode number of the directory
+ * @param name file name
+ * @param e entry parameters to fill for the new file
+ * @return 0 on success, or a negative errno
+ */
+static int make_file_ll(fuse_req_t req, fuse_ino_t parent, const char* name, struct fuse_entry_param* e)
+{
+	if (parent != FUSE_ROOT_ID)
+	{
+		return -ENOENT;
+	}
+	
+	AltoFS* afs = alto_ll(req);
+	const std::string path = std::string("/") + name;
+	
+	int res = 0;
+	if (afs->find_fileinfo(path))
+	{
+		res = afs->unlink_file(path);
+	}
+	if (res == 0)
+	{
+		res = afs->create_file(path);
+	}
+	
+	struct stat st;
+	if (res == 0 && afs->getattr(path, &st) < 0)
+	{
+		// Something went really, really wrong
+		res = -ENOSPC;
+	}
+	if (res == 0)
+	{
+		fill_entry_ll(req, &st, e);
+	}
+	
+	log(2, "%s: path: %s result: %d\n", __func__, path.c_str(), res);
+	
+	return res;
+}
+
+static void mknod_ll(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t, dev_t)
+{
+	log(2, "%s: parent: %lu name: %s\n", __func__, (unsigned long)parent, name);
+
+	struct fuse_entry_param e;
+	const int res = make_file_ll(req, parent, name, &e);
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	
+	fuse_reply_entry(req, &e);
+}
+
+static void create_ll(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t, struct fuse_file_info* fi)
+{
+	log(2, "%s: parent: %lu name: %s\n", __func__, (unsigned long)parent, name);
+
+	struct fuse_entry_param e;
+	const int res = make_file_ll(req, parent, name, &e);
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	
+	fi->fh = (uint64_t)ino_to_vda(e.ino);
+	alto_ll(req)->open_file((page_t)fi->fh);
+	fuse_reply_create(req, &e, fi);
+}
+
+static void unlink_ll(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	log(2, "%s: parent: %lu name: %s\n", __func__, (unsigned long)parent, name);
+
+	const int res = parent == FUSE_ROOT_ID ? alto_ll(req)->unlink_file(std::string("/") + name) : -ENOENT;
+	fuse_reply_err(req, -res);
+}
+
+#if FUSE_VERSION >= 30
+static void rename_ll(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags)
+#else
+static void rename_ll(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname)
+#endif
+{
+	log(2, "%s: name: %s newname: %s\n", __func__, name, newname);
+
+	int res = -ENOENT;
+#if FUSE_VERSION >= 30
+	// Neither RENAME_NOREPLACE nor RENAME_EXCHANGE
+	if (flags)
+	{
+		res = -EINVAL;
+	}
+	else
+#endif
+	if (parent == FUSE_ROOT_ID && newparent == FUSE_ROOT_ID)
+	{
+		res = alto_ll(req)->rename_file(std::string("/") + name, std::string("/") + newname);
+	}
+	
+	fuse_reply_err(req, -res);
+}
+
+static void open_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	log(2, "%s: ino: %lu\n", __func__, (unsigned long)ino);
+
+	if (ino == FUSE_ROOT_ID)
+	{
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	
+	// A lazily decoded image reads the data pages of a file only now
+	if (alto_ll(req)->open_file(ino_to_vda(ino)) < 0)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	
+	fi->fh = (uint64_t)ino_to_vda(ino);
+	fuse_reply_open(req, fi);
+}
+
+static void read_ll(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	log(2, "%s: ino: %lu size: %zu offset: %lld\n", __func__, (unsigned long)ino, size, offset);
+
+	std::vector<char> buf(size);
+	const size_t done = alto_ll(req)->read_file((page_t)fi->fh, buf.data(), size, offset);
+	if (done == (size_t)-1)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	
+	// Convert some chars from Alto to Mac
+	convertReadChars(buf.data(), done);
+	
+	fuse_reply_buf(req, buf.data(), done);
+}
+
+static void write_ll(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	log(2, "%s: ino: %lu size: %zu offset: %lld\n", __func__, (unsigned long)ino, size, offset);
+
+	// Convert some chars from Mac to Alto
+	const char* convBuff = convertWriteChars(buf, size);
+	
+	const size_t done = alto_ll(req)->write_file((page_t)fi->fh, convBuff, size, offset);
+	
+	// free the newly allocated buffer if there is one
+	if (convBuff != buf)
+	{
+		free((void*)convBuff);
+	}
+	
+	if (done == (size_t)-1)
+	{
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	
+	fuse_reply_write(req, done);
+}
+
+#if FUSE_VERSION >= 30
+/**
+ * @brief Write data which libfuse may have spliced from /dev/fuse into a pipe
+ * Without this, libfuse would read the pipe into its own buffer first.
+ * @param req request
+ * @param ino inode number
+ * @param in_buf data to write, in memory or in a pipe
+ * @param offset offset in the file
+ * @param fi open file
+ */
+static void write_buf_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* in_buf, off_t offset, struct fuse_file_info* fi)
+{
+	const size_t size = fuse_buf_size(in_buf);
+	std::vector<char> buf(size);
+	
+	// Like FUSE_BUFVEC_INIT(size), which is a compound literal C++ doesn't have
+	struct fuse_bufvec out_buf;
+	memset(&out_buf, 0, sizeof(out_buf));
+	out_buf.count = 1;
+	out_buf.buf[0].size = size;
+	out_buf.buf[0].mem = buf.data();
+	out_buf.buf[0].fd = -1;
+	
+	const ssize_t got = fuse_buf_copy(&out_buf, in_buf, (enum fuse_buf_copy_flags)0);
+	if (got < 0)
+	{
+		fuse_reply_err(req, (int)-got);
+		return;
+	}
+	
+	write_ll(req, ino, buf.data(), (size_t)got, offset, fi);
+}
+#endif
+
+static void flush_ll(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+	AltoFS* afs = alto_ll(req);
+	
+	// Reads and writes left the new size and times for getattr to here
+	afs->publish_file((page_t)fi->fh);
+	
+	// Hand the changes over to the kernel, but don't wait for the disk.
+	// Closing a file which was only opened must not write the image.
+	fuse_reply_err(req, afs->dirty((page_t)fi->fh) ? -afs->commit(false) : 0);
+}
+
+static void fsync_ll(fuse_req_t req, fuse_ino_t, int, struct fuse_file_info*)
+{
+	fuse_reply_err(req, -alto_ll(req)->commit(true));
+}
+
+static void release_ll(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+	// flush_ll() already committed the changes, but reads may have followed it
+	AltoFS* afs = alto_ll(req);
+	afs->publish_file((page_t)fi->fh);
+	afs->release_file((page_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void opendir_ll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	log(2, "%s: ino: %lu\n", __func__, (unsigned long)ino);
+
+	if (ino != FUSE_ROOT_ID)
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	
+	// The listing continues in the same snapshot, whatever changes meanwhile
+	std::shared_ptr<const afs_snapshot> snap = alto_ll(req)->snapshot();
+	if (!snap)
+	{
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	
+	fi->fh = (uint64_t)new std::shared_ptr<const afs_snapshot>(snap);
+	fuse_reply_open(req, fi);
+}
+
+static void releasedir_ll(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+	delete reinterpret_cast<std::shared_ptr<const afs_snapshot>*>(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+/**
+ * @brief List the snapshot of an open directory
+ * The offset of ".", ".." and the snapshot's entries is their index,
+ * with the deleted entries counted but skipped.
+ * @param req request
+ * @param size maximum number of bytes to reply
+ * @param offset index of the first entry to reply
+ * @param fi open directory
+ * @param plus true, to reply the entry parameters (readdirplus)
+ */
+static void list_dir_ll(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info* fi, bool plus)
+{
+	const afs_snapshot& snap = **reinterpret_cast<std::shared_ptr<const afs_snapshot>*>(fi->fh);
+	std::vector<char> buf(size);
+	size_t pos = 0;
+	
+	for (size_t idx = (size_t)offset; idx < snap.size() + 2; idx++)
+	{
+		const afs_dirent_t* entry = idx >= 2 ? &snap.entry(idx - 2) : NULL;
+		if (entry && entry->deleted)
+		{
+			continue;
+		}
+		
+		const char* name = entry ? entry->name : idx == 0 ? "." : "..";
+		struct fuse_entry_param e;
+		if (entry)
+		{
+			fill_entry_ll(req, &entry->st, &e);
+		}
+		else
+		{
+			// No inode number, so that "." and ".." are not looked up
+			memset(&e, 0, sizeof(e));
+			e.attr = *snap.st();
+			e.attr.st_ino = FUSE_ROOT_ID;
+		}
+		
+		size_t len;
+#if FUSE_VERSION >= 30
+		if (plus)
+		{
+			len = fuse_add_direntry_plus(req, buf.data() + pos, size - pos, name, &e, (off_t)(idx + 1));
+		}
+		else
+#endif
+		{
+			(void)plus;
+			len = fuse_add_direntry(req, buf.data() + pos, size - pos, name, &e.attr, (off_t)(idx + 1));
+		}
+		if (len > size - pos)
+		{
+			break;
+		}
+		pos += len;
+	}
+	
+	fuse_reply_buf(req, buf.data(), pos);
+}
+
+static void readdir_ll(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	log(2, "%s: ino: %lu size: %zu offset: %lld\n", __func__, (unsigned long)ino, size, offset);
+
+	list_dir_ll(req, size, offset, fi, false);
+}
+
+#if FUSE_VERSION >= 30
+static void readdirplus_ll(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	log(2, "%s: ino: %lu size: %zu offset: %lld\n", __func__, (unsigned long)ino, size, offset);
+
+	// The kernel gets the status of the files along, so it needs no lookup() of them
+	list_dir_ll(req, size, offset, fi, true);
+}
+#endif
+
+static void statfs_ll(fuse_req_t req, fuse_ino_t)
+{
+	struct statvfs vfs;
+	const int res = alto_ll(req)->statvfs(&vfs);
+	if (res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	
+	fuse_reply_statfs(req, &vfs);
+}
+
+static int usage(const char* program)
+{
+	const char* prog = strrchr(program, '/');
+	prog = prog ? prog + 1 : program;
+	
+	char dateStr[32];
+	sprintf(dateStr, "%s %s", __DATE__, __TIME__);
+	
+	fprintf(stderr, "fuse-alto Version %s (%s) by Luca Severini <lucaseverini@mac.com>\n", FUSE_ALTO_VERSION, dateStr);
+	fprintf(stderr, "Copyright (c) 2016, Juergen Buchmueller <pullmoll@t-online.de>\n\n");
+	fprintf(stderr, "usage: %s <mountpoint> [options] <disk image file> [<second disk image file>]\n", prog);
+	fprintf(stderr, "Where [options] can be one or more of\n");
+	fprintf(stderr, "    -h|--help          prints this help and all possible options, then quits\n");
+	fprintf(stderr, "    -d|--debug         prints debug messages\n");
+	fprintf(stderr, "    -f|--foreground    runs fuse-alto in the foreground\n");
+	fprintf(stderr, "    -s|--single        runs fuse-alto single threaded\n");
+	fprintf(stderr, "    -v|--verbose       sets verbose mode (can be repeated)\n");
+	fprintf(stderr, "    -c|--check         (not implemented yet) checks the validity of disk structure\n");
+	fprintf(stderr, "    -r|--rebuild       (not implemented yet) rebuilds the disk structure like the scavenger programs does\n");
+	fprintf(stderr, "    --inplace          writes changes to the disk image file(s) instead of to a copy named <file>~\n");
+	fprintf(stderr, "    --overlay          leaves the disk image file(s) alone and writes the changed pages to <file>.delta\n");
+	fprintf(stderr, "    -o flush_interval=N writes changes back every N seconds (default 30, 0 disables)\n");
+	fprintf(stderr, "    -o dirty_max=N     writes changes back when N pages are dirty (default 1024, 0 disables)\n");
+	fprintf(stderr, "    -o compress=C      saves the copy as none, Z, gz, zst or afz (seekable) instead of like the image\n");
+	fprintf(stderr, "    -o alloc=P         allocates pages with the policy nearest (default), first, best or cylinder\n");
+	fprintf(stderr, "    --layout           prints the fragmentation and seek distance of the files for each policy, then quits\n");
+	fprintf(stderr, "    --lowlevel         uses the inode based FUSE interface instead of the path based one\n");
+	fprintf(stderr, "    -o entry_timeout=T caches the file names for T seconds (default 1.0)\n");
+	fprintf(stderr, "    -o attr_timeout=T  caches the status of files for T seconds (default 1.0)\n");
+#if FUSE_VERSION >= 30
+	fprintf(stderr, "    -o max_idle_threads=N keeps at most N threads waiting for requests\n");
+	fprintf(stderr, "    -o max_write=N     lets the kernel write at most N bytes at once (default 1 MiB)\n");
+	fprintf(stderr, "    -o writeback_cache lets the kernel cache writes; line ends in the rest of each written page become CRs\n");
+	fprintf(stderr, "    -o no_splice_read|no_splice_write copies instead of splicing requests and replies\n");
+#endif
+	fprintf(stderr, "    -V|--version       prints version of fuse and fuse-alto programs, then quits\n");
+	return 0;
+}
+
+static int is_alto_opt(const char* arg)
+{
+	char* end = NULL;
+	
+	if (strncmp(arg, "flush_interval=", 15) == 0)
+	{
+		long val = strtol(arg + 15, &end, 0);
+		if (*end != '\0' || val < 0)
+		{
+			fprintf(stderr, "invalid value in -o %s\n", arg);
+			exit(1);
+		}
+		flush_interval = (int)val;
+		
+		return 1;
+	}
+	
+	if (strncmp(arg, "dirty_max=", 10) == 0)
+	{
+		long val = strtol(arg + 10, &end, 0);
+		if (*end != '\0' || val < 0)
+		{
+			fprintf(stderr, "invalid value in -o %s\n", arg);
+			exit(1);
+		}
+		dirty_max = val;
+		
+		return 1;
+	}
+	
+	if (strncmp(arg, "compress=", 9) == 0)
+	{
+		std::string sfx = std::string(".") + (arg + 9);
+		afs_codec_t codec = afs_codec::from_name(sfx);
+		if ((codec == CODEC_NONE && strcmp(arg + 9, "none") != 0) || !afs_codec::supported(codec))
+		{
+			fprintf(stderr, "invalid value in -o %s\n", arg);
+			exit(1);
+		}
+		save_codec = codec;
+		
+		return 1;
+	}
+	
+	if (strncmp(arg, "entry_timeout=", 14) == 0 || strncmp(arg, "attr_timeout=", 13) == 0)
+	{
+		const bool entry = arg[1] == 'n';
+		double val = strtod(strchr(arg, '=') + 1, &end);
+		if (*end != '\0' || val < 0)
+		{
+			fprintf(stderr, "invalid value in -o %s\n", arg);
+			exit(1);
+		}
+		if (entry)
+		{
+			entry_timeout = val;
+		}
+		else
+		{
+			attr_timeout = val;
+		}
+		
+		return 1;
+	}
+	
+	if (strncmp(arg, "alloc=", 6) == 0)
+	{
+		afs_alloc_policy_t policy = afs_allocator::from_name(arg + 6);
+		if (policy == ALLOC_POLICIES)
+		{
+			fprintf(stderr, "invalid value in -o %s\n", arg);
+			exit(1);
+		}
+		alloc_policy = policy;
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+static int alto_fuse_main(struct fuse_args *args)
+{
+	return fuse_main(args->argc, args->argv, fuse_ops, NULL);
+}
+
+static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+	// char* arg0 = reinterpret_cast<char *>(data);
+	
+	switch (key)
+	{
+		case FUSE_OPT_KEY_OPT:
+			if (is_alto_opt(arg))
+			{
+				size_t size = strlen(arg) + 3;
+				char* tmp = new char[size];
+				snprintf(tmp, size, "-o%s", arg);
+				// Not yet
+				// fuse_opt_add_arg(atlto_args, arg, -1);
+				delete[] tmp;
+				
+				return 0;
+			}
+			break;
+			
+		case FUSE_OPT_KEY_NONOPT:
+			if (nonopt_seen++ == 0)
+			{
+				return 1;
+			}
+			
+			if (NULL == filenames)
+			{
+				size_t size = strlen(arg) + 1;
+				filenames = new char[size];
+				snprintf(filenames, size, "%s", arg);
+				
+				return 0;
+			}
+			else
+			{
+				size_t size = strlen(filenames) + 1 + strlen(arg) + 1;
+				char* tmp = new char[size];
+				snprintf(tmp, size, "%s,%s", filenames, arg);
+				delete[] filenames;
+				filenames = tmp;
+				
+				return 0;
+			}
+			break;
+			
+		case KEY_HELP:
+			help = 1;
+			return 0;
+
+		case KEY_DEBUG:
 			debug = 1;
 			return 0;
 
@@ -621,6 +1391,22 @@ static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args*
 			rebuild = true;
 			return 0;
 
+		case KEY_INPLACE:
+			inplace = true;
+			return 0;
+
+		case KEY_OVERLAY:
+			overlay = true;
+			return 0;
+
+		case KEY_LAYOUT:
+			layout = true;
+			return 0;
+
+		case KEY_LOWLEVEL:
+			lowlevel = true;
+			return 0;
+
 		default:
 			fprintf(stderr, "internal error\n");
 			exit(2);
@@ -631,9 +1417,6 @@ static int fuse_opt_proc(void* data, const char* arg, int key, struct fuse_args*
 
 static void shutdown_fuse()
 {
-	delete afs;
-	afs = nullptr;
-	
 	if (fuse)
 	{
 		log(2, "%s: removing signal handlers\n", __func__);
@@ -641,6 +1424,44 @@ static void shutdown_fuse()
 		fuse_remove_signal_handlers(fuse_get_session(fuse));
 	}
 	
+#if FUSE_VERSION >= 30
+	if (mounted)
+	{
+		log(2, "%s: unmounting %s\n", __func__, mountpoint);
+		
+		if (session)
+		{
+			fuse_session_unmount(session);
+		}
+		else
+		{
+			fuse_unmount(fuse);
+		}
+		mounted = false;
+	}
+	
+	if (session)
+	{
+		log(2, "%s: shutting down the fuse session\n", __func__);
+		
+		fuse_remove_signal_handlers(session);
+		fuse_session_destroy(session);
+		session = 0;
+	}
+	
+	free(conn_opts);
+	conn_opts = 0;
+#else
+	if (session)
+	{
+		log(2, "%s: shutting down the fuse session\n", __func__);
+		
+		fuse_remove_signal_handlers(session);
+		fuse_session_remove_chan(chan);
+		fuse_session_destroy(session);
+		session = 0;
+	}
+	
 	if (mountpoint && chan)
 	{
 		log(2, "%s: unmounting %s\n", __func__, mountpoint);
@@ -649,6 +1470,7 @@ static void shutdown_fuse()
 		mountpoint = 0;
 		chan = 0;
 	}
+#endif
 	
 	if (fuse)
 	{
@@ -658,6 +1480,10 @@ static void shutdown_fuse()
 		fuse = 0;
 	}
 	
+	// In case fuse never called destroy_alto()
+	delete afs;
+	afs = nullptr;
+	
 	if (fuse_ops)
 	{
 		log(2, "%s: releasing fuse ops\n", __func__);
@@ -666,6 +1492,14 @@ static void shutdown_fuse()
 		fuse_ops = 0;
 	}
 	
+	if (fuse_ll_ops)
+	{
+		log(2, "%s: releasing fuse lowlevel ops\n", __func__);
+		
+		free(fuse_ll_ops);
+		fuse_ll_ops = 0;
+	}
+	
 	if(fuse_args.allocated != 0)
 	{
 		log(2, "%s: releasing fuse args\n", __func__);
@@ -694,6 +1528,12 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
+	if (inplace && overlay)
+	{
+		fprintf(stderr, "The options --inplace and --overlay can't be used together\n");
+		exit(1);
+	}
+
 	if (verbose)
 	{
 		printf("%s pid:%d\n", basename(argv[0]), getpid());
@@ -742,7 +1582,42 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 	
+	if (layout)
+	{
+		if (NULL == filenames)
+		{
+			usage(argv[0]);
+			
+			exit(1);
+		}
+		
+		AltoFS* fs = new AltoFS(filenames, verbose, check, rebuild, inplace, overlay);
+		fs->report_layout();
+		delete fs;
+		
+		exit(0);
+	}
+	
+#if FUSE_VERSION >= 30
+	struct fuse_cmdline_opts opts;
+	res = fuse_parse_cmdline(&fuse_args, &opts);
+	mountpoint = opts.mountpoint;
+	multithreaded = !opts.singlethread;
+	foreground = opts.foreground;
+	
+	// Each worker thread reads its requests from its own clone of /dev/fuse
+	loop_config.clone_fd = 1;
+	loop_config.max_idle_threads = opts.max_idle_threads;
+	
+	// Taken out of the arguments before fuse_new() sees them, and applied by tune_conn()
+	conn_opts = fuse_parse_conn_info_opts(&fuse_args);
+	if (res != -1 && conn_opts == NULL)
+	{
+		res = -1;
+	}
+#else
 	res = fuse_parse_cmdline(&fuse_args, &mountpoint, &multithreaded, &foreground);
+#endif
 	if (res == -1)
 	{
 		perror("fuse_parse_cmdline()");
@@ -769,7 +1644,39 @@ int main(int argc, char *argv[])
 	fuse_ops->readdir = readdir_alto;
 	fuse_ops->utimens = utimens_alto;
 	fuse_ops->statfs = statfs_alto;
+	fuse_ops->flush = flush_alto;
+	fuse_ops->fsync = fsync_alto;
+	fuse_ops->release = release_alto;
 	fuse_ops->init = init_alto;
+	fuse_ops->destroy = destroy_alto;
+	
+	fuse_ll_ops = reinterpret_cast<struct fuse_lowlevel_ops *>(calloc(1, sizeof(*fuse_ll_ops)));
+	fuse_ll_ops->init = init_ll;
+	fuse_ll_ops->destroy = destroy_ll;
+	fuse_ll_ops->lookup = lookup_ll;
+	fuse_ll_ops->forget = forget_ll;
+	fuse_ll_ops->getattr = getattr_ll;
+	fuse_ll_ops->setattr = setattr_ll;
+	fuse_ll_ops->mknod = mknod_ll;
+	fuse_ll_ops->create = create_ll;
+	fuse_ll_ops->unlink = unlink_ll;
+	fuse_ll_ops->rename = rename_ll;
+	fuse_ll_ops->open = open_ll;
+	fuse_ll_ops->read = read_ll;
+	fuse_ll_ops->write = write_ll;
+#if FUSE_VERSION >= 30
+	fuse_ll_ops->write_buf = write_buf_ll;
+#endif
+	fuse_ll_ops->flush = flush_ll;
+	fuse_ll_ops->fsync = fsync_ll;
+	fuse_ll_ops->release = release_ll;
+	fuse_ll_ops->opendir = opendir_ll;
+	fuse_ll_ops->readdir = readdir_ll;
+#if FUSE_VERSION >= 30
+	fuse_ll_ops->readdirplus = readdirplus_ll;
+#endif
+	fuse_ll_ops->releasedir = releasedir_ll;
+	fuse_ll_ops->statfs = statfs_ll;
 	
 	atexit(shutdown_fuse);
 	
@@ -787,6 +1694,43 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
+#if FUSE_VERSION >= 30
+	if (lowlevel)
+	{
+		// The AltoFS* is created by init_ll() at &afs
+		session = fuse_session_new(&fuse_args, fuse_ll_ops, sizeof(*fuse_ll_ops), &afs);
+		if (session == 0)
+		{
+			perror("fuse_session_new()");
+			exit(2);
+		}
+		
+		res = fuse_session_mount(session, mountpoint);
+	}
+	else
+	{
+		// The path based library caches names and status itself
+		char timeouts[80];
+		snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g", entry_timeout, attr_timeout);
+		fuse_opt_add_arg(&fuse_args, timeouts);
+		
+		fuse = fuse_new(&fuse_args, fuse_ops, sizeof(*fuse_ops), NULL);
+		if (fuse == 0)
+		{
+			perror("fuse_new()");
+			exit(2);
+		}
+		
+		res = fuse_mount(fuse, mountpoint);
+	}
+	
+	if (res != 0)
+	{
+		perror("fuse_mount()");
+		exit(1);
+	}
+	mounted = true;
+#else
 	chan = fuse_mount(mountpoint, &fuse_args);
 	if (chan == 0)
 	{
@@ -794,24 +1738,57 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 	
-	fuse = fuse_new(chan, &fuse_args, fuse_ops, sizeof(*fuse_ops), NULL);
-	if (fuse == 0)
+	if (lowlevel)
 	{
-		perror("fuse_new()");
-		exit(2);
+		// The AltoFS* is created by init_ll() at &afs
+		session = fuse_lowlevel_new(&fuse_args, fuse_ll_ops, sizeof(*fuse_ll_ops), &afs);
+		if (session == 0)
+		{
+			perror("fuse_lowlevel_new()");
+			exit(2);
+		}
+		
+		fuse_session_add_chan(session, chan);
 	}
+	else
+	{
+		// The path based library caches names and status itself
+		char timeouts[80];
+		snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g", entry_timeout, attr_timeout);
+		fuse_opt_add_arg(&fuse_args, timeouts);
+		
+		fuse = fuse_new(chan, &fuse_args, fuse_ops, sizeof(*fuse_ops), NULL);
+		if (fuse == 0)
+		{
+			perror("fuse_new()");
+			exit(2);
+		}
+	}
+#endif
 	
 	res = fuse_daemonize(foreground);
 	if (res != -1)
 	{
-		res = fuse_set_signal_handlers(fuse_get_session(fuse));
+		res = fuse_set_signal_handlers(lowlevel ? session : fuse_get_session(fuse));
 	}
 	
 	if (res != -1)
 	{
-		if (multithreaded)
+		if (lowlevel)
 		{
+#if FUSE_VERSION >= 30
+			res = multithreaded ? fuse_session_loop_mt(session, &loop_config) : fuse_session_loop(session);
+#else
+			res = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+#endif
+		}
+		else if (multithreaded)
+		{
+#if FUSE_VERSION >= 30
+			res = fuse_loop_mt(fuse, &loop_config);
+#else
 			res = fuse_loop_mt(fuse);
+#endif
 		}
 		else
 		{
@@ -0,0 +1,274 @@
+/*******************************************************************************************
+ *
+ * Alto disk image write-ahead journal
+ *
+ *******************************************************************************************/
+#include "journal.h"
+#include "crc32c.h"
+
+#define JOURNAL_MAGIC   0x4c4e4a41  //!< "AJNL" in little endian
+#define JOURNAL_ENTRY   (sizeof(uint32_t) + sizeof(afs_page_t))
+
+afs_journal::afs_journal() :
+    m_name(),
+    m_fd(-1),
+    m_seq(0),
+    m_size(0),
+    m_record(),
+    m_count(0)
+{
+}
+
+afs_journal::~afs_journal()
+{
+    close();
+}
+
+/**
+ * @brief Open (or create) the journal file
+ * @param name file name of the journal
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_journal::open(std::string name)
+{
+    close();
+
+    int fd = ::open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    m_name = name;
+    m_fd = fd;
+    m_seq = 0;
+    m_size = 0;
+
+    return true;
+}
+
+/**
+ * @brief Close the journal file
+ * @param remove if true, also remove the file
+ */
+void afs_journal::close(bool remove)
+{
+    if (m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+
+        if (remove)
+        {
+            unlink(m_name.c_str());
+        }
+    }
+
+    m_record.clear();
+    m_count = 0;
+}
+
+bool afs_journal::active() const
+{
+    return m_fd >= 0;
+}
+
+size_t afs_journal::size() const
+{
+    return m_size;
+}
+
+/**
+ * @brief Read all complete records and hand their pages to a function
+ *
+ * The journal is truncated after the last complete record, so that
+ * new records are appended to a valid journal. A record with a page
+ * count or a page number out of range is treated like a torn one, even
+ * before its CRC is checked, so that a corrupt header can't make us
+ * allocate a huge buffer.
+ *
+ * @param npages number of pages of the disk image(s)
+ * @param apply function called for every page image, in journal order
+ * @return number of page images replayed
+ */
+size_t afs_journal::replay(page_t npages, std::function<void(page_t, const afs_page_t*)> apply)
+{
+    size_t pages = 0;
+    off_t offs = 0;
+    std::vector<char> entries;
+
+    while (m_fd >= 0)
+    {
+        afs_journal_rec_t rec;
+        if (pread(m_fd, &rec, sizeof(rec), offs) != (ssize_t)sizeof(rec) || rec.magic != JOURNAL_MAGIC)
+        {
+            break;
+        }
+
+        // A commit has at least one page and no page twice
+        if (rec.count == 0 || rec.count > 2 * NPAGES)
+        {
+            break;
+        }
+
+        size_t length = rec.count * JOURNAL_ENTRY;
+        entries.resize(length);
+        if (pread(m_fd, entries.data(), length, offs + sizeof(rec)) != (ssize_t)length)
+        {
+            break;
+        }
+
+        uint32_t crc = crc32c(0, &rec.seq, 2 * sizeof(uint32_t));
+        crc = crc32c(crc, entries.data(), length);
+        if (crc != rec.crc)
+        {
+            break;
+        }
+
+        uint32_t i;
+        for (i = 0; i < rec.count; i++)
+        {
+            uint32_t vda;
+            memcpy(&vda, entries.data() + i * JOURNAL_ENTRY, sizeof(vda));
+            if (vda >= (uint32_t)npages)
+            {
+                break;
+            }
+        }
+        if (i < rec.count)
+        {
+            break;
+        }
+
+        for (i = 0; i < rec.count; i++)
+        {
+            const char* entry = entries.data() + i * JOURNAL_ENTRY;
+            uint32_t vda;
+            memcpy(&vda, entry, sizeof(vda));
+            apply((page_t)vda, reinterpret_cast<const afs_page_t*>(entry + sizeof(vda)));
+        }
+
+        pages += rec.count;
+        m_seq = rec.seq + 1;
+        offs += sizeof(rec) + length;
+    }
+
+    // Drop a torn record at the end
+    if (m_fd >= 0 && ftruncate(m_fd, offs) == 0)
+    {
+        m_size = (size_t)offs;
+    }
+
+    return pages;
+}
+
+/**
+ * @brief Add a page image to the record of the next commit
+ * @param vda page number
+ * @param page pointer to the page contents
+ */
+void afs_journal::add(page_t vda, const afs_page_t* page)
+{
+    if (m_record.empty())
+    {
+        m_record.resize(sizeof(afs_journal_rec_t));
+    }
+
+    uint32_t v = (uint32_t)vda;
+    const char* src = reinterpret_cast<const char*>(page);
+    m_record.insert(m_record.end(), reinterpret_cast<const char*>(&v), reinterpret_cast<const char*>(&v) + sizeof(v));
+    m_record.insert(m_record.end(), src, src + sizeof(afs_page_t));
+    m_count++;
+}
+
+size_t afs_journal::pending() const
+{
+    return m_count;
+}
+
+/**
+ * @brief Append the pending pages as one record and flush it to stable storage
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_journal::commit()
+{
+    if (m_fd < 0)
+    {
+        errno = EBADF;
+        return false;
+    }
+
+    if (m_count == 0)
+    {
+        return true;
+    }
+
+    afs_journal_rec_t rec;
+    rec.magic = JOURNAL_MAGIC;
+    rec.seq = m_seq;
+    rec.count = m_count;
+    rec.crc = crc32c(0, &rec.seq, 2 * sizeof(uint32_t));
+    rec.crc = crc32c(rec.crc, m_record.data() + sizeof(rec), m_record.size() - sizeof(rec));
+    memcpy(m_record.data(), &rec, sizeof(rec));
+
+    const char* src = m_record.data();
+    size_t length = m_record.size();
+    off_t offs = (off_t)m_size;
+    bool ok = true;
+    while (ok && length > 0)
+    {
+        ssize_t bytes = pwrite(m_fd, src, length, offs);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        ok = bytes > 0;
+        if (ok)
+        {
+            src += bytes;
+            offs += bytes;
+            length -= bytes;
+        }
+    }
+
+#if defined(__APPLE__)
+    ok = ok && (fcntl(m_fd, F_FULLFSYNC) == 0 || fsync(m_fd) == 0);
+#else
+    ok = ok && fdatasync(m_fd) == 0;
+#endif
+
+    // The caller adds the pages again, if the commit failed
+    m_record.clear();
+    m_count = 0;
+
+    if (ok)
+    {
+        m_size = (size_t)offs;
+        m_seq++;
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Empty the journal, after all its pages reached the image on stable storage
+ * @return true on success, or false on error (errno is set)
+ */
+bool afs_journal::reset()
+{
+    if (m_fd < 0)
+    {
+        errno = EBADF;
+        return false;
+    }
+
+    if (ftruncate(m_fd, 0) < 0 || fsync(m_fd) < 0)
+    {
+        return false;
+    }
+
+    m_size = 0;
+
+    return true;
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************************
+ *
+ * Alto disk image write-ahead journal
+ *
+ *******************************************************************************************/
+#if !defined(_JOURNAL_H_)
+#define _JOURNAL_H_
+
+#include <functional>
+
+#include "afs_types.h"
+
+/**
+ * @brief Header of one journal record
+ *
+ * A record holds the images of all pages changed by one commit.
+ * It is followed by count entries of a 32 bit page number (vda)
+ * and the afs_page_t of that page.
+ */
+typedef struct {
+    uint32_t magic;                         //!< JOURNAL_MAGIC
+    uint32_t seq;                           //!< Sequence number of the record
+    uint32_t count;                         //!< Number of page entries following
+    uint32_t crc;                           //!< CRC-32C of seq, count and the entries
+}   afs_journal_rec_t;
+
+/**
+ * @brief Class to keep an append-only redo journal of page images
+ *
+ * The pages changed since the last commit are collected with add(), then
+ * commit() appends them as a single record and waits until the record is
+ * on stable storage. Only after that the pages may be written to the image.
+ * When the image itself is synced, reset() empties the journal.
+ *
+ * At mount time replay() hands the page images of all complete records
+ * to the caller. A torn or corrupt record ends the replay; it and any
+ * data after it are discarded.
+ */
+class afs_journal
+{
+public:
+    afs_journal();
+    ~afs_journal();
+
+    bool open(std::string name);
+    void close(bool remove = false);
+    bool active() const;
+    size_t size() const;
+
+    size_t replay(page_t npages, std::function<void(page_t, const afs_page_t*)> apply);
+
+    void add(page_t vda, const afs_page_t* page);
+    size_t pending() const;
+    bool commit();
+    bool reset();
+
+private:
+    std::string m_name;                     //!< File name of the journal
+    int m_fd;                               //!< File descriptor of the journal, or -1
+    uint32_t m_seq;                         //!< Sequence number of the next record
+    size_t m_size;                          //!< Size of the valid records in the journal
+    std::vector<char> m_record;             //!< The record being built by add()
+    uint32_t m_count;                       //!< Number of pages in m_record
+};
+
+#endif // !defined(_JOURNAL_H_)
@@ -0,0 +1,135 @@
+/*******************************************************************************************
+ *
+ * Reader/writer lock for the file system operations
+ *
+ *******************************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rwlock.h"
+
+/**
+ * @brief Stop on a misuse of the lock, which would otherwise deadlock or corrupt it
+ * This is checked in release builds as well, unlike an assert().
+ * @param flag condition which must be true
+ * @param errmsg message to print if it is false
+ */
+static void rwlock_assert_or_die(bool flag, const char* errmsg)
+{
+    if (flag)
+        return;
+    fprintf(stdout, "afs_rwlock: %s\n", errmsg);
+    fflush(stdout);
+    abort();
+}
+
+afs_rwlock::afs_rwlock() :
+    m_mutex(),
+    m_cv(),
+    m_readers(0),
+    m_writers_waiting(0),
+    m_writer(),
+    m_depth(0),
+    m_shared()
+{
+}
+
+/**
+ * @brief Lock exclusive, waiting until no other thread holds the lock
+ */
+void afs_rwlock::lock()
+{
+    const std::thread::id self = std::this_thread::get_id();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_writer == self)
+    {
+        m_depth++;
+        return;
+    }
+
+    // Upgrading a shared lock would wait for ourselves
+    rwlock_assert_or_die(m_shared.find(self) == m_shared.end(), "Upgrading a shared lock to exclusive");
+
+    m_writers_waiting++;
+    m_cv.wait(lock, [this]() { return m_writer == std::thread::id() && m_readers == 0; });
+    m_writers_waiting--;
+    m_writer = self;
+    m_depth = 1;
+}
+
+/**
+ * @brief Unlock exclusive
+ */
+void afs_rwlock::unlock()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_depth == 0)
+    {
+        m_writer = std::thread::id();
+        m_cv.notify_all();
+    }
+}
+
+/**
+ * @brief Lock shared, waiting until no thread holds or waits for it exclusive
+ */
+void afs_rwlock::lock_shared()
+{
+    const std::thread::id self = std::this_thread::get_id();
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_writer == self)
+    {
+        // Nested in our own exclusive lock
+        m_depth++;
+        return;
+    }
+
+    std::unordered_map<std::thread::id, size_t>::iterator it = m_shared.find(self);
+    if (it != m_shared.end())
+    {
+        // Nested in our own shared lock, which must not wait for a writer
+        it->second++;
+        return;
+    }
+
+    m_cv.wait(lock, [this]() { return m_writer == std::thread::id() && m_writers_waiting == 0; });
+    m_readers++;
+    m_shared[self] = 1;
+}
+
+/**
+ * @brief Unlock shared
+ */
+void afs_rwlock::unlock_shared()
+{
+    const std::thread::id self = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_writer == self)
+    {
+        // The exclusive lock is still held by the outer caller
+        m_depth--;
+        return;
+    }
+
+    std::unordered_map<std::thread::id, size_t>::iterator it = m_shared.find(self);
+    rwlock_assert_or_die(it != m_shared.end(), "Unlocking a shared lock which is not held");
+    if (--it->second == 0)
+    {
+        m_shared.erase(it);
+        if (--m_readers == 0)
+        {
+            m_cv.notify_all();
+        }
+    }
+}
+
+afs_read_lock::afs_read_lock(afs_rwlock& lock) :
+    m_lock(lock)
+{
+    m_lock.lock_shared();
+}
+
+afs_read_lock::~afs_read_lock()
+{
+    m_lock.unlock_shared();
+}
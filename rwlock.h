@@ -0,0 +1,71 @@
+/*******************************************************************************************
+ *
+ * Reader/writer lock for the file system operations
+ *
+ *******************************************************************************************/
+#if !defined(_RWLOCK_H_)
+#define _RWLOCK_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * @brief Reentrant reader/writer lock
+ *
+ * Any number of threads can hold the lock shared, or one thread can hold
+ * it exclusive. C++11 has no std::shared_mutex, so this is built from a
+ * mutex and a condition variable.
+ *
+ * The operations call each other, so the lock is reentrant: a thread which
+ * holds it exclusive can lock it again, shared or exclusive, and a thread
+ * which holds it shared can lock it shared again, even while a writer waits.
+ * A thread which holds it shared must not lock it exclusive.
+ *
+ * Waiting writers keep new readers out, so a steady stream of readers can't
+ * starve them.
+ *
+ * lock()/unlock() make it usable with std::lock_guard and std::unique_lock,
+ * afs_read_lock does the same for lock_shared()/unlock_shared().
+ */
+class afs_rwlock
+{
+public:
+    afs_rwlock();
+
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+
+private:
+    afs_rwlock(const afs_rwlock&);
+    afs_rwlock& operator=(const afs_rwlock&);
+
+    std::mutex m_mutex;                     //!< Protects the members below
+    std::condition_variable m_cv;           //!< Wakes up the threads waiting for the lock
+    size_t m_readers;                       //!< Number of threads holding the lock shared
+    size_t m_writers_waiting;               //!< Number of threads waiting to lock it exclusive
+    std::thread::id m_writer;               //!< Thread holding the lock exclusive, if any
+    size_t m_depth;                         //!< Number of times m_writer locked it
+    std::unordered_map<std::thread::id, size_t> m_shared;   //!< Number of times each reader locked it
+};
+
+/**
+ * @brief Scoped shared lock of an afs_rwlock, like std::lock_guard
+ */
+class afs_read_lock
+{
+public:
+    explicit afs_read_lock(afs_rwlock& lock);
+    ~afs_read_lock();
+
+private:
+    afs_read_lock(const afs_read_lock&);
+    afs_read_lock& operator=(const afs_read_lock&);
+
+    afs_rwlock& m_lock;                     //!< The lock held shared
+};
+
+#endif // !defined(_RWLOCK_H_)
@@ -0,0 +1,159 @@
+/*******************************************************************************************
+ *
+ * Immutable directory listing
+ *
+ *******************************************************************************************/
+#include <algorithm>
+#include <cstring>
+
+#include "snapshot.h"
+
+afs_snapshot::afs_snapshot(uint64_t version, const struct stat& st) :
+    m_version(version),
+    m_st(st),
+    m_entries(),
+    m_sorted(),
+    m_by_ino()
+{
+}
+
+/**
+ * @brief Copy a snapshot, so that the copy can be changed before it is published
+ * @param other snapshot to copy
+ * @param version version of the copy
+ */
+afs_snapshot::afs_snapshot(const afs_snapshot& other, uint64_t version) :
+    m_version(version),
+    m_st(other.m_st),
+    m_entries(other.m_entries),
+    m_sorted(other.m_sorted),
+    m_by_ino(other.m_by_ino)
+{
+}
+
+/**
+ * @brief Append an entry, call sort() after the last one
+ * @param name file name
+ * @param st status of the file
+ * @param deleted true, if the file is not in SysDir
+ */
+void afs_snapshot::append(const std::string& name, const struct stat& st, bool deleted)
+{
+    afs_dirent_t entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, name.c_str(), sizeof(entry.name) - 1);
+    entry.deleted = deleted;
+    entry.st = st;
+    m_entries.push_back(entry);
+}
+
+/**
+ * @brief Replace the status of an entry
+ * @param idx index of the entry
+ * @param st new status
+ */
+void afs_snapshot::set_stat(size_t idx, const struct stat& st)
+{
+    m_entries[idx].st = st;
+}
+
+/**
+ * @brief Build the index sorted by name and the inode table
+ * Entries with the same name stay in directory order, so that find()
+ * returns the first one, like afs_fileinfo::find().
+ */
+void afs_snapshot::sort()
+{
+    m_sorted.resize(m_entries.size());
+    for (size_t i = 0; i < m_sorted.size(); i++)
+    {
+        m_sorted[i] = i;
+    }
+
+    std::stable_sort(m_sorted.begin(), m_sorted.end(), [this](size_t a, size_t b)
+    {
+        return strcmp(m_entries[a].name, m_entries[b].name) < 0;
+    });
+
+    // The inode numbers are leader page VDAs, so the table stays small
+    std::shared_ptr<std::vector<ssize_t> > by_ino = std::make_shared<std::vector<ssize_t> >();
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        const size_t ino = (size_t)m_entries[i].st.st_ino;
+        if (ino >= by_ino->size())
+        {
+            by_ino->resize(ino + 1, -1);
+        }
+        if ((*by_ino)[ino] < 0)
+        {
+            (*by_ino)[ino] = (ssize_t)i;
+        }
+    }
+    m_by_ino = by_ino;
+}
+
+uint64_t afs_snapshot::version() const
+{
+    return m_version;
+}
+
+const struct stat* afs_snapshot::st() const
+{
+    return &m_st;
+}
+
+size_t afs_snapshot::size() const
+{
+    return m_entries.size();
+}
+
+const afs_dirent_t& afs_snapshot::entry(size_t idx) const
+{
+    return m_entries[idx];
+}
+
+/**
+ * @brief Find an entry by name
+ * @param name pointer to the name (need not be 0 terminated)
+ * @param length length of the name
+ * @return pointer to the first entry with that name, or NULL if there is none
+ */
+const afs_dirent_t* afs_snapshot::find(const char* name, size_t length) const
+{
+    if (length >= FNLEN)
+    {
+        return NULL;
+    }
+
+    char key[FNLEN];
+    memcpy(key, name, length);
+    key[length] = '\0';
+
+    std::vector<size_t>::const_iterator it = std::lower_bound(m_sorted.begin(), m_sorted.end(), key,
+        [this](size_t idx, const char* key)
+    {
+        return strcmp(m_entries[idx].name, key) < 0;
+    });
+
+    if (it == m_sorted.end() || strcmp(m_entries[*it].name, key) != 0)
+    {
+        return NULL;
+    }
+
+    return &m_entries[*it];
+}
+
+/**
+ * @brief Find the entry of a file by its inode number
+ * @param ino inode number (leader page VDA)
+ * @return index of the entry, or -1 if there is none
+ */
+ssize_t afs_snapshot::index_of(ino_t ino) const
+{
+    if (!m_by_ino || (size_t)ino >= m_by_ino->size())
+    {
+        return -1;
+    }
+
+    return (*m_by_ino)[ino];
+}
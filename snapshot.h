@@ -0,0 +1,68 @@
+/*******************************************************************************************
+ *
+ * Immutable directory listing
+ *
+ *******************************************************************************************/
+#if !defined(_SNAPSHOT_H_)
+#define _SNAPSHOT_H_
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "afs_types.h"
+
+/**
+ * @brief One entry of a directory snapshot
+ */
+typedef struct
+{
+    char        name[FNLEN];            //!< File name, 0 terminated
+    bool        deleted;                //!< True, if the file is not in SysDir
+    struct stat st;                     //!< Status of the file
+} afs_dirent_t;
+
+/**
+ * @brief Class to keep a versioned, immutable copy of a directory
+ *
+ * The entries are a flat array of names and status records, in the order
+ * of the directory's children, plus an index sorted by name and a table
+ * from inode number to entry for lookups.
+ *
+ * A snapshot is built once and never changed after it is published, so
+ * any number of threads can list it and look up names in it without a
+ * lock. A change of the directory or of a file's status publishes a new
+ * snapshot, which is a copy of the previous one with the next version.
+ * The copy shares the inode table, since a status change keeps the
+ * order of the entries.
+ */
+class afs_snapshot
+{
+public:
+    afs_snapshot(uint64_t version, const struct stat& st);
+    afs_snapshot(const afs_snapshot& other, uint64_t version);
+
+    void append(const std::string& name, const struct stat& st, bool deleted);
+    void set_stat(size_t idx, const struct stat& st);
+    void sort();
+
+    uint64_t version() const;
+    const struct stat* st() const;
+    size_t size() const;
+    const afs_dirent_t& entry(size_t idx) const;
+    const afs_dirent_t* find(const char* name, size_t length) const;
+    ssize_t index_of(ino_t ino) const;
+
+private:
+    afs_snapshot& operator=(const afs_snapshot&);
+
+    uint64_t m_version;                     //!< Number of snapshots published before this one
+    struct stat m_st;                       //!< Status of the directory itself
+    std::vector<afs_dirent_t> m_entries;    //!< The entries in directory order
+    std::vector<size_t> m_sorted;           //!< Indices of m_entries sorted by name
+    std::shared_ptr<const std::vector<ssize_t> > m_by_ino; //!< Index into m_entries for each inode number, or -1
+};
+
+#endif // !defined(_SNAPSHOT_H_)
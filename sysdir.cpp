@@ -0,0 +1,290 @@
+/*******************************************************************************************
+ *
+ * Alto SysDir entries
+ *
+ *******************************************************************************************/
+#include <algorithm>
+
+#include "sysdir.h"
+
+#define SYSDIR_TYPE_FILE    4       //!< Type of an entry for an existing file
+#define SYSDIR_MAX_WORDS    1023    //!< Largest length of an entry in words, which has 10 bits
+
+afs_sysdir::afs_sysdir() :
+    m_lsb(0),
+    m_entries(),
+    m_names(),
+    m_index(),
+    m_deleted(0),
+    m_bytes(0)
+{
+    // Same as AltoFS::lsb()
+    const union { word e; byte lh[2]; } little = { 1 };
+    m_lsb = little.lh[0];
+}
+
+void afs_sysdir::clear()
+{
+    m_entries.clear();
+    m_names.clear();
+    m_index.clear();
+    m_deleted = 0;
+    m_bytes = 0;
+}
+
+/**
+ * @brief Add an entry read from the SysDir file
+ * @param name decoded file name of the entry
+ * @param dv the entry
+ */
+void afs_sysdir::append(const std::string& name, const afs_dv_t& dv)
+{
+    m_index.insert(std::make_pair(name, m_entries.size()));
+    m_entries.push_back(afs_dv(dv));
+    m_names.push_back(name);
+    m_bytes += entry_size(dv);
+    if (!is_used(dv))
+    {
+        m_deleted++;
+    }
+}
+
+/**
+ * @brief Find the used entry for a file name
+ * @param name file name
+ * @return pointer to the entry, or NULL if there is none
+ */
+afs_dv_t* afs_sysdir::find(const std::string& name)
+{
+    const size_t pos = find_used(name);
+    if (pos == m_entries.size())
+    {
+        return NULL;
+    }
+
+    return &m_entries[pos].data;
+}
+
+/**
+ * @brief Insert a new entry, reusing a deleted entry with the same name
+ * @param name file name of the entry
+ * @param dv the entry
+ *
+ * A deleted entry with the same name has the same size, so it is
+ * overwritten in place. Otherwise the entry goes at the end.
+ */
+void afs_sysdir::insert(const std::string& name, const afs_dv_t& dv)
+{
+    auto range = m_index.equal_range(name);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        afs_dv& entry = m_entries[it->second];
+        if (!is_used(entry.data))
+        {
+            m_bytes -= entry_size(entry.data);
+            entry.data = dv;
+            m_bytes += entry_size(dv);
+            m_deleted--;
+            return;
+        }
+    }
+
+    append(name, dv);
+}
+
+/**
+ * @brief Mark the used entry for a file name as deleted
+ * @param name file name
+ * @return true on success, or false if there is no such entry
+ */
+bool afs_sysdir::remove(const std::string& name)
+{
+    afs_dv_t* dv = find(name);
+    if (!dv)
+    {
+        return false;
+    }
+
+    dv->typelength[m_lsb] = 0;
+    m_deleted++;
+
+    // Drop the deleted entries once they are the majority
+    if (m_deleted > used())
+    {
+        compact();
+    }
+
+    return true;
+}
+
+/**
+ * @brief Replace the used entry for a file name with a renamed one
+ * @param name file name
+ * @param newname new file name
+ * @param dv the renamed entry
+ * @return true on success, or false if there is no such entry
+ *
+ * The entry keeps its position in the SysDir file.
+ */
+bool afs_sysdir::rename(const std::string& name, const std::string& newname, const afs_dv_t& dv)
+{
+    auto range = m_index.equal_range(name);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        const size_t pos = it->second;
+        afs_dv& entry = m_entries[pos];
+        if (!is_used(entry.data))
+        {
+            continue;
+        }
+
+        m_bytes -= entry_size(entry.data);
+        entry.data = dv;
+        m_bytes += entry_size(dv);
+        m_names[pos] = newname;
+        m_index.erase(it);
+        m_index.insert(std::make_pair(newname, pos));
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Drop all entries marked as deleted
+ */
+void afs_sysdir::compact()
+{
+    size_t dst = 0;
+    m_index.clear();
+    for (size_t src = 0; src < m_entries.size(); src++)
+    {
+        if (!is_used(m_entries[src].data))
+        {
+            m_bytes -= entry_size(m_entries[src].data);
+            continue;
+        }
+
+        if (dst != src)
+        {
+            m_entries[dst] = m_entries[src];
+            m_names[dst].swap(m_names[src]);
+        }
+        m_index.insert(std::make_pair(m_names[dst], dst));
+        dst++;
+    }
+
+    m_entries.resize(dst);
+    m_names.resize(dst);
+    m_deleted = 0;
+}
+
+/**
+ * @brief Return the number of entries, including deleted ones
+ */
+size_t afs_sysdir::size() const
+{
+    return m_entries.size();
+}
+
+/**
+ * @brief Return the number of entries for existing files
+ */
+size_t afs_sysdir::used() const
+{
+    return m_entries.size() - m_deleted;
+}
+
+/**
+ * @brief Return the number of bytes serialize() writes
+ */
+size_t afs_sysdir::bytes() const
+{
+    return m_bytes;
+}
+
+/**
+ * @brief Write the entries in the SysDir file format
+ *
+ * Each entry gets its length in words, which the Alto uses to find the
+ * next one. The words between the last entry and size are zeroed and
+ * covered by free entries (type 0) of at most SYSDIR_MAX_WORDS words each,
+ * so that a compacted SysDir still parses on an Alto, where a zero word
+ * would be an entry of length 0.
+ *
+ * @param dst buffer of at least size bytes
+ * @param size size of the SysDir file, at least bytes()
+ * @return number of bytes of the entries
+ */
+size_t afs_sysdir::serialize(char* dst, size_t size) const
+{
+    char* pos = dst;
+    for (auto it = m_entries.begin(); it != m_entries.end(); it++)
+    {
+        const size_t esize = entry_size(it->data);
+        memcpy(pos, &it->data, esize);
+        // The Alto finds the next entry by the length in words, whatever the entry says
+        reinterpret_cast<afs_dv_t*>(pos)->typelength[m_lsb ^ 1] = (byte)(esize / 2);
+        pos += esize;
+    }
+
+    const size_t eod = (size_t)(pos - dst);
+    memset(pos, 0, size - eod);
+    for (size_t words = (size - eod) / 2; words > 0; )
+    {
+        const size_t length = std::min<size_t>(words, SYSDIR_MAX_WORDS);
+        afs_dv_t* dv = reinterpret_cast<afs_dv_t*>(pos);
+        // The upper 6 bits of the word are the type, the lower 10 bits the length
+        dv->typelength[m_lsb] = (byte)(length >> 8);
+        dv->typelength[m_lsb ^ 1] = (byte)(length & 0xff);
+        pos += length * 2;
+        words -= length;
+    }
+
+    return eod;
+}
+
+afs_sysdir::const_iterator afs_sysdir::begin() const
+{
+    return m_entries.begin();
+}
+
+afs_sysdir::const_iterator afs_sysdir::end() const
+{
+    return m_entries.end();
+}
+
+/**
+ * @brief Return the size of an entry in the SysDir file
+ */
+size_t afs_sysdir::entry_size(const afs_dv_t& dv) const
+{
+    const byte fnlen = dv.filename[m_lsb];
+    // length is always word aligned
+    const size_t nsize = (fnlen | 1) + 1;
+    return sizeof(dv) - sizeof(dv.filename) + nsize;
+}
+
+bool afs_sysdir::is_used(const afs_dv_t& dv) const
+{
+    return dv.typelength[m_lsb] == SYSDIR_TYPE_FILE;
+}
+
+/**
+ * @brief Return the position of the used entry for a file name
+ * @param name file name
+ * @return position in m_entries, or size() if there is none
+ */
+size_t afs_sysdir::find_used(const std::string& name) const
+{
+    auto range = m_index.equal_range(name);
+    for (auto it = range.first; it != range.second; it++)
+    {
+        if (is_used(m_entries[it->second].data))
+        {
+            return it->second;
+        }
+    }
+
+    return m_entries.size();
+}
@@ -0,0 +1,68 @@
+/*******************************************************************************************
+ *
+ * Alto SysDir entries
+ *
+ *******************************************************************************************/
+#if !defined(_SYSDIR_H_)
+#define _SYSDIR_H_
+
+#include <map>
+#include <vector>
+
+#include "afs_types.h"
+
+/**
+ * @brief Class to keep the entries of the SysDir file in their on-disk order
+ *
+ * The entries live in a vector in the order they have in the SysDir file,
+ * and a multimap from the file name to the position in the vector is used
+ * to find them, so finding, removing and renaming an entry takes O(log n)
+ * time. New entries reuse a deleted entry with the same name, or go at the
+ * end of the file.
+ *
+ * Removing an entry only marks it as deleted (type 0), like the Alto
+ * does. The deleted entries are dropped when they outnumber the used
+ * entries, which keeps the order of the remaining ones. The SysDir file
+ * doesn't shrink, so serialize() covers the words after the last entry
+ * with free entries, which the Alto skips by their length.
+ *
+ * The number of bytes the entries take in the SysDir file is kept up
+ * to date, so that it is known without looking at the entries.
+ */
+class afs_sysdir
+{
+public:
+    typedef std::vector<afs_dv>::const_iterator const_iterator;
+
+    afs_sysdir();
+
+    void clear();
+    void append(const std::string& name, const afs_dv_t& dv);
+    afs_dv_t* find(const std::string& name);
+    void insert(const std::string& name, const afs_dv_t& dv);
+    bool remove(const std::string& name);
+    bool rename(const std::string& name, const std::string& newname, const afs_dv_t& dv);
+    void compact();
+
+    size_t size() const;
+    size_t used() const;
+    size_t bytes() const;
+    size_t serialize(char* dst, size_t size) const;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+
+private:
+    size_t entry_size(const afs_dv_t& dv) const;
+    bool is_used(const afs_dv_t& dv) const;
+    size_t find_used(const std::string& name) const;
+
+    int m_lsb;                                      //!< Index of the least significant byte of a word
+    std::vector<afs_dv> m_entries;                  //!< The entries, in on-disk order
+    std::vector<std::string> m_names;               //!< The file names of the entries
+    std::multimap<std::string, size_t> m_index;     //!< Positions of the entries by file name
+    size_t m_deleted;                               //!< Number of entries marked as deleted
+    size_t m_bytes;                                 //!< Number of bytes of all entries in the SysDir file
+};
+
+#endif // !defined(_SYSDIR_H_)
@@ -0,0 +1,104 @@
+/*******************************************************************************************
+ *
+ * Regression test: overlay pages appended without a commit must not show up, nor reach the image
+ *
+ * usage: delta_uncommitted <disk image file> <scratch directory>
+ *
+ *******************************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "altofs.h"
+#include "test_util.h"
+
+/**
+ * @brief Read a whole file
+ * @param name file name
+ * @return the contents, or an empty string on error
+ */
+static std::string read_file(const std::string& name)
+{
+    std::string data;
+    FILE* in = fopen(name.c_str(), "rb");
+    std::vector<char> buf(65536);
+    size_t n;
+    while (in && (n = fread(buf.data(), 1, buf.size(), in)) > 0)
+    {
+        data.append(buf.data(), n);
+    }
+    if (in)
+        fclose(in);
+    return data;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <disk image file> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+
+    const std::string image = std::string(argv[2]) + "/delta_uncommitted.dsk";
+    const std::string delta = image + ".delta";
+    remove(delta.c_str());
+    remove((image + ".crc").c_str());
+    if (!copy_file(argv[1], image))
+    {
+        fprintf(stderr, "Could not copy %s to %s\n", argv[1], image.c_str());
+        return 2;
+    }
+    const std::string base = read_file(image);
+
+    // Take two free pages, and the images the overlay gives them
+    afs_diskimage disk;
+    if (!disk.map(image, false))
+    {
+        fprintf(stderr, "Could not map %s\n", image.c_str());
+        return 2;
+    }
+    const std::vector<page_t> pages = free_pages(disk, 2);
+    if (pages.size() != 2)
+    {
+        fprintf(stderr, "Not enough free pages in %s\n", image.c_str());
+        return 2;
+    }
+    afs_page_t committed = *disk.page(pages[0]);
+    afs_page_t pending = *disk.page(pages[1]);
+    const afs_page_t original = pending;
+    disk.unmap();
+    memset(committed.data, 0xa5, sizeof(committed.data));
+    memset(pending.data, 0x5a, sizeof(pending.data));
+
+    // The second page is appended after the commit, as if the system went down before the next one
+    afs_delta overlay;
+    bool ok = overlay.open(delta, NPAGES, [](page_t, const afs_page_t*) {});
+    ok = ok && overlay.write(pages[0], &committed) && overlay.commit();
+    ok = ok && overlay.write(pages[1], &pending);
+    overlay.close();
+    if (!ok)
+    {
+        fprintf(stderr, "Could not write the overlay %s\n", delta.c_str());
+        return 2;
+    }
+
+    // Mount and unmount with the overlay, then look at the pages it gives
+    {
+        AltoFS afs(image.c_str(), 0, false, false, false, true);
+    }
+    if (!disk.map(image, false) || !disk.attach_delta(delta))
+    {
+        fprintf(stderr, "Could not map %s with %s\n", image.c_str(), delta.c_str());
+        return 1;
+    }
+    const bool applied = memcmp(disk.page(pages[0]), &committed, sizeof(afs_page_t)) == 0;
+    const bool skipped = memcmp(disk.page(pages[1]), &original, sizeof(afs_page_t)) == 0;
+    disk.unmap();
+    const bool unchanged = read_file(image) == base;
+
+    printf("committed page %s, uncommitted page %s, base image %s\n", applied ? "applied" : "NOT applied",
+           skipped ? "skipped" : "APPLIED", unchanged ? "unchanged" : "CHANGED");
+    return applied && skipped && unchanged ? 0 : 1;
+}
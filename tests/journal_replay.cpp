@@ -0,0 +1,86 @@
+/*******************************************************************************************
+ *
+ * Regression test: mounting in-place replays the complete journal records only
+ *
+ * usage: journal_replay <disk image file> <scratch directory>
+ *
+ *******************************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "altofs.h"
+#include "test_util.h"
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <disk image file> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+
+    const std::string image = std::string(argv[2]) + "/journal_replay.dsk";
+    const std::string journal = image + ".journal";
+    remove(journal.c_str());
+    remove((image + ".crc").c_str());
+    if (!copy_file(argv[1], image))
+    {
+        fprintf(stderr, "Could not copy %s to %s\n", argv[1], image.c_str());
+        return 2;
+    }
+
+    // Take two free pages, and the images the journal records give them
+    afs_diskimage disk;
+    if (!disk.map(image, false))
+    {
+        fprintf(stderr, "Could not map %s\n", image.c_str());
+        return 2;
+    }
+    const std::vector<page_t> pages = free_pages(disk, 2);
+    if (pages.size() != 2)
+    {
+        fprintf(stderr, "Not enough free pages in %s\n", image.c_str());
+        return 2;
+    }
+    afs_page_t complete = *disk.page(pages[0]);
+    afs_page_t torn = *disk.page(pages[1]);
+    const afs_page_t original = torn;
+    disk.unmap();
+    memset(complete.data, 0xa5, sizeof(complete.data));
+    memset(torn.data, 0x5a, sizeof(torn.data));
+
+    // The second record loses its last half, as if the system went down while appending it
+    afs_journal jnl;
+    bool ok = jnl.open(journal);
+    jnl.add(pages[0], &complete);
+    ok = ok && jnl.commit();
+    const size_t first = jnl.size();
+    jnl.add(pages[1], &torn);
+    ok = ok && jnl.commit();
+    const size_t second = jnl.size();
+    jnl.close();
+    if (!ok || truncate(journal.c_str(), (off_t)(first + (second - first) / 2)) != 0)
+    {
+        fprintf(stderr, "Could not write the journal %s\n", journal.c_str());
+        return 2;
+    }
+
+    {
+        AltoFS afs(image.c_str(), 0, false, false, true);
+    }
+
+    if (!disk.map(image, false))
+    {
+        fprintf(stderr, "Could not map %s\n", image.c_str());
+        return 1;
+    }
+    const bool applied = memcmp(disk.page(pages[0]), &complete, sizeof(afs_page_t)) == 0;
+    const bool skipped = memcmp(disk.page(pages[1]), &original, sizeof(afs_page_t)) == 0;
+    disk.unmap();
+
+    printf("complete record %s, torn record %s\n", applied ? "applied" : "NOT applied", skipped ? "skipped" : "APPLIED");
+    return applied && skipped ? 0 : 1;
+}
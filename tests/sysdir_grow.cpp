@@ -0,0 +1,100 @@
+/*******************************************************************************************
+ *
+ * Regression test: a SysDir grown by many new files must reach the saved image
+ *
+ * usage: sysdir_grow <disk image file> <scratch directory>
+ *
+ *******************************************************************************************/
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "altofs.h"
+#include "test_util.h"
+
+static const int nfiles = 350;
+
+static std::string file_name(int i)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "zGrow%03d.txt", i);
+    return name;
+}
+
+/**
+ * @brief Read the SysDir file of a disk image
+ * The names of the entries are contiguous in one of the two byte orders,
+ * so the contents are returned in both.
+ * @param afs mounted disk image
+ * @return the SysDir file as read, followed by its bytes swapped in pairs
+ */
+static std::string read_sysdir(AltoFS& afs)
+{
+    struct stat st;
+    if (afs.getattr("/SysDir", &st) != 0)
+    {
+        return std::string();
+    }
+
+    std::string data((size_t)st.st_size, '\0');
+    const size_t done = afs.read_file((page_t)st.st_ino, &data[0], data.size(), 0, false);
+    data.resize(done == (size_t)-1 ? 0 : done);
+
+    std::string swapped(data);
+    for (size_t i = 0; i + 1 < swapped.size(); i += 2)
+    {
+        std::swap(swapped[i], swapped[i + 1]);
+    }
+
+    return data + swapped;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <disk image file> <scratch directory>\n", argv[0]);
+        return 2;
+    }
+
+    const std::string image = std::string(argv[2]) + "/sysdir_grow.dsk";
+    const std::string saved = image + "~";
+    remove(saved.c_str());
+    remove((saved + ".crc").c_str());
+    if (!copy_file(argv[1], image))
+    {
+        fprintf(stderr, "Could not copy %s to %s\n", argv[1], image.c_str());
+        return 2;
+    }
+
+    AltoFS afs(image.c_str());
+    for (int i = 0; i < nfiles; i++)
+    {
+        if (afs.create_file("/" + file_name(i)) != 0)
+        {
+            fprintf(stderr, "Could not create %s\n", file_name(i).c_str());
+            return 1;
+        }
+    }
+    if (afs.commit(true) != 0)
+    {
+        fprintf(stderr, "Could not save %s\n", saved.c_str());
+        return 1;
+    }
+
+    // The SysDir of the saved copy must list all files as soon as commit() returned
+    AltoFS copy(saved.c_str());
+    const std::string sysdir = read_sysdir(copy);
+    int found = 0;
+    for (int i = 0; i < nfiles; i++)
+    {
+        if (sysdir.find(file_name(i) + ".") != std::string::npos)
+        {
+            found++;
+        }
+    }
+
+    printf("%d of %d files found in the SysDir of %s\n", found, nfiles, saved.c_str());
+    return found == nfiles ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+/*******************************************************************************************
+ *
+ * Helpers shared by the regression tests
+ *
+ *******************************************************************************************/
+#if !defined(_TEST_UTIL_H_)
+#define _TEST_UTIL_H_
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "altofs.h"
+
+/**
+ * @brief Copy a file
+ * @param from name of the file to copy
+ * @param to name of the copy
+ * @return true on success
+ */
+inline bool copy_file(const std::string& from, const std::string& to)
+{
+    FILE* in = fopen(from.c_str(), "rb");
+    FILE* out = in ? fopen(to.c_str(), "wb") : NULL;
+    bool ok = in && out;
+    std::vector<char> buf(65536);
+    size_t n;
+    while (ok && (n = fread(buf.data(), 1, buf.size(), in)) > 0)
+    {
+        ok = fwrite(buf.data(), 1, n, out) == n;
+    }
+    if (in)
+        fclose(in);
+    if (out && fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+/**
+ * @brief Find the last free pages of a disk image
+ * Changing their data words doesn't touch any file.
+ * @param disk mapped disk image
+ * @param count number of pages to find
+ * @return page numbers, fewer than count if there are not enough free pages
+ */
+inline std::vector<page_t> free_pages(const afs_diskimage& disk, size_t count)
+{
+    std::vector<page_t> pages;
+    for (page_t vda = (page_t)disk.npages() - 1; vda > 0 && pages.size() < count; vda--)
+    {
+        const afs_label_t* l = reinterpret_cast<const afs_label_t*>(disk.page(vda)->label);
+        if (l->fid_file == 0xffff && l->fid_dir == 0xffff && l->fid_id == 0xffff)
+        {
+            pages.push_back(vda);
+        }
+    }
+    return pages;
+}
+
+#endif // !defined(_TEST_UTIL_H_)